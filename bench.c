@@ -0,0 +1,494 @@
+/*
+   Load generator for server.c, prints one JSON line per run.
+   To compile:
+   $ gcc -obench -D[DEFINE] bench.c selectpoll.c selectfdset.c selectepoll.c selecturing.c socketunix.c error.c -lpthread
+   with the same [DEFINE] as server.c.
+   To run:
+   $ ./srv 5000 1 echo &
+   $ ./bench -m echo -c 1000 -s 64 -d 10 127.0.0.1 5000
+   or with -u <path> instead of the host and port over a Unix socket,
+   @name for the abstract namespace.
+   Modes:
+   echo      - every connection keeps -p messages in flight and sends the
+               next one when its own comes back (server in echo mode)
+   broadcast - -S connections send like in echo mode, every connection
+               counts the messages it gets (server in broadcast mode)
+   churn     - every connection connects, sends one message, waits for it
+               and reconnects, latency includes the connect
+   A message is -s bytes: send time, connection id, sequence number, padding.
+*/
+
+#include <assert.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "debug.h"
+#include "socket.h"
+#include "selectpoll.h"
+
+#define MODE_ECHO 0
+#define MODE_BROADCAST 1
+#define MODE_CHURN 2
+
+#define HEADER_SIZE 16 /* timestamp, id, sequence */
+#define BUCKETS (64 * 16) /* log-linear latency histogram, ~6% precision */
+#define MAX_EVENTS 256
+#define RECV_SIZE (64 * 1024)
+
+struct BenchConn {
+    Socket* sock;
+    unsigned id;
+    unsigned seq;
+    int connecting; /* connect is in progress */
+    int sender; /* sends messages, all do except in broadcast mode */
+    int inflight; /* own messages sent and not received back */
+    unsigned events; /* registered SELECT_POLL_XXX */
+    unsigned long long connectStart; /* ns */
+    char* in; /* partial message */
+    unsigned inLength;
+    char* out; /* messages not sent yet */
+    unsigned outLength;
+    unsigned outOffset;
+};
+
+struct BenchStats {
+    unsigned long long messages; /* own messages back, deliveries in broadcast mode */
+    unsigned long long bytes; /* received */
+    unsigned long long sent;
+    unsigned long long connects;
+    unsigned long long errors;
+    unsigned long long latency[BUCKETS];
+};
+
+struct BenchThread {
+    pthread_t thread;
+    struct SelectPoll* poll;
+    struct BenchConn* conn;
+    int count;
+    char* buffer;
+    struct BenchStats stats;
+};
+
+static int mode = MODE_ECHO;
+static int connections = 100;
+static unsigned size = 64;
+static int depth = 1;
+static int senders = 1;
+static int threads = 1;
+static double duration = 10;
+static double warmup = 1;
+static unsigned int address; /* host order */
+static unsigned short port;
+static const char* path = NULL; /* Unix socket instead of address and port */
+static volatile int running = 1; /* senders stop after duration */
+static volatile int measuring = 0; /* samples are counted after warmup */
+
+static void terminate(const char* fmt, ...);
+
+static unsigned long long now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int bucketOf(unsigned long long ns)
+{
+    int msb;
+
+    if (ns < 16)
+        return (int)ns;
+    msb = 63 - __builtin_clzll(ns);
+    return (msb - 3) * 16 + (int)((ns >> (msb - 4)) & 15);
+}
+
+/* the middle of the bucket */
+static unsigned long long valueOf(int bucket)
+{
+    int msb;
+
+    if (bucket < 16)
+        return bucket;
+    msb = bucket / 16 + 3;
+    return ((16ULL + bucket % 16) << (msb - 4)) + ((1ULL << (msb - 4)) >> 1);
+}
+
+static unsigned long long percentile(const struct BenchStats* stats, double p)
+{
+    unsigned long long total = 0, seen = 0, target;
+    int i;
+
+    for (i = 0; i < BUCKETS; i++)
+        total += stats->latency[i];
+    if (total == 0)
+        return 0;
+    target = (unsigned long long)(p * total);
+    if (target == 0)
+        target = 1;
+    for (i = 0; i < BUCKETS; i++) {
+        seen += stats->latency[i];
+        if (seen >= target)
+            return valueOf(i);
+    }
+    return valueOf(BUCKETS - 1);
+}
+
+static void setEvents(struct BenchThread* t, struct BenchConn* c, unsigned events)
+{
+    if (c->events == events)
+        return;
+    if (selectPollModify(t->poll, *(int*)c->sock, events, c) == 0)
+        c->events = events;
+}
+
+static int connectConn(struct BenchThread* t, struct BenchConn* c)
+{
+    int rc;
+
+    c->sock = socketConstruct();
+    if (c->sock == NULL)
+        return -1;
+    if (path != NULL)
+        socketSetPath(path, c->sock); /* checked by main */
+    else
+        socketSetAddress(address, port, c->sock);
+    if ((socketCreate(c->sock) == -1) || (socketSetBlocking(0, c->sock) == -1)) {
+        debugPrintf("socket: %s", socketError(c->sock));
+        socketDestroy(c->sock);
+        c->sock = NULL;
+        return -1;
+    }
+    c->connectStart = now();
+    rc = socketConnect(c->sock);
+    if ((rc == -1) || (selectPollAdd(t->poll, *(int*)c->sock, SELECT_POLL_IN | SELECT_POLL_OUT, c) == -1)) {
+        debugPrintf("socketConnect: %s", socketError(c->sock));
+        socketClose(c->sock);
+        socketDestroy(c->sock);
+        c->sock = NULL;
+        return -1;
+    }
+    c->events = SELECT_POLL_IN | SELECT_POLL_OUT;
+    c->connecting = 1;
+    c->inflight = 0;
+    c->inLength = c->outLength = c->outOffset = 0;
+    return 0;
+}
+
+static void closeConn(struct BenchThread* t, struct BenchConn* c)
+{
+    selectPollRemove(t->poll, *(int*)c->sock);
+    socketClose(c->sock);
+    socketDestroy(c->sock);
+    c->sock = NULL;
+}
+
+static void flushConn(struct BenchThread* t, struct BenchConn* c)
+{
+    int rc;
+
+    while (c->outOffset < c->outLength) {
+        rc = socketSend(c->sock, c->out + c->outOffset, c->outLength - c->outOffset, 0);
+        if (rc <= 0)
+            break;
+        c->outOffset += rc;
+        t->stats.sent += rc;
+    }
+    if (c->outOffset == c->outLength)
+        c->outOffset = c->outLength = 0;
+    setEvents(t, c, (c->outLength != 0) ? SELECT_POLL_IN | SELECT_POLL_OUT : SELECT_POLL_IN);
+}
+
+static void sendMessage(struct BenchThread* t, struct BenchConn* c)
+{
+    char* msg = c->out + c->outLength;
+    unsigned long long ts = now();
+
+    memcpy(msg, &ts, sizeof(ts));
+    memcpy(msg + 8, &c->id, sizeof(c->id));
+    memcpy(msg + 12, &c->seq, sizeof(c->seq));
+    c->seq++;
+    c->outLength += size;
+    c->inflight++;
+}
+
+static void sendMore(struct BenchThread* t, struct BenchConn* c)
+{
+    if (!c->sender || !running)
+        return;
+    while ((c->inflight < depth) && (c->outLength + size <= depth * size))
+        sendMessage(t, c);
+    flushConn(t, c);
+}
+
+static void sample(struct BenchThread* t, unsigned long long since)
+{
+    unsigned long long ns = now();
+
+    if (!measuring)
+        return;
+    t->stats.messages++;
+    t->stats.latency[bucketOf((ns > since) ? ns - since : 0)]++;
+}
+
+/* returns -1 if the connection has been closed */
+static int handleMessage(struct BenchThread* t, struct BenchConn* c, const char* msg)
+{
+    unsigned long long ts;
+    unsigned id;
+
+    memcpy(&ts, msg, sizeof(ts));
+    memcpy(&id, msg + 8, sizeof(id));
+    if (mode == MODE_BROADCAST) {
+        sample(t, ts);
+        if (id == c->id) {
+            c->inflight--;
+            sendMore(t, c);
+        }
+        return 0;
+    }
+    if (id != c->id) /* echo server is expected, but ignore others anyway */
+        return 0;
+    c->inflight--;
+    if (mode == MODE_CHURN) {
+        sample(t, c->connectStart);
+        closeConn(t, c);
+        if (running && (connectConn(t, c) == -1))
+            t->stats.errors++;
+        return -1;
+    }
+    sample(t, ts);
+    sendMore(t, c);
+    return 0;
+}
+
+static void readConn(struct BenchThread* t, struct BenchConn* c)
+{
+    int rc, i;
+
+    rc = socketRecv(c->sock, t->buffer, RECV_SIZE, 0);
+    if (rc <= 0) {
+        if ((rc == -1) && ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)))
+            return;
+        t->stats.errors++;
+        closeConn(t, c);
+        return;
+    }
+    if (measuring)
+        t->stats.bytes += rc;
+    for (i = 0; i < rc; ) { /* split the stream into messages */
+        unsigned part = size - c->inLength;
+        if (part > (unsigned)(rc - i))
+            part = rc - i;
+        memcpy(c->in + c->inLength, t->buffer + i, part);
+        c->inLength += part;
+        i += part;
+        if (c->inLength < size)
+            break;
+        c->inLength = 0;
+        if (handleMessage(t, c, c->in) == -1)
+            return;
+    }
+}
+
+static void* benchThread(void* arg)
+{
+    struct BenchThread* t = arg;
+    struct SelectPollEvent events[MAX_EVENTS];
+    int i, n;
+
+    for (i = 0; i < t->count; i++) {
+        if (connectConn(t, &t->conn[i]) == -1)
+            t->stats.errors++;
+    }
+    while (running) { /* messages still in flight are not measured anyway */
+        n = selectPollWait(t->poll, events, MAX_EVENTS, 100);
+        if (n == -1) {
+            perror("poll");
+            break;
+        }
+        for (i = 0; i < n; i++) {
+            struct BenchConn* c = events[i].data;
+            if (c->sock == NULL)
+                continue;
+            if (c->connecting && (events[i].events & SELECT_POLL_OUT)) {
+                c->connecting = 0;
+                if (measuring)
+                    t->stats.connects++;
+                setEvents(t, c, SELECT_POLL_IN);
+                if (mode == MODE_CHURN) {
+                    sendMessage(t, c);
+                    flushConn(t, c);
+                } else {
+                    sendMore(t, c);
+                }
+                continue;
+            }
+            if (events[i].events & SELECT_POLL_IN)
+                readConn(t, c);
+            if ((c->sock != NULL) && (events[i].events & SELECT_POLL_OUT))
+                flushConn(t, c);
+        }
+    }
+    for (i = 0; i < t->count; i++)
+        if (t->conn[i].sock != NULL)
+            closeConn(t, &t->conn[i]);
+    return NULL;
+}
+
+static void resolve(const char* host)
+{
+    struct addrinfo hints, *ainfo;
+    struct in_addr in;
+
+    if (inet_pton(AF_INET, host, &in) != 1) {
+        bzero(&hints, sizeof(hints));
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        if (getaddrinfo(host, NULL, &hints, &ainfo) != 0)
+            terminate("Can't resolve %s!", host);
+        in = ((struct sockaddr_in*)ainfo->ai_addr)->sin_addr;
+        freeaddrinfo(ainfo);
+    }
+    address = ntohl(in.s_addr);
+}
+
+static void report(const struct BenchStats* total, double seconds)
+{
+    static const char* names[] = { "echo", "broadcast", "churn" };
+
+    printf("{\"mode\":\"%s\",\"connections\":%d,\"size\":%u,\"depth\":%d,\"senders\":%d,\"threads\":%d,"
+        "\"seconds\":%.3f,\"messages\":%llu,\"msgs_per_sec\":%.1f,\"mb_per_sec\":%.3f,"
+        "\"connects_per_sec\":%.1f,\"p50_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f,\"errors\":%llu}\n",
+        names[mode], connections, size, depth, (mode == MODE_BROADCAST) ? senders : connections, threads,
+        seconds, total->messages, total->messages / seconds, total->bytes / seconds / (1024 * 1024),
+        total->connects / seconds, percentile(total, 0.5) / 1000.0, percentile(total, 0.99) / 1000.0,
+        percentile(total, 0.999) / 1000.0, total->errors);
+    fflush(stdout);
+}
+
+static void usage(const char* name)
+{
+    terminate("Usage: %s [-m echo|broadcast|churn] [-c connections] [-s size] [-p depth]\n"
+        "    [-S senders] [-t threads] [-d seconds] [-w warmup seconds] <host> <port> | -u <path>", name);
+}
+
+int main(int argc, char* argv[])
+{
+    struct BenchThread* t;
+    struct BenchStats total;
+    unsigned long long start;
+    double seconds;
+    Socket* check;
+    int opt, i, j, id = 0;
+
+    while ((opt = getopt(argc, argv, "m:c:s:p:S:t:d:w:u:")) != -1) {
+        switch (opt) {
+        case 'm':
+            if (strcmp(optarg, "echo") == 0) mode = MODE_ECHO;
+            else if (strcmp(optarg, "broadcast") == 0) mode = MODE_BROADCAST;
+            else if (strcmp(optarg, "churn") == 0) mode = MODE_CHURN;
+            else usage(argv[0]);
+            break;
+        case 'c': connections = atoi(optarg); break;
+        case 's': size = (unsigned)atoi(optarg); break;
+        case 'p': depth = atoi(optarg); break;
+        case 'S': senders = atoi(optarg); break;
+        case 't': threads = atoi(optarg); break;
+        case 'd': duration = atof(optarg); break;
+        case 'w': warmup = atof(optarg); break;
+        case 'u': path = optarg; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (argc - optind != ((path != NULL) ? 0 : 2))
+        usage(argv[0]);
+    if ((connections < 1) || (size < HEADER_SIZE) || (depth < 1) || (threads < 1) || (duration <= 0))
+        terminate("Connections, depth and threads must be positive, size at least %d!", HEADER_SIZE);
+    if (mode == MODE_CHURN)
+        depth = 1;
+    if (threads > connections)
+        threads = connections;
+    if (path == NULL) {
+        resolve(argv[optind]);
+        port = (unsigned short)atoi(argv[optind + 1]);
+    } else {
+        check = socketConstruct();
+        if ((check == NULL) || (socketSetPath(path, check) == -1))
+            terminate("Can't use path %s!", path);
+        socketDestroy(check);
+    }
+    signal(SIGPIPE, SIG_IGN);
+    t = calloc(threads, sizeof(*t));
+    if (t == NULL) terminate("Can't allocate memory!");
+    for (i = 0; i < threads; i++) { /* connections are spread evenly */
+        t[i].count = connections / threads + (i < connections % threads);
+        t[i].conn = calloc(t[i].count, sizeof(struct BenchConn));
+        t[i].buffer = malloc(RECV_SIZE);
+        t[i].poll = selectPollCreate(MAX_EVENTS, RECV_SIZE);
+        if ((t[i].conn == NULL) || (t[i].buffer == NULL) || (t[i].poll == NULL))
+            terminate("Can't allocate memory!");
+        for (j = 0; j < t[i].count; j++, id++) {
+            struct BenchConn* c = &t[i].conn[j];
+            c->id = id;
+            c->sender = (mode != MODE_BROADCAST) || (id < senders);
+            c->in = malloc(size);
+            c->out = malloc(depth * size);
+            if ((c->in == NULL) || (c->out == NULL))
+                terminate("Can't allocate memory!");
+        }
+    }
+    for (i = 0; i < threads; i++)
+        if (pthread_create(&t[i].thread, NULL, benchThread, &t[i]) != 0)
+            terminate("Can't create thread!");
+    usleep((useconds_t)(warmup * 1000000));
+    start = now();
+    measuring = 1;
+    usleep((useconds_t)(duration * 1000000));
+    measuring = 0;
+    seconds = (now() - start) / 1e9;
+    running = 0;
+    for (i = 0; i < threads; i++)
+        pthread_join(t[i].thread, NULL);
+    bzero(&total, sizeof(total));
+    for (i = 0; i < threads; i++) {
+        total.messages += t[i].stats.messages;
+        total.bytes += t[i].stats.bytes;
+        total.sent += t[i].stats.sent;
+        total.connects += t[i].stats.connects;
+        total.errors += t[i].stats.errors;
+        for (j = 0; j < BUCKETS; j++)
+            total.latency[j] += t[i].stats.latency[j];
+        selectPollDestroy(t[i].poll);
+        for (j = 0; j < t[i].count; j++) {
+            free(t[i].conn[j].in);
+            free(t[i].conn[j].out);
+        }
+        free(t[i].conn);
+        free(t[i].buffer);
+    }
+    free(t);
+    report(&total, seconds);
+    return 0;
+}
+
+static void terminate(const char* fmt, ...)
+{
+    char str[BUFSIZ+1];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(str, BUFSIZ, fmt, ap);
+    va_end(ap);
+    fprintf(stderr, "%s\n", str);
+    exit(1);
+}
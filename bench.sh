@@ -0,0 +1,81 @@
+#!/bin/sh
+# Runs bench against server.c over loopback for a matrix of settings,
+# one JSON line per run, so results of two releases can be diffed.
+# usage: bench.sh [srv binary] [bench binary] > results.jsonl
+# environment: PORT, LOOPS, SECONDS_PER_RUN, CONNECTIONS, SIZES, THREADS,
+# PROFILES (socket profiles of server.c, every line is tagged with its own),
+# RELAY=0 skips echo through a relay (server mode relay:PORT+1),
+# UNIX=0 skips echo over a Unix socket (@srvPORT, LOOPS=1 only), e.g.
+# PROFILES="nodelay=1 nodelay=1,splice=0 nodelay=1,zerocopy=16384"
+# compares splice and copying relays and MSG_ZEROCOPY sends.
+
+SRV=${1:-./srv}
+BENCH=${2:-./bench}
+PORT=${PORT:-5000}
+LOOPS=${LOOPS:-1}
+SECONDS_PER_RUN=${SECONDS_PER_RUN:-10}
+CONNECTIONS=${CONNECTIONS:-"10 100 1000"}
+SIZES=${SIZES:-"64 1024 16384"}
+THREADS=${THREADS:-1}
+PROFILES=${PROFILES:-default}
+RELAY=${RELAY:-1}
+UNIX=${UNIX:-1}
+
+start() { # port, server mode
+    if [ "$profile" = default ]; then
+        "$SRV" "$1" "$LOOPS" "$2" 2>/dev/null &
+    else
+        "$SRV" "$1" "$LOOPS" "$2" "$profile" 2>/dev/null &
+    fi
+}
+
+run() { # server mode, bench arguments
+    start "$PORT" "$1"
+    pid=$!
+    sleep 0.5
+    mode=$1
+    shift
+    "$BENCH" -t "$THREADS" -d "$SECONDS_PER_RUN" "$@" 127.0.0.1 "$PORT" |
+        sed "s/^{/{\"profile\":\"$profile\",\"server\":\"$mode\",\"transport\":\"tcp\",/"
+    kill "$pid"
+    wait "$pid" 2>/dev/null || true
+}
+
+unix() { # bench arguments, echo server listening on TCP and Unix sockets
+    start "$PORT,@srv$PORT" echo
+    pid=$!
+    sleep 0.5
+    "$BENCH" -t "$THREADS" -d "$SECONDS_PER_RUN" "$@" -u "@srv$PORT" |
+        sed "s/^{/{\"profile\":\"$profile\",\"server\":\"echo\",\"transport\":\"unix\",/"
+    kill "$pid"
+    wait "$pid" 2>/dev/null || true
+}
+
+relay() { # bench arguments, echo server behind the relay
+    start $((PORT + 1)) echo
+    echo_pid=$!
+    run relay:$((PORT + 1)) "$@"
+    kill "$echo_pid"
+    wait "$echo_pid" 2>/dev/null || true
+}
+
+for profile in $PROFILES; do
+    for c in $CONNECTIONS; do
+        for s in $SIZES; do
+            run echo -m echo -c "$c" -s "$s"
+            run echo -m echo -c "$c" -s "$s" -p 16
+            run broadcast -m broadcast -c "$c" -s "$s" -S 1 -p 16
+        done
+        run echo -m churn -c "$c" -s 64
+        if [ "$UNIX" = 1 ] && [ "$LOOPS" = 1 ]; then
+            for s in $SIZES; do
+                unix -m echo -c "$c" -s "$s"
+            done
+        fi
+        if [ "$RELAY" = 1 ]; then
+            for s in $SIZES; do
+                relay -m echo -c "$c" -s "$s"
+            done
+        fi
+    done
+done
@@ -0,0 +1,1387 @@
+/*
+   Checks of the select loop, each against a server running in this
+   process over loopback.
+   To compile:
+   $ gcc -ocheck -D[DEFINE] check.c selectunix.c selectpoll.c selectfdset.c selectepoll.c selecturing.c pool.c queue.c socketunix.c timer.c topic.c trace.c error.c -lpthread
+   with the same [DEFINE] as server.c, or see check.sh.
+   To run:
+   $ ./check [port]
+   uses CHECK_PORTS ports from port (5100 by default), prints every failed
+   check and exits with 1 if any has failed.
+*/
+
+#include <assert.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pool.h"
+#include "socket.h"
+#include "queue.h"
+#include "select.h"
+#include "timer.h"
+
+#define CHECK_PORTS 30 /* the most servers started by one run */
+#define WAIT_MS 5000 /* for a server or the data of a check */
+#define MESSAGE_SIZE 1024 /* of the fill server */
+#define SMALL_BUFFER 4096 /* SO_SNDBUF and SO_RCVBUF, so output queues up in the loop */
+#define RECORDS 5000 /* sent by the flush server, "%07d\n" each */
+#define SLOT_CONNECTIONS 20
+#define WHEEL_TIMERS 14
+#define TOPICS 300
+#define WORKER_CONNECTIONS 50
+#define WORKER_DELAY_US 20000 /* a job runs long enough for the client to reset its connection */
+
+/* one server of a check, its loop runs in own thread */
+struct CheckServer {
+    pthread_t thread;
+    Socket* listen[3]; /* Unix ones first, then TCP on port */
+    int listenCount;
+    unsigned short port;
+    SelectOptions options;
+    SelectHandlers handlers;
+    int limit; /* messages sent on "fill", until selectSend fails if 0 */
+    /* results of the last "fill", valid once done is set */
+    int done;
+    int sent;
+    int dropped;
+    unsigned long bytesUsed; /* the most output queued in the loop meanwhile */
+    unsigned long blockSize; /* of the pool holding it */
+    int timeout; /* reason of the last serverTimeout, 0 if none */
+};
+
+/* data of a connection of the worker server, not freed, so late use is seen */
+struct CheckConn {
+    int alive; /* cleared by the last callback of the connection */
+    int started, finished; /* jobs */
+};
+
+/* timer of the wheel check, fired at the simulated time when it came */
+struct CheckTimer {
+    Timer timer;
+    unsigned long long fired;
+    int count;
+};
+
+static int checks = 0;
+static int failures = 0;
+static unsigned long flushSent = 0; /* bytes reported by serverSentOk, changed atomically */
+static const Socket* slotSock[SLOT_CONNECTIONS * 2]; /* of the slot server by slot, used by its loop only */
+static int slotClosed = 0;
+static unsigned long long wheelTime; /* simulated ms of the wheel check */
+static int loopTicks = 0; /* of the periodic timer of the timer server */
+static SelectTimer* loopTicker = NULL; /* used by its loop only */
+static int upstreamAccepts = 0;
+static unsigned short upstreamPort, silentPort, closedPort; /* of the connect check */
+/* of the eager server, changed by its loop only */
+static int eagerInside = 0; /* in serverRecvOk */
+static int eagerWritten = 0; /* replies sent by selectSend itself */
+static int eagerEarly = 0; /* serverSentOk calls from inside selectSend */
+static int eagerReported = 0; /* serverSentOk calls, changed atomically */
+static unsigned long duplexReceived = 0; /* by the duplex server, changed atomically */
+static int duplexOverlapped = 0; /* reads of the duplex server while its output was queued */
+static int workerFailures = 0; /* counted by workers and the loop, changed atomically */
+static struct CheckConn workerConn[WORKER_CONNECTIONS + 16];
+static int workerConnCount = 0;
+static int workerClosed = 0;
+static const Socket* pauseSink = NULL; /* of the pause server, used by its loop only */
+static unsigned short firstPort, nextPort;
+
+static void terminate(const char* fmt, ...);
+
+#define check(condition) checkResult((condition), #condition, __LINE__)
+
+static void checkResult(int ok, const char* text, int line)
+{
+    checks++;
+    if (ok)
+        return;
+    failures++;
+    fprintf(stderr, "check.c:%d: failed: %s\n", line, text);
+}
+
+static unsigned long long now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+/* waits until *count, changed by another thread, reaches value, returns it */
+static int waitCount(const int* count, int value)
+{
+    unsigned long long until = now() + WAIT_MS;
+
+    while ((__atomic_load_n(count, __ATOMIC_ACQUIRE) < value) && (now() < until))
+        usleep(1000);
+    return __atomic_load_n(count, __ATOMIC_ACQUIRE);
+}
+
+/* the server has closed the connection, by FIN or RST */
+static int closedByServer(int fd)
+{
+    char byte;
+    ssize_t rc = recv(fd, &byte, 1, 0);
+
+    return (rc == 0) || ((rc == -1) && (errno == ECONNRESET));
+}
+
+static void* serverThread(void* arg)
+{
+    struct CheckServer* server = arg;
+
+    if (selectServerListeners((const Socket**)server->listen, server->listenCount, &server->options) == -1)
+        terminate("Server has failed: %s!", strerror(errno));
+    return NULL;
+}
+
+/* on the next free port, the server runs until the process exits */
+static void startServer(struct CheckServer* server)
+{
+    Socket* listen = socketConstruct();
+
+    if (listen == NULL) terminate("Can't allocate memory!");
+    if ((socketCreate(listen) == -1) || (socketSetBlocking(0/*false*/, listen) == -1)
+            || (socketSetOptReuse(listen) == -1))
+        terminate("Can't create socket: %s!", socketError(listen));
+    server->port = nextPort++;
+    socketSetPort(server->port, listen);
+    if ((socketBind(listen) == -1) || (socketListen(listen) == -1))
+        terminate("Can't listen on port %u: %s!", (unsigned)server->port, socketError(listen));
+    assert(server->listenCount < (int)(sizeof(server->listen) / sizeof(server->listen[0])));
+    server->listen[server->listenCount++] = listen;
+    server->options.handlers = &server->handlers;
+    server->options.user = server;
+    if (pthread_create(&server->thread, NULL, serverThread, server) != 0)
+        terminate("Can't create thread!");
+    pthread_detach(server->thread);
+}
+
+/* blocking client socket, rcvbuf is SO_RCVBUF if not 0 */
+static int connectTo(unsigned short port, int rcvbuf)
+{
+    struct sockaddr_in addr;
+    struct timeval timeout = { WAIT_MS / 1000, 0 };
+    int fd = socket(AF_INET, SOCK_STREAM, 0), one = 1;
+
+    if (fd == -1) terminate("Can't create socket: %s!", strerror(errno));
+    if (rcvbuf != 0)
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1)
+        terminate("Can't connect to port %u: %s!", (unsigned)port, strerror(errno));
+    return fd;
+}
+
+static void sendAll(int fd, const char* data, unsigned long size)
+{
+    ssize_t rc;
+
+    for ( ; size > 0; data += rc, size -= rc) {
+        rc = send(fd, data, size, 0);
+        if (rc == -1) terminate("Can't send: %s!", strerror(errno));
+    }
+}
+
+/* bytes received up to size, less if closed or nothing came for WAIT_MS */
+static unsigned long recvAll(int fd, char* data, unsigned long size)
+{
+    unsigned long got = 0;
+    char sink[4096];
+    ssize_t rc;
+
+    while (got < size) {
+        if (data != NULL)
+            rc = recv(fd, data + got, size - got, 0);
+        else
+            rc = recv(fd, sink, (size - got < sizeof(sink)) ? size - got : sizeof(sink), 0);
+        if (rc <= 0)
+            break;
+        got += rc;
+    }
+    return got;
+}
+
+static void echoRecv(const Socket* sock, void* data, char* buffer, unsigned size, const void* context)
+{
+    selectSend(sock, buffer, size, context);
+}
+
+/* chunks across a partial send, as the loop consumes them */
+static void checkQueue(void)
+{
+    struct iovec iov[4];
+    Queue queue;
+
+    queueInit(&queue, NULL);
+    check((queuePush(&queue, "abc", 3) == 0) && (queuePush(&queue, "de", 2) == 0)
+        && (queuePush(&queue, "fgh", 3) == 0));
+    check(queue.bytes == 8);
+    check(queueIovec(&queue, iov, 4) == 3);
+    check(queueIovec(&queue, iov, 2) == 2);
+    queueConsume(&queue, 4); /* into the second chunk */
+    check(queue.bytes == 4);
+    check(queueIovec(&queue, iov, 4) == 2);
+    check((iov[0].iov_len == 1) && (memcmp(iov[0].iov_base, "e", 1) == 0));
+    check((iov[1].iov_len == 3) && (memcmp(iov[1].iov_base, "fgh", 3) == 0));
+    queueConsume(&queue, 4);
+    check((queue.bytes == 0) && (queue.head == NULL) && (queue.tail == NULL));
+    check(queuePush(&queue, "i", 1) == 0); /* the emptied queue is usable again */
+    check((queueIovec(&queue, iov, 4) == 1) && (iov[0].iov_len == 1));
+    queueClear(&queue);
+}
+
+/* sends RECORDS numbered records at once, many more than the socket takes */
+static void flushRecv(const Socket* sock, void* data, char* buffer, unsigned size, const void* context)
+{
+    char record[9];
+    int i;
+
+    for (i = 0; i < RECORDS; i++) {
+        snprintf(record, sizeof(record), "%07d\n", i);
+        selectSend(sock, record, 8, context);
+    }
+}
+
+static void flushSentOk(const Socket* sock, void* data, char* buffer, unsigned size, const void* context)
+{
+    __atomic_fetch_add(&flushSent, size, __ATOMIC_RELEASE);
+}
+
+/* queued output is sent whole and in order by gather sends */
+static void checkQueueFlush(void)
+{
+    static struct CheckServer server;
+    static char in[RECORDS * 8];
+    char record[9];
+    int fd, i, ordered = 1;
+
+    memset(&server, 0, sizeof(server));
+    selectOptionsInit(&server.options);
+    server.options.profile.sendBuffer = SMALL_BUFFER;
+    server.handlers.serverRecvOk = flushRecv;
+    server.handlers.serverSentOk = flushSentOk;
+    startServer(&server);
+    fd = connectTo(server.port, SMALL_BUFFER);
+    sendAll(fd, "go", 2);
+    usleep(100000); /* the rest waits in the queue meanwhile */
+    check(recvAll(fd, in, sizeof(in)) == sizeof(in));
+    for (i = 0; (i < RECORDS) && ordered; i++) {
+        snprintf(record, sizeof(record), "%07d\n", i);
+        ordered = (memcmp(in + i * 8, record, 8) == 0);
+    }
+    check(ordered);
+    for (i = 0; (i < 1000) && (__atomic_load_n(&flushSent, __ATOMIC_ACQUIRE) < sizeof(in)); i++)
+        usleep(1000);
+    check(__atomic_load_n(&flushSent, __ATOMIC_ACQUIRE) == sizeof(in));
+    close(fd);
+}
+
+static void slotConnect(const Socket* sock, const void* context)
+{
+    int slot = selectSlot(sock, context);
+
+    if (slot < (int)(sizeof(slotSock) / sizeof(slotSock[0])))
+        slotSock[slot] = sock;
+}
+
+static void slotDisconnect(const Socket* sock, void* data, const void* context)
+{
+    int slot = selectSlot(sock, context);
+
+    if (slot < (int)(sizeof(slotSock) / sizeof(slotSock[0])))
+        slotSock[slot] = NULL;
+    __atomic_fetch_add(&slotClosed, 1, __ATOMIC_RELEASE);
+}
+
+/* "?" gets the slot and serial of the connection, ">slot" sends "hi" to the one in slot */
+static void slotRecv(const Socket* sock, void* data, char* buffer, unsigned size, const void* context)
+{
+    SelectHandle handle;
+    char reply[32];
+    int slot;
+
+    if (size >= sizeof(reply))
+        return;
+    if (buffer[0] == '?') {
+        selectHandle(sock, context, &handle);
+        snprintf(reply, sizeof(reply), "%4d %10u\n", handle.slot, handle.serial);
+        selectSend(sock, reply, 16, context);
+    } else if (buffer[0] == '>') {
+        memcpy(reply, buffer + 1, size - 1); /* not terminated */
+        reply[size - 1] = 0;
+        slot = atoi(reply);
+        if ((slot >= 0) && (slot < (int)(sizeof(slotSock) / sizeof(slotSock[0]))) && (slotSock[slot] != NULL))
+            selectSend(slotSock[slot], "hi", 2, context);
+    }
+}
+
+/* slot and serial of the connection fd */
+static void askSlot(int fd, int* slot, unsigned* serial)
+{
+    char reply[17];
+
+    sendAll(fd, "?", 1);
+    reply[16] = 0;
+    if (recvAll(fd, reply, 16) != 16) {
+        *slot = -1;
+        *serial = 0;
+        return;
+    }
+    *slot = atoi(reply);
+    *serial = (unsigned)strtoul(reply + 5, NULL, 10);
+}
+
+/* slots are compact, freed ones are reused first by a new serial, sends find them */
+static void checkSlots(void)
+{
+    static struct CheckServer server;
+    int fd[SLOT_CONNECTIONS], slot[SLOT_CONNECTIONS], used[SLOT_CONNECTIONS];
+    unsigned serial[SLOT_CONNECTIONS], oldSerial[SLOT_CONNECTIONS];
+    int i, reused = 1, distinct = 1, newSerial = 1;
+    char hi[2], command[16];
+
+    memset(&server, 0, sizeof(server));
+    selectOptionsInit(&server.options);
+    server.handlers.serverConnect = slotConnect;
+    server.handlers.serverDisconnect = slotDisconnect;
+    server.handlers.serverRecvOk = slotRecv;
+    startServer(&server);
+    memset(used, 0, sizeof(used));
+    for (i = 0; i < SLOT_CONNECTIONS; i++) {
+        fd[i] = connectTo(server.port, 0);
+        askSlot(fd[i], &slot[i], &serial[i]);
+        if ((slot[i] < 0) || (slot[i] >= SLOT_CONNECTIONS) || used[slot[i]])
+            distinct = 0;
+        else
+            used[slot[i]] = 1;
+    }
+    check(distinct);
+    /* every fifth goes, the new ones take their slots */
+    memset(used, 0, sizeof(used));
+    for (i = 0; i < SLOT_CONNECTIONS; i += 5) {
+        used[slot[i]] = 1; /* freed */
+        oldSerial[slot[i]] = serial[i];
+        close(fd[i]);
+    }
+    check(waitCount(&slotClosed, SLOT_CONNECTIONS / 5) == SLOT_CONNECTIONS / 5);
+    for (i = 0; i < SLOT_CONNECTIONS; i += 5) {
+        fd[i] = connectTo(server.port, 0);
+        askSlot(fd[i], &slot[i], &serial[i]);
+        if ((slot[i] < 0) || (slot[i] >= SLOT_CONNECTIONS) || !used[slot[i]]) {
+            reused = 0;
+            continue;
+        }
+        used[slot[i]] = 0;
+        if (serial[i] == oldSerial[slot[i]])
+            newSerial = 0;
+    }
+    check(reused);
+    check(newSerial);
+    /* the last connection reaches each one by its slot */
+    for (i = 0; i < SLOT_CONNECTIONS - 1; i++) {
+        snprintf(command, sizeof(command), ">%d", slot[i]);
+        sendAll(fd[SLOT_CONNECTIONS - 1], command, strlen(command));
+        check((recvAll(fd[i], hi, 2) == 2) && (memcmp(hi, "hi", 2) == 0));
+    }
+    for (i = 0; i < SLOT_CONNECTIONS; i++)
+        close(fd[i]);
+}
+
+/* budget shared by two pools, what one gives back the other may take */
+static void checkPool(void)
+{
+    PoolBudget budget;
+    Pool a, b;
+    void* block;
+
+    poolBudgetInit(&budget, 256 * 1024);
+    poolInit(&a, 4096, &budget);
+    poolInit(&b, 4096, &budget);
+    check(poolCharge(&a, 200 * 1024) == 0);
+    check(poolCharge(&b, 100 * 1024) == -1);
+    check(b.bytesUsed == 0);
+    poolRefund(&a, 200 * 1024);
+    check(poolCharge(&b, 100 * 1024) == 0);
+    block = poolAlloc(&a, 4096);
+    check(block != NULL);
+    check(a.bytesUsed + b.bytesUsed <= budget.limit);
+    check(budget.reserved <= budget.limit);
+    poolFree(&a, block, 4096);
+    poolRefund(&b, 100 * 1024);
+    poolClear(&a);
+    poolClear(&b);
+    check(budget.reserved == 0);
+}
+
+/* "fill" sends limit messages, or until selectSend fails, back to the sender */
+static void fillMessage(const Socket* sock, void* data, char* message, unsigned size, const void* context)
+{
+    struct CheckServer* server = selectUser(context);
+    SelectMemoryStats stats;
+    char buffer[MESSAGE_SIZE];
+    int i;
+
+    if ((size != 4) || (memcmp(message, "fill", 4) != 0))
+        return;
+    memset(buffer, 'm', sizeof(buffer));
+    server->sent = server->dropped = 0;
+    server->bytesUsed = 0;
+    for (i = 0; (server->limit == 0) ? (server->dropped == 0) : (i < server->limit); i++) {
+        if (selectSend(sock, buffer, sizeof(buffer), context) == 0)
+            server->sent++;
+        else
+            server->dropped++;
+        selectMemoryStats(context, &stats);
+        if (stats.bytesUsed > server->bytesUsed)
+            server->bytesUsed = stats.bytesUsed;
+        server->blockSize = stats.blockSize;
+        if (i == 100000) /* the budget does not work */
+            break;
+    }
+    __atomic_store_n(&server->done, 1, __ATOMIC_RELEASE);
+}
+
+static void fillServer(struct CheckServer* server)
+{
+    memset(server, 0, sizeof(*server));
+    selectOptionsInit(&server->options);
+    server->options.framing = SELECT_FRAME_DELIMITER;
+    server->options.profile.sendBuffer = SMALL_BUFFER;
+    server->handlers.serverMessage = fillMessage;
+}
+
+/* "fill" until the budget is used up, then what has been queued is received */
+static unsigned long fill(struct CheckServer* server, int fd)
+{
+    __atomic_store_n(&server->done, 0, __ATOMIC_RELEASE);
+    sendAll(fd, "fill\n", 5);
+    if (!waitCount(&server->done, 1))
+        return 0;
+    return recvAll(fd, NULL, (unsigned long)server->sent * MESSAGE_SIZE);
+}
+
+static void checkBudget(void)
+{
+    static struct CheckServer server;
+    const unsigned long budget = 256 * 1024;
+    int fd;
+
+    fillServer(&server);
+    server.options.memoryBudget = budget;
+    startServer(&server);
+    fd = connectTo(server.port, SMALL_BUFFER);
+    check(fill(&server, fd) == (unsigned long)server.sent * MESSAGE_SIZE);
+    check(server.dropped == 1);
+    check(server.bytesUsed <= budget);
+    check(server.bytesUsed > budget / 2);
+    /* all of it has been sent, so the budget is free again */
+    check(fill(&server, fd) == (unsigned long)server.sent * MESSAGE_SIZE);
+    check((server.dropped == 1) && (server.bytesUsed > budget / 2));
+    close(fd);
+}
+
+static void checkWatermark(void)
+{
+    static struct CheckServer server, closing;
+    const unsigned long high = 64 * 1024;
+    int fd;
+
+    fillServer(&server);
+    server.options.highWatermark = high;
+    server.options.lowWatermark = 16 * 1024;
+    server.options.slowPolicy = SELECT_SLOW_DROP;
+    server.limit = 1000;
+    startServer(&server);
+    fd = connectTo(server.port, SMALL_BUFFER);
+    /* only the messages which fit are queued, and all of them arrive */
+    check(fill(&server, fd) == (unsigned long)server.sent * MESSAGE_SIZE);
+    check(server.sent + server.dropped == server.limit);
+    check(server.dropped > 0);
+    /* output is kept in blocks of maxChunkSize bytes after a header */
+    check(server.bytesUsed <= (high / server.options.maxChunkSize + 2) * server.blockSize);
+    close(fd);
+
+    /* the first message above the high watermark closes the connection */
+    fillServer(&closing);
+    closing.options.highWatermark = high;
+    closing.options.lowWatermark = 16 * 1024;
+    closing.options.slowPolicy = SELECT_SLOW_CLOSE;
+    closing.limit = 1000;
+    startServer(&closing);
+    fd = connectTo(closing.port, SMALL_BUFFER);
+    sendAll(fd, "fill\n", 5);
+    check(waitCount(&closing.done, 1) == 1);
+    check(closing.dropped > 0);
+    check(recvAll(fd, NULL, (unsigned long)closing.limit * MESSAGE_SIZE) < (unsigned long)closing.limit * MESSAGE_SIZE);
+    close(fd);
+}
+
+/* sends the message back followed by '|' */
+static void echoMessage(const Socket* sock, void* data, char* message, unsigned size, const void* context)
+{
+    if (size > 0)
+        selectSend(sock, message, size, context);
+    selectSend(sock, "|", 1, context);
+}
+
+static void frameServer(struct CheckServer* server, int framing)
+{
+    memset(server, 0, sizeof(*server));
+    selectOptionsInit(&server->options);
+    server->options.framing = framing;
+    server->options.frameLengthBytes = 2;
+    server->options.maxChunkSize = 16; /* frames span reads */
+    server->options.maxFrameSize = 40;
+    server->handlers.serverMessage = echoMessage;
+}
+
+/* the echo of what was sent matches expected */
+static int echoes(int fd, const char* sent, unsigned long sentSize, const char* expected)
+{
+    char buffer[256];
+    unsigned long size = strlen(expected);
+
+    assert(size <= sizeof(buffer));
+    sendAll(fd, sent, sentSize);
+    return (recvAll(fd, buffer, size) == size) && (memcmp(buffer, expected, size) == 0);
+}
+
+static void checkFraming(void)
+{
+    static struct CheckServer length, delimiter;
+    char frame[64];
+    int fd, i;
+
+    frameServer(&length, SELECT_FRAME_LENGTH);
+    startServer(&length);
+    frameServer(&delimiter, SELECT_FRAME_DELIMITER);
+    startServer(&delimiter);
+
+    /* a frame sent byte by byte, the length too */
+    fd = connectTo(length.port, 0);
+    for (i = 0; i < 6; i++) {
+        sendAll(fd, "\0\4ping" + i, 1);
+        usleep(10000);
+    }
+    check(echoes(fd, "", 0, "ping|"));
+    /* frames across the 16 byte reads, an empty one and the longest one */
+    memset(frame, 'x', sizeof(frame));
+    frame[0] = 0;
+    frame[1] = 40;
+    frame[42] = 0;
+    frame[43] = 0;
+    check(echoes(fd, frame, 44, "xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx||"));
+    /* one byte too long closes it before the message comes */
+    frame[1] = 41;
+    sendAll(fd, frame, 2);
+    check(closedByServer(fd));
+    close(fd);
+
+    /* delimiters at the last and the first byte of a read */
+    fd = connectTo(delimiter.port, 0);
+    check(echoes(fd, "aaaaaaaaaaaaaaa\nbbbbbbbbbbbbbbbb\nc\n", 35, "aaaaaaaaaaaaaaa|bbbbbbbbbbbbbbbb|c|"));
+    /* a partial line waits for the rest */
+    sendAll(fd, "par", 3);
+    usleep(20000);
+    check(echoes(fd, "tial\n\n", 6, "partial||"));
+    /* a line without its delimiter is too long at maxFrameSize + 1 bytes */
+    memset(frame, 'y', sizeof(frame));
+    sendAll(fd, frame, 41);
+    check(closedByServer(fd));
+    close(fd);
+}
+
+/*
+"sink" makes the connection the one all other data goes to, "stat" gets
+the wakeups and pauses of the loop.
+*/
+static void pauseRecv(const Socket* sock, void* data, char* buffer, unsigned size, const void* context)
+{
+    SelectMetrics metrics;
+    SelectFlowStats flow;
+    char reply[32];
+
+    if ((size == 4) && (memcmp(buffer, "sink", 4) == 0)) {
+        pauseSink = sock;
+    } else if ((size == 4) && (memcmp(buffer, "stat", 4) == 0)) {
+        selectMetrics(context, &metrics);
+        selectFlowStats(context, &flow);
+        snprintf(reply, sizeof(reply), "%10lu %10lu\n", metrics.wakeups, flow.paused);
+        selectSend(sock, reply, 22, context);
+    } else if (pauseSink != NULL) {
+        selectSend(pauseSink, buffer, size, context);
+    }
+}
+
+static void pauseDisconnect(const Socket* sock, void* data, const void* context)
+{
+    if (sock == pauseSink)
+        pauseSink = NULL;
+}
+
+static void pauseStat(int fd, unsigned long* wakeups, unsigned long* paused)
+{
+    char reply[23];
+
+    sendAll(fd, "stat", 4);
+    reply[22] = 0;
+    if (recvAll(fd, reply, 22) != 22) {
+        *wakeups = *paused = 0;
+        return;
+    }
+    *wakeups = strtoul(reply, NULL, 10);
+    *paused = strtoul(reply + 11, NULL, 10);
+}
+
+/* a reset peer of a connection which waits for nothing does not wake the loop */
+static void checkPausedReset(void)
+{
+    static struct CheckServer server;
+    static char data[64 * 1024];
+    struct linger reset = { 1, 0 };
+    unsigned long long until;
+    unsigned long before, after, paused;
+    int sink, producer, stat;
+
+    memset(&server, 0, sizeof(server));
+    selectOptionsInit(&server.options);
+    server.options.profile.sendBuffer = SMALL_BUFFER;
+    server.options.highWatermark = 16 * 1024;
+    server.options.lowWatermark = 4 * 1024;
+    server.options.slowPolicy = SELECT_SLOW_BLOCK;
+    server.handlers.serverDisconnect = pauseDisconnect;
+    server.handlers.serverRecvErr = pauseDisconnect;
+    server.handlers.serverSentErr = pauseDisconnect;
+    server.handlers.serverRecvOk = pauseRecv;
+    startServer(&server);
+    sink = connectTo(server.port, SMALL_BUFFER);
+    sendAll(sink, "sink", 4);
+    stat = connectTo(server.port, 0);
+    pauseStat(stat, &before, &paused); /* the sink is known after this reply */
+    /* the producer sends until the server stops reading it */
+    producer = connectTo(server.port, 0);
+    memset(data, 'p', sizeof(data));
+    for (until = now() + 200; now() < until; )
+        if (send(producer, data, sizeof(data), MSG_DONTWAIT) > 0)
+            until = now() + 200;
+    pauseStat(stat, &before, &paused);
+    check(paused > 0);
+    setsockopt(producer, SOL_SOCKET, SO_LINGER, &reset, sizeof(reset));
+    close(producer);
+    usleep(10000);
+    pauseStat(stat, &before, &paused);
+    usleep(200000);
+    pauseStat(stat, &after, &paused);
+    check(after - before < 20);
+    close(stat);
+    close(sink);
+}
+
+static void wheelFired(Timer* timer)
+{
+    struct CheckTimer* owner = timer->arg;
+
+    owner->fired = wheelTime;
+    owner->count++;
+}
+
+/*
+Timers on every level fire once, at the tick when they expire if the
+wheel is advanced to each next expiry, at most step ms late otherwise.
+*/
+static void checkWheel(unsigned long long step)
+{
+    static const unsigned long long delay[WHEEL_TIMERS] = {
+        0, 1, 63, 64, 65, 4095, 4096, 4097, 262143, 262144, 300001, 16777216, 20000000, 5000 /* stopped */
+    };
+    struct CheckTimer timer[WHEEL_TIMERS];
+    const unsigned long long start = 1000003; /* not at a slot boundary of any level */
+    const unsigned long long end = start + delay[WHEEL_TIMERS - 2] + step; /* all are late by then */
+    TimerWheel wheel;
+    int i, next, once = 1, inTime = 1;
+
+    timerInit(&wheel, start);
+    memset(timer, 0, sizeof(timer));
+    for (i = 0; i < WHEEL_TIMERS; i++) {
+        timer[i].timer.callback = wheelFired;
+        timer[i].timer.arg = &timer[i];
+        timerStart(&wheel, &timer[i].timer, start + delay[i]);
+    }
+    timerStop(&wheel, &timer[WHEEL_TIMERS - 1].timer);
+    check(wheel.count == WHEEL_TIMERS - 1);
+    for (wheelTime = start; ((next = timerNext(&wheel, wheelTime)) != -1) && (wheelTime <= end); ) {
+        if (step == 0)
+            wheelTime += next;
+        else
+            wheelTime += (next > 0) ? step : 0;
+        timerAdvance(&wheel, wheelTime);
+    }
+    for (i = 0; i < WHEEL_TIMERS - 1; i++) {
+        if (timer[i].count != 1)
+            once = 0;
+        else if ((timer[i].fired < start + delay[i]) || (timer[i].fired > start + delay[i] + step))
+            inTime = 0;
+    }
+    check(once);
+    check(inTime);
+    check(timer[WHEEL_TIMERS - 1].count == 0);
+    check(wheel.count == 0);
+}
+
+static void timerTick(void* arg, const void* context)
+{
+    if (__atomic_add_fetch(&loopTicks, 1, __ATOMIC_RELEASE) == 5)
+        selectTimerStop(loopTicker, context);
+}
+
+static void timerOnce(void* arg, const void* context)
+{
+    selectSend(arg, "t", 1, context);
+}
+
+/* a connection starts a one-shot timer which answers it and a periodic one */
+static void timerConnect(const Socket* sock, const void* context)
+{
+    loopTicker = selectTimerStart(20, 20, timerTick, NULL, context);
+    selectTimerStart(150, 0, timerOnce, (void*)sock, context);
+}
+
+static void timeoutRecv(const Socket* sock, void* data, char* buffer, unsigned size, const void* context)
+{
+    char output[MESSAGE_SIZE];
+    int i;
+
+    if (buffer[0] != 'w')
+        return;
+    memset(output, 'o', sizeof(output));
+    for (i = 0; i < 1000; i++) /* much more than a client which does not read takes */
+        selectSend(sock, output, sizeof(output), context);
+}
+
+static void timeoutReported(const Socket* sock, void* data, int reason, const void* context)
+{
+    struct CheckServer* server = selectUser(context);
+
+    __atomic_store_n(&server->timeout, reason, __ATOMIC_RELEASE);
+}
+
+static void timeoutServer(struct CheckServer* server)
+{
+    memset(server, 0, sizeof(*server));
+    selectOptionsInit(&server->options);
+    server->options.profile.sendBuffer = SMALL_BUFFER;
+    server->handlers.serverRecvOk = timeoutRecv;
+    server->handlers.serverTimeout = timeoutReported;
+}
+
+/* closed by the server after between min and max ms, for reason */
+static void checkTimedOut(struct CheckServer* server, int fd, unsigned long long since,
+    unsigned long long min, unsigned long long max, int reason)
+{
+    unsigned long long elapsed;
+
+    check(closedByServer(fd));
+    elapsed = now() - since;
+    check((elapsed >= min) && (elapsed <= max));
+    check(waitCount(&server->timeout, 1) == reason);
+    close(fd);
+}
+
+/* loop timers fire in time, connections are closed by their deadlines */
+static void checkTimers(void)
+{
+    static struct CheckServer timers, idle, read, write;
+    unsigned long long since;
+    char byte;
+    int fd, i;
+
+    memset(&timers, 0, sizeof(timers));
+    selectOptionsInit(&timers.options);
+    timers.handlers.serverConnect = timerConnect;
+    startServer(&timers);
+    since = now();
+    fd = connectTo(timers.port, 0);
+    check((recvAll(fd, &byte, 1) == 1) && (byte == 't'));
+    check(now() - since >= 150);
+    usleep(100000);
+    check(__atomic_load_n(&loopTicks, __ATOMIC_ACQUIRE) == 5);
+    close(fd);
+
+    timeoutServer(&idle);
+    idle.options.idleTimeout = 100;
+    startServer(&idle);
+    since = now();
+    checkTimedOut(&idle, connectTo(idle.port, 0), since, 100, 1000, SELECT_TIMEOUT_IDLE);
+
+    /* a client which sends often enough stays */
+    timeoutServer(&read);
+    read.options.readTimeout = 200;
+    startServer(&read);
+    fd = connectTo(read.port, 0);
+    for (i = 0; i < 8; i++) {
+        sendAll(fd, "r", 1);
+        usleep(50000);
+    }
+    check(__atomic_load_n(&read.timeout, __ATOMIC_ACQUIRE) == 0);
+    checkTimedOut(&read, fd, now(), 100, 1000, SELECT_TIMEOUT_READ);
+
+    /* output which makes no progress */
+    timeoutServer(&write);
+    write.options.writeTimeout = 100;
+    startServer(&write);
+    fd = connectTo(write.port, SMALL_BUFFER);
+    since = now();
+    sendAll(fd, "w", 1);
+    usleep(300000); /* not read meanwhile */
+    check(__atomic_load_n(&write.timeout, __ATOMIC_ACQUIRE) == SELECT_TIMEOUT_WRITE);
+    recvAll(fd, NULL, 1000 * MESSAGE_SIZE); /* what has been sent before */
+    close(fd);
+}
+
+static void upstreamConnect(const Socket* sock, const void* context)
+{
+    __atomic_fetch_add(&upstreamAccepts, 1, __ATOMIC_RELEASE);
+}
+
+/* answers the client which asked for the connection, then gives it back */
+static void connectDone(const Socket* sock, void* arg, const void* context)
+{
+    selectSend(arg, "k", 1, context);
+    selectRelease(sock, context);
+}
+
+static void connectFailed(void* arg, const void* context)
+{
+    selectSend(arg, (errno == ETIMEDOUT) ? "T" : (errno == ECONNREFUSED) ? "R" : "E", 1, context);
+}
+
+/* "u", "s" and "c" connect to the upstream, the silent and the closed port */
+static void connectRecv(const Socket* sock, void* data, char* buffer, unsigned size, const void* context)
+{
+    unsigned short port = (buffer[0] == 'u') ? upstreamPort : (buffer[0] == 's') ? silentPort : closedPort;
+
+    if (selectConnect(0x7f000001/*127.0.0.1*/, port, 200, (void*)sock, context) == -1)
+        selectSend(sock, "E", 1, context);
+}
+
+/* the answer of the connect server to command */
+static char connectAnswer(int fd, const char* command)
+{
+    char answer;
+
+    sendAll(fd, command, 1);
+    return (recvAll(fd, &answer, 1) == 1) ? answer : 0;
+}
+
+/* a port whose backlog is full, so connects to it never complete */
+static int silentListener(unsigned short port, int* filler, int count)
+{
+    struct sockaddr_in addr;
+    int fd = socket(AF_INET, SOCK_STREAM, 0), one = 1, i;
+
+    if (fd == -1) terminate("Can't create socket: %s!", strerror(errno));
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if ((bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1) || (listen(fd, 0) == -1))
+        terminate("Can't listen on port %u: %s!", (unsigned)port, strerror(errno));
+    for (i = 0; i < count; i++) {
+        filler[i] = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        connect(filler[i], (struct sockaddr*)&addr, sizeof(addr));
+    }
+    usleep(10000);
+    return fd;
+}
+
+/* connects time out or fail with their errno, released ones are reused */
+static void checkConnect(void)
+{
+    static struct CheckServer upstream, server;
+    unsigned long long since;
+    int fd, silent, filler[4], i;
+
+    memset(&upstream, 0, sizeof(upstream));
+    selectOptionsInit(&upstream.options);
+    upstream.handlers.serverConnect = upstreamConnect;
+    startServer(&upstream);
+    upstreamPort = upstream.port;
+    silentPort = nextPort++;
+    silent = silentListener(silentPort, filler, 4);
+    closedPort = nextPort++;
+    memset(&server, 0, sizeof(server));
+    selectOptionsInit(&server.options);
+    server.options.upstreamIdle = 1;
+    server.options.upstreamIdleTimeout = 300;
+    server.handlers.clientConnect = connectDone;
+    server.handlers.clientConnectErr = connectFailed;
+    server.handlers.serverRecvOk = connectRecv;
+    startServer(&server);
+    fd = connectTo(server.port, 0);
+
+    for (i = 0; i < 3; i++)
+        check(connectAnswer(fd, "u") == 'k');
+    check(__atomic_load_n(&upstreamAccepts, __ATOMIC_ACQUIRE) == 1);
+    /* one kept for longer than upstreamIdleTimeout is closed */
+    usleep(500000);
+    check(connectAnswer(fd, "u") == 'k');
+    check(waitCount(&upstreamAccepts, 2) == 2);
+    since = now();
+    check(connectAnswer(fd, "s") == 'T');
+    check(now() - since >= 200);
+    check(connectAnswer(fd, "c") == 'R');
+    close(fd);
+    for (i = 0; i < 4; i++)
+        close(filler[i]);
+    close(silent);
+}
+
+/* sends the data back and sees whether selectSend has written it already */
+static void eagerRecv(const Socket* sock, void* data, char* buffer, unsigned size, const void* context)
+{
+    SelectMetrics before, after;
+
+    selectMetrics(context, &before);
+    eagerInside = 1;
+    selectSend(sock, buffer, size, context);
+    eagerInside = 0;
+    selectMetrics(context, &after);
+    if (after.sendCalls == before.sendCalls + 1) /* the bytes are counted when reported */
+        eagerWritten++;
+}
+
+static void eagerSentOk(const Socket* sock, void* data, char* buffer, unsigned size, const void* context)
+{
+    if (eagerInside)
+        eagerEarly++;
+    __atomic_fetch_add(&eagerReported, 1, __ATOMIC_RELEASE);
+}
+
+/* output of an idle connection is written by selectSend, reported after the callback */
+static void checkEagerWrite(void)
+{
+    static struct CheckServer server;
+    char sent[8], echo[6];
+    int fd, i, echoed = 1;
+
+    memset(&server, 0, sizeof(server));
+    selectOptionsInit(&server.options);
+    server.handlers.serverRecvOk = eagerRecv;
+    server.handlers.serverSentOk = eagerSentOk;
+    startServer(&server);
+    fd = connectTo(server.port, 0);
+    for (i = 0; i < 10; i++) {
+        snprintf(sent, sizeof(sent), "eager%d", i);
+        sendAll(fd, sent, 6);
+        if ((recvAll(fd, echo, 6) != 6) || (memcmp(sent, echo, 6) != 0))
+            echoed = 0;
+    }
+    check(echoed);
+    check(waitCount(&eagerReported, 10) == 10);
+    /* counted by the loop before it has reported them */
+    check(eagerWritten == 10);
+    check(eagerEarly == 0);
+    close(fd);
+}
+
+/* sends back four times what comes */
+static void duplexRecv(const Socket* sock, void* data, char* buffer, unsigned size, const void* context)
+{
+    SelectMemoryStats stats;
+    int i;
+
+    selectMemoryStats(context, &stats);
+    if (stats.bytesUsed != 0)
+        __atomic_fetch_add(&duplexOverlapped, 1, __ATOMIC_RELAXED);
+    for (i = 0; i < 4; i++)
+        selectSend(sock, buffer, size, context);
+    __atomic_fetch_add(&duplexReceived, size, __ATOMIC_RELEASE);
+}
+
+/* a connection is read while its output waits, until there is duplexOutput of it */
+static void checkDuplex(void)
+{
+    static struct CheckServer server;
+    char data[MESSAGE_SIZE];
+    unsigned long long until;
+    unsigned long sent = 0;
+    ssize_t rc;
+    int fd;
+
+    memset(&server, 0, sizeof(server));
+    selectOptionsInit(&server.options);
+    server.options.profile.sendBuffer = SMALL_BUFFER;
+    server.options.duplexOutput = 64 * 1024;
+    server.handlers.serverRecvOk = duplexRecv;
+    startServer(&server);
+    fd = connectTo(server.port, SMALL_BUFFER);
+    memset(data, 'd', sizeof(data));
+    /* the client does not read, so the server stops reading at some point */
+    for (until = now() + 200; now() < until; ) {
+        rc = send(fd, data, sizeof(data), MSG_DONTWAIT);
+        if (rc > 0) {
+            sent += rc;
+            until = now() + 200;
+        }
+    }
+    check(__atomic_load_n(&duplexOverlapped, __ATOMIC_RELAXED) > 0);
+    check(__atomic_load_n(&duplexReceived, __ATOMIC_ACQUIRE) * 4 >= server.options.duplexOutput);
+    check(__atomic_load_n(&duplexReceived, __ATOMIC_ACQUIRE) < sent);
+    /* and reads the rest once its output goes */
+    check(recvAll(fd, NULL, sent * 4) == sent * 4);
+    check(__atomic_load_n(&duplexReceived, __ATOMIC_ACQUIRE) == sent);
+    close(fd);
+}
+
+/* served by the next startServer too, path starts with @ in the abstract namespace */
+static void addUnixListener(struct CheckServer* server, const char* path)
+{
+    Socket* listen = socketConstruct();
+
+    if (listen == NULL) terminate("Can't allocate memory!");
+    if (path[0] != '@')
+        unlink(path);
+    if ((socketSetPath(path, listen) == -1) || (socketCreate(listen) == -1)
+            || (socketSetBlocking(0/*false*/, listen) == -1) || (socketBind(listen) == -1)
+            || (socketListen(listen) == -1))
+        terminate("Can't listen on %s: %s!", path, socketError(listen));
+    server->listen[server->listenCount++] = listen;
+}
+
+/* blocking client socket of a Unix listener */
+static int connectUnix(const char* path)
+{
+    struct sockaddr_un addr;
+    struct timeval timeout = { WAIT_MS / 1000, 0 };
+    socklen_t size = offsetof(struct sockaddr_un, sun_path) + strlen(path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if (fd == -1) terminate("Can't create socket: %s!", strerror(errno));
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path, strlen(path));
+    if (path[0] == '@')
+        addr.sun_path[0] = '\0';
+    else
+        size++;
+    if (connect(fd, (struct sockaddr*)&addr, size) == -1)
+        terminate("Can't connect to %s: %s!", path, strerror(errno));
+    return fd;
+}
+
+/* one loop serves Unix and TCP listeners, TCP options do not keep Unix clients out */
+static void checkUnix(void)
+{
+    static struct CheckServer server;
+    char abstract[32], path[64], buffer[5];
+    int fd[3], i;
+
+    memset(&server, 0, sizeof(server));
+    selectOptionsInit(&server.options);
+    server.options.profile.noDelay = 1;
+    server.options.profile.quickAck = 1;
+    server.handlers.serverRecvOk = echoRecv;
+    snprintf(abstract, sizeof(abstract), "@check%u", (unsigned)nextPort);
+    snprintf(path, sizeof(path), "/tmp/check%u.sock", (unsigned)nextPort);
+    addUnixListener(&server, abstract);
+    addUnixListener(&server, path);
+    startServer(&server);
+    fd[0] = connectUnix(abstract);
+    fd[1] = connectUnix(path);
+    fd[2] = connectTo(server.port, 0);
+    for (i = 0; i < 3; i++) {
+        sendAll(fd[i], "unix", 4);
+        check((recvAll(fd[i], buffer, 4) == 4) && (memcmp(buffer, "unix", 4) == 0));
+    }
+    for (i = 0; i < 3; i++)
+        close(fd[i]);
+    unlink(path);
+}
+
+/*
+"s<topic>" subscribes, "u<topic>" unsubscribes, "p<topic> <message>"
+publishes the message as a line, each answers with what the call returned.
+*/
+static void pubsubMessage(const Socket* sock, void* data, char* message, unsigned size, const void* context)
+{
+    char line[128], reply[16];
+    const char* space;
+    int rc = -2;
+
+    if ((size == 0) || (size >= sizeof(line) - 1))
+        return;
+    memcpy(line, message, size);
+    line[size] = 0;
+    if (line[0] == 's') {
+        rc = selectSubscribe(sock, line + 1, size - 1, context);
+    } else if (line[0] == 'u') {
+        rc = selectUnsubscribe(sock, line + 1, size - 1, context);
+    } else if ((line[0] == 'p') && ((space = strchr(line, ' ')) != NULL)) {
+        line[size] = '\n'; /* sent with the message */
+        rc = selectPublish(line + 1, space - line - 1, space + 1, line + size - space, context);
+    }
+    snprintf(reply, sizeof(reply), "%d\n", rc);
+    selectSend(sock, reply, strlen(reply), context);
+}
+
+/* one line without '\n', empty if none has come */
+static const char* readLine(int fd)
+{
+    static char line[128];
+    unsigned i;
+
+    for (i = 0; (i < sizeof(line) - 1) && (recvAll(fd, line + i, 1) == 1) && (line[i] != '\n'); i++)
+        ;
+    line[i] = 0;
+    return line;
+}
+
+/* what the server has returned for command */
+static int pubsub(int fd, const char* command)
+{
+    sendAll(fd, command, strlen(command));
+    sendAll(fd, "\n", 1);
+    return atoi(readLine(fd));
+}
+
+/* nothing is waiting on fd */
+static int silent(int fd)
+{
+    char byte;
+
+    usleep(50000);
+    return (recv(fd, &byte, 1, MSG_DONTWAIT) == -1) && (errno == EAGAIN);
+}
+
+/* messages go to the subscribers of their topic only, many topics included */
+static void checkPubsub(void)
+{
+    static struct CheckServer server;
+    char command[32];
+    int a, b, c, publisher, i, ordered = 1, published = 1;
+
+    memset(&server, 0, sizeof(server));
+    selectOptionsInit(&server.options);
+    server.options.framing = SELECT_FRAME_DELIMITER;
+    server.handlers.serverMessage = pubsubMessage;
+    startServer(&server);
+    a = connectTo(server.port, 0);
+    b = connectTo(server.port, 0);
+    c = connectTo(server.port, 0);
+    publisher = connectTo(server.port, 0);
+
+    check(pubsub(a, "snews") == 0);
+    check(pubsub(b, "snews") == 0);
+    check(pubsub(b, "ssport") == 0);
+    check(pubsub(a, "snews") == 1);
+    check(pubsub(publisher, "pnews hello") == 2);
+    check(strcmp(readLine(a), "hello") == 0);
+    check(strcmp(readLine(b), "hello") == 0);
+    check(pubsub(publisher, "psport goal") == 1);
+    check(strcmp(readLine(b), "goal") == 0);
+    check(silent(a));
+    /* a prefix is another topic */
+    check(pubsub(publisher, "pnew nobody") == 0);
+    check(pubsub(a, "unews") == 0);
+    check(pubsub(a, "unews") == -1);
+    check(pubsub(publisher, "pnews again") == 1);
+    check(strcmp(readLine(b), "again") == 0);
+    check(silent(a));
+    check(silent(c));
+
+    /* many topics of one connection */
+    for (i = 0; i < TOPICS; i++) {
+        snprintf(command, sizeof(command), "stopic%d", i);
+        if (pubsub(c, command) != 0)
+            published = 0;
+    }
+    for (i = 0; i < TOPICS; i++) {
+        snprintf(command, sizeof(command), "ptopic%d %d", i, i);
+        if (pubsub(publisher, command) != 1)
+            published = 0;
+    }
+    check(published);
+    for (i = 0; (i < TOPICS) && ordered; i++)
+        ordered = (atoi(readLine(c)) == i);
+    check(ordered);
+
+    /* the topics of a closed connection are left */
+    close(b);
+    usleep(50000);
+    check(pubsub(publisher, "psport late") == 0);
+    check(pubsub(publisher, "pnews late") == 0);
+    close(a);
+    close(c);
+    close(publisher);
+}
+
+static void workerConnect(const Socket* sock, const void* context)
+{
+    struct CheckConn* conn;
+    int i = __atomic_fetch_add(&workerConnCount, 1, __ATOMIC_RELAXED);
+
+    if (i >= (int)(sizeof(workerConn) / sizeof(workerConn[0]))) {
+        selectClose(sock, context);
+        return;
+    }
+    conn = &workerConn[i];
+    __atomic_store_n(&conn->alive, 1, __ATOMIC_RELEASE);
+    selectSetData(sock, conn, context);
+}
+
+/* the last callback of a connection, its jobs must be finished by now */
+static void workerGone(struct CheckConn* conn)
+{
+    if (conn == NULL)
+        return;
+    if (__atomic_load_n(&conn->started, __ATOMIC_ACQUIRE) != __atomic_load_n(&conn->finished, __ATOMIC_ACQUIRE))
+        __atomic_fetch_add(&workerFailures, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&conn->alive, 0, __ATOMIC_RELEASE);
+    __atomic_fetch_add(&workerClosed, 1, __ATOMIC_RELEASE);
+}
+
+static void workerDisconnect(const Socket* sock, void* data, const void* context)
+{
+    workerGone(data);
+}
+
+static void workerError(const Socket* sock, void* data, const void* context)
+{
+    workerGone(data);
+}
+
+static void workerTimeout(const Socket* sock, void* data, int reason, const void* context)
+{
+    workerGone(data);
+}
+
+/* echoes after a while, the data of the connection must stay valid meanwhile */
+static void workerRecv(const SelectHandle* handle, void* data, char* buffer, unsigned size)
+{
+    struct CheckConn* conn = data;
+
+    __atomic_fetch_add(&conn->started, 1, __ATOMIC_RELEASE);
+    if (!__atomic_load_n(&conn->alive, __ATOMIC_ACQUIRE))
+        __atomic_fetch_add(&workerFailures, 1, __ATOMIC_RELAXED);
+    usleep(WORKER_DELAY_US);
+    if (!__atomic_load_n(&conn->alive, __ATOMIC_ACQUIRE))
+        __atomic_fetch_add(&workerFailures, 1, __ATOMIC_RELAXED);
+    selectPostSend(handle, buffer, size);
+    __atomic_fetch_add(&conn->finished, 1, __ATOMIC_RELEASE);
+}
+
+/* connections reset while their jobs run are closed after the jobs */
+static void checkWorkers(void)
+{
+    static struct CheckServer server;
+    struct linger reset = { 1, 0 };
+    char buffer[1000];
+    int fd, i;
+
+    memset(&server, 0, sizeof(server));
+    selectOptionsInit(&server.options);
+    server.options.workers = 2;
+    server.handlers.serverConnect = workerConnect;
+    server.handlers.serverDisconnect = workerDisconnect;
+    server.handlers.serverRecvErr = workerError;
+    server.handlers.serverSentErr = workerError;
+    server.handlers.serverTimeout = workerTimeout;
+    server.handlers.workerRecv = workerRecv;
+    startServer(&server);
+    memset(buffer, 'w', sizeof(buffer));
+    for (i = 0; i < WORKER_CONNECTIONS; i++) {
+        fd = connectTo(server.port, 0);
+        sendAll(fd, buffer, sizeof(buffer));
+        usleep(1000); /* read by the server, so it has a job */
+        setsockopt(fd, SOL_SOCKET, SO_LINGER, &reset, sizeof(reset));
+        close(fd);
+    }
+    check(waitCount(&workerClosed, WORKER_CONNECTIONS) == WORKER_CONNECTIONS);
+    check(__atomic_load_n(&workerFailures, __ATOMIC_ACQUIRE) == 0);
+    /* and the server still answers */
+    fd = connectTo(server.port, 0);
+    sendAll(fd, "ping", 4);
+    check((recvAll(fd, buffer, 4) == 4) && (memcmp(buffer, "ping", 4) == 0));
+    close(fd);
+}
+
+/* the harness itself: what bench measures comes back whole */
+static void checkEcho(void)
+{
+    static struct CheckServer server;
+    char out[10000], in[sizeof(out)];
+    int fd, i;
+
+    memset(&server, 0, sizeof(server));
+    selectOptionsInit(&server.options);
+    server.handlers.serverRecvOk = echoRecv;
+    startServer(&server);
+    for (i = 0; i < (int)sizeof(out); i++)
+        out[i] = (char)i;
+    fd = connectTo(server.port, 0);
+    sendAll(fd, out, sizeof(out));
+    check((recvAll(fd, in, sizeof(in)) == sizeof(in)) && (memcmp(in, out, sizeof(in)) == 0));
+    close(fd);
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc > 2) terminate("Usage: %s [port]", argv[0]);
+    firstPort = nextPort = (argc > 1) ? (unsigned short)atoi(argv[1]) : 5100;
+    signal(SIGPIPE, SIG_IGN);
+    checkEcho();
+    checkQueue();
+    checkQueueFlush();
+    checkSlots();
+    checkPool();
+    checkBudget();
+    checkPausedReset();
+    checkWheel(0);
+    checkWheel(997);
+    checkTimers();
+    checkWatermark();
+    checkFraming();
+    checkConnect();
+    checkEagerWrite();
+    checkDuplex();
+    checkUnix();
+    checkPubsub();
+    checkWorkers();
+    assert(nextPort - firstPort <= CHECK_PORTS);
+    printf("%d checks, %d failed\n", checks, failures);
+    return (failures == 0) ? 0 : 1;
+}
+
+static void terminate(const char* fmt, ...)
+{
+    char str[BUFSIZ+1];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(str, BUFSIZ, fmt, ap);
+    va_end(ap);
+    fprintf(stderr, "%s\n", str);
+    exit(1);
+}
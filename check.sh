@@ -0,0 +1,46 @@
+#!/bin/sh
+# Builds check.c with every poller and runs it, then runs bench shortly
+# against server.c built the same way, exits with 1 if any check fails,
+# so it can gate a change next to bench.sh.
+# usage: check.sh [extra compiler flags], e.g. check.sh -fsanitize=address
+# environment: CC, PLATFORM (-DLINUX by default), POLLERS (defines of the
+# builds, "fdset" for none), PORT (the first of the ports used, 31 per
+# poller).
+
+CC=${CC:-cc}
+PLATFORM=${PLATFORM:--DLINUX}
+POLLERS=${POLLERS:-"fdset -DEPOLL -DURING"}
+PORT=${PORT:-5100}
+LIB="selectunix.c selectpoll.c selectfdset.c selectepoll.c selecturing.c pool.c queue.c socketunix.c timer.c topic.c trace.c error.c"
+
+# echo through srv, every message sent must come back without errors
+bench() {
+    ./srv "$1" 1 echo 2>/dev/null &
+    pid=$!
+    sleep 0.5
+    result=$(./bench -m echo -c 10 -s 64 -d 1 -w 0 127.0.0.1 "$1")
+    kill "$pid"
+    wait "$pid" 2>/dev/null
+    echo "$result" | grep -q '"messages":[1-9].*"errors":0}' && return 0
+    echo "bench: $result"
+    return 1
+}
+
+cd "$(dirname "$0")" || exit 1
+rc=0
+for poller in $POLLERS; do
+    [ "$poller" = fdset ] && define= || define=$poller
+    if ! $CC -g -o check $PLATFORM $define "$@" check.c $LIB -lpthread ||
+            ! $CC -g -o srv $PLATFORM $define "$@" server.c $LIB -lpthread ||
+            ! $CC -g -o bench $PLATFORM $define "$@" bench.c $LIB -lpthread; then
+        echo "$poller: build failed"
+        rc=1
+        continue
+    fi
+    printf '%s: ' "$poller"
+    ./check "$PORT" || rc=1
+    bench $((PORT + 30)) || rc=1
+    PORT=$((PORT + 31))
+done
+rm -f check srv bench
+exit $rc
@@ -4,22 +4,29 @@
 #include <stdlib.h>
 #include <string.h>
 
-char* errorString(int error, char* buf, const char* fmt, ...)
+#include "error.h"
+
+/*
+Formats fmt and appends the description of errno value error,
+if it is not zero. buf must be at least size bytes.
+*/
+char* errorString(int error, char* buf, unsigned size, const char* fmt, ...)
 {
     va_list ap;
     int n;
 
+    assert(size > 0);
     va_start(ap, fmt);
-    n = vsnprintf(buf, BUFSIZ, fmt, ap);
+    n = vsnprintf(buf, size, fmt, ap);
     va_end(ap);
     assert(n > 0);
-    if (error != 0) {
+    if ((error != 0) && (n >= 0) && ((unsigned)n < size - 1)) {
         char* errp = buf + n;
-        strerror_r(error, errp, BUFSIZ);
-        n = strlen(errp);
-        snprintf(errp + n, BUFSIZ - n, ".(%d)", error);
+        strerror_r(error, errp, size - n);
+        n += strlen(errp);
+        snprintf(buf + n, size - n, ".(%d)", error);
     }
-    buf[BUFSIZ - 1] = '\0';
+    buf[size - 1] = '\0';
     return buf;
 }
 
@@ -1,6 +1,6 @@
 #ifndef _ERROR_H
 #define _ERROR_H
 
-char* errorString(int error, const char* fmt, ...);
+char* errorString(int error, char* buf, unsigned size, const char* fmt, ...);
 
 #endif /*_ERROR_H */
@@ -0,0 +1,155 @@
+#include <assert.h>
+#include <stdlib.h>
+
+#include "pool.h"
+
+#define POOL_KEEP 256 /* free blocks kept for reuse, the rest goes back to heap */
+#define POOL_GRANT (64 * 1024) /* budget taken at once, the shared counter is touched rarely */
+
+struct _PoolBlock {
+    struct _PoolBlock* next;
+};
+
+/*
+Makes room for size more bytes in the budget, taking a grant from the
+shared counter when the pool has used up its own. Other pools may get
+the last bytes, -1 if none are left for size.
+*/
+static int reserve(Pool* pool, unsigned long size)
+{
+    PoolBudget* budget = pool->budget;
+    unsigned long need, grant, taken;
+
+    if ((budget == NULL) || (pool->bytesUsed + size <= pool->reserved))
+        return 0;
+    need = pool->bytesUsed + size - pool->reserved;
+    taken = __atomic_load_n(&budget->reserved, __ATOMIC_RELAXED);
+    do {
+        grant = (need < POOL_GRANT) ? POOL_GRANT : need;
+        if (taken + grant > budget->limit)
+            grant = need; /* the rest of the budget is thin, take only what is needed */
+        if (taken + grant > budget->limit)
+            return -1;
+    } while (!__atomic_compare_exchange_n(&budget->reserved, &taken, taken + grant, 1,
+        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    pool->reserved += grant;
+    return 0;
+}
+
+/* gives back what the pool keeps above its use, all of it if keep is 0 */
+static void unreserve(Pool* pool, unsigned long keep)
+{
+    unsigned long extra;
+
+    if ((pool->budget == NULL) || (pool->reserved - pool->bytesUsed <= 2 * keep))
+        return;
+    extra = pool->reserved - pool->bytesUsed - keep;
+    __atomic_sub_fetch(&pool->budget->reserved, extra, __ATOMIC_RELAXED);
+    pool->reserved -= extra;
+}
+
+/*
+Sizes up to blockSize are served from the pool, larger ones from heap.
+Returns NULL if the budget would be exceeded or out of memory.
+*/
+void* poolAlloc(Pool* pool, unsigned size)
+{
+    struct _PoolBlock* block;
+
+    assert(size > 0);
+    if (reserve(pool, size) == -1)
+        return NULL;
+    if (size > pool->blockSize) {
+        void* ptr = malloc(size);
+        if (ptr != NULL)
+            pool->bytesUsed += size;
+        return ptr;
+    }
+    block = pool->free;
+    if (block != NULL) {
+        pool->free = block->next;
+        pool->freeCount--;
+    } else {
+        block = malloc(pool->blockSize);
+        if (block == NULL)
+            return NULL;
+        pool->blocks++;
+    }
+    pool->blocksUsed++;
+    pool->bytesUsed += size;
+    return block;
+}
+
+void poolBudgetInit(PoolBudget* budget, unsigned long limit)
+{
+    assert(limit > 0);
+    budget->limit = limit;
+    budget->reserved = 0;
+}
+
+/* counts size bytes allocated elsewhere against the budget, -1 if exceeded */
+int poolCharge(Pool* pool, unsigned long size)
+{
+    if (reserve(pool, size) == -1)
+        return -1;
+    pool->bytesUsed += size;
+    return 0;
+}
+
+/* releases free blocks and unused budget, blocks in use stay valid */
+void poolClear(Pool* pool)
+{
+    while (pool->free != NULL) {
+        struct _PoolBlock* next = pool->free->next;
+        free(pool->free);
+        pool->free = next;
+        pool->blocks--;
+    }
+    pool->freeCount = 0;
+    unreserve(pool, 0);
+}
+
+/* size must be the same as passed to poolAlloc */
+void poolFree(Pool* pool, void* ptr, unsigned size)
+{
+    struct _PoolBlock* block = ptr;
+
+    assert(pool->bytesUsed >= size);
+    pool->bytesUsed -= size;
+    unreserve(pool, POOL_GRANT);
+    if (size > pool->blockSize) {
+        free(ptr);
+        return;
+    }
+    pool->blocksUsed--;
+    if (pool->freeCount >= POOL_KEEP) { /* idle memory goes back */
+        free(block);
+        pool->blocks--;
+        return;
+    }
+    block->next = pool->free;
+    pool->free = block;
+    pool->freeCount++;
+}
+
+/* budget may be shared by pools of other threads, NULL if unlimited */
+void poolInit(Pool* pool, unsigned blockSize, PoolBudget* budget)
+{
+    assert(blockSize >= sizeof(struct _PoolBlock));
+    pool->blockSize = blockSize;
+    pool->free = NULL;
+    pool->freeCount = 0;
+    pool->blocks = 0;
+    pool->blocksUsed = 0;
+    pool->bytesUsed = 0;
+    pool->budget = budget;
+    pool->reserved = 0;
+}
+
+/* size must be the same as passed to poolCharge */
+void poolRefund(Pool* pool, unsigned long size)
+{
+    assert(pool->bytesUsed >= size);
+    pool->bytesUsed -= size;
+    unreserve(pool, POOL_GRANT);
+}
@@ -0,0 +1,32 @@
+#ifndef _POOL_H
+#define _POOL_H
+
+struct _PoolBlock;
+
+/* memory limit shared by the pools of several threads */
+typedef struct _PoolBudget {
+    unsigned long limit; /* bytes */
+    unsigned long reserved; /* taken by the pools, changed atomically */
+} PoolBudget;
+
+/* fixed size blocks for data in flight, one pool per loop, not thread-safe */
+typedef struct _Pool {
+    unsigned blockSize;
+    struct _PoolBlock* free; /* blocks ready for reuse */
+    unsigned long freeCount;
+    unsigned long blocks; /* blocks taken from heap and not returned */
+    unsigned long blocksUsed; /* blocks handed out by poolAlloc */
+    unsigned long bytesUsed; /* bytes handed out or charged, including larger than a block */
+    PoolBudget* budget; /* limit for bytesUsed of all pools sharing it, NULL if unlimited */
+    unsigned long reserved; /* bytes of budget taken by this pool, not less than bytesUsed */
+} Pool;
+
+void* poolAlloc(Pool* pool, unsigned size);
+void poolBudgetInit(PoolBudget* budget, unsigned long limit);
+int poolCharge(Pool* pool, unsigned long size);
+void poolClear(Pool* pool);
+void poolFree(Pool* pool, void* ptr, unsigned size);
+void poolInit(Pool* pool, unsigned blockSize, PoolBudget* budget);
+void poolRefund(Pool* pool, unsigned long size);
+
+#endif /*_POOL_H */
@@ -0,0 +1,239 @@
+#include <assert.h>
+#include <sys/uio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pool.h"
+#include "queue.h"
+
+struct _QueueBuffer {
+    unsigned refs; /* released when drops to zero, changed atomically */
+    unsigned size;
+    char data[];
+};
+
+struct _QueueChunk {
+    struct _QueueChunk* next;
+    const char* data; /* payload, stored right after the chunk or shared */
+    unsigned size; /* payload size */
+    unsigned offset; /* bytes of payload already sent */
+    QueueBuffer* shared; /* NULL if payload is owned by the chunk */
+    unsigned tag; /* of queueConsumeHeld, while it is held */
+};
+
+QueueBuffer* queueBufferCreate(const void* buffer, unsigned size)
+{
+    QueueBuffer* shared;
+
+    assert(size > 0);
+    shared = malloc(sizeof(*shared) + size);
+    if (shared == NULL)
+        return NULL;
+    shared->refs = 1;
+    shared->size = size;
+    memcpy(shared->data, buffer, size);
+    return shared;
+}
+
+const char* queueBufferData(const QueueBuffer* buffer)
+{
+    return buffer->data;
+}
+
+/* buffers may be shared by loops running in different threads */
+void queueBufferRelease(QueueBuffer* buffer)
+{
+    assert(buffer->refs > 0);
+    if (__atomic_sub_fetch(&buffer->refs, 1, __ATOMIC_ACQ_REL) == 0)
+        free(buffer);
+}
+
+QueueBuffer* queueBufferRetain(QueueBuffer* buffer)
+{
+    __atomic_add_fetch(&buffer->refs, 1, __ATOMIC_RELAXED);
+    return buffer;
+}
+
+unsigned queueBufferSize(const QueueBuffer* buffer)
+{
+    return buffer->size;
+}
+
+/* chunks come from the queue pool if there is one */
+static struct _QueueChunk* allocChunk(Queue* queue, unsigned size)
+{
+    if (queue->pool != NULL)
+        return poolAlloc(queue->pool, size);
+    return malloc(size);
+}
+
+static void freeChunk(Queue* queue, struct _QueueChunk* chunk)
+{
+    unsigned size = sizeof(*chunk);
+
+    if (chunk->shared != NULL) {
+        if (queue->pool != NULL)
+            poolRefund(queue->pool, chunk->size);
+        queueBufferRelease(chunk->shared);
+    } else {
+        size += chunk->size;
+    }
+    if (queue->pool != NULL)
+        poolFree(queue->pool, chunk, size);
+    else
+        free(chunk);
+}
+
+static void append(Queue* queue, struct _QueueChunk* chunk)
+{
+    if (queue->tail != NULL)
+        queue->tail->next = chunk;
+    else
+        queue->head = chunk;
+    queue->tail = chunk;
+    queue->bytes += chunk->size;
+}
+
+/* bytes taken from the pool by a copy of size bytes */
+unsigned queueChunkSize(unsigned size)
+{
+    return sizeof(struct _QueueChunk) + size;
+}
+
+/* pool may be NULL, then chunks are allocated from heap */
+void queueInit(Queue* queue, Pool* pool)
+{
+    assert(queue != NULL);
+    queue->head = NULL;
+    queue->tail = NULL;
+    queue->bytes = 0;
+    queue->pool = pool;
+}
+
+void queueClear(Queue* queue)
+{
+    struct _QueueChunk* chunk = queue->head;
+
+    while (chunk != NULL) {
+        struct _QueueChunk* next = chunk->next;
+        freeChunk(queue, chunk);
+        chunk = next;
+    }
+    queue->head = NULL;
+    queue->tail = NULL;
+    queue->bytes = 0;
+}
+
+/* drop bytes from the head, partial chunk keeps its offset */
+void queueConsume(Queue* queue, unsigned long bytes)
+{
+    assert(bytes <= queue->bytes);
+    queue->bytes -= bytes;
+    while (bytes > 0) {
+        struct _QueueChunk* chunk = queue->head;
+        unsigned left = chunk->size - chunk->offset;
+        if (bytes < left) {
+            chunk->offset += bytes;
+            return;
+        }
+        bytes -= left;
+        queue->head = chunk->next;
+        freeChunk(queue, chunk);
+    }
+    if (queue->head == NULL)
+        queue->tail = NULL;
+}
+
+/*
+Like queueConsume, but fully sent chunks are moved to the tail of held
+instead of being released, the kernel may still read them.
+tag - released by queueReleaseHeld() once done reaches it.
+*/
+void queueConsumeHeld(Queue* queue, unsigned long bytes, Queue* held, unsigned tag)
+{
+    assert(bytes <= queue->bytes);
+    queue->bytes -= bytes;
+    while (bytes > 0) {
+        struct _QueueChunk* chunk = queue->head;
+        unsigned left = chunk->size - chunk->offset;
+        if (bytes < left) {
+            chunk->offset += bytes;
+            return;
+        }
+        bytes -= left;
+        queue->head = chunk->next;
+        chunk->next = NULL;
+        chunk->tag = tag;
+        append(held, chunk);
+    }
+    if (queue->head == NULL)
+        queue->tail = NULL;
+}
+
+/* releases held chunks from the head while their tag is not after done, tags may wrap */
+void queueReleaseHeld(Queue* held, unsigned done)
+{
+    while ((held->head != NULL) && ((int)(done - held->head->tag) >= 0)) {
+        struct _QueueChunk* chunk = held->head;
+        held->head = chunk->next;
+        held->bytes -= chunk->size;
+        freeChunk(held, chunk);
+    }
+    if (held->head == NULL)
+        held->tail = NULL;
+}
+
+/* fill at most count vectors from the head, returns number of filled */
+int queueIovec(const Queue* queue, struct iovec* iov, int count)
+{
+    const struct _QueueChunk* chunk;
+    int i = 0;
+
+    for (chunk = queue->head; (chunk != NULL) && (i < count); chunk = chunk->next, i++) {
+        iov[i].iov_base = (char*)chunk->data + chunk->offset;
+        iov[i].iov_len = chunk->size - chunk->offset;
+    }
+    return i;
+}
+
+/* copy buffer to the tail, returns -1 if out of memory or pool budget */
+int queuePush(Queue* queue, const void* buffer, unsigned size)
+{
+    struct _QueueChunk* chunk;
+
+    assert(size > 0);
+    chunk = allocChunk(queue, sizeof(*chunk) + size);
+    if (chunk == NULL)
+        return -1;
+    chunk->next = NULL;
+    chunk->data = (const char*)(chunk + 1);
+    chunk->size = size;
+    chunk->offset = 0;
+    chunk->shared = NULL;
+    memcpy(chunk + 1, buffer, size);
+    append(queue, chunk);
+    return 0;
+}
+
+/*
+Queue by reference, the payload is not copied, but it is charged to the
+pool budget of every queue holding it. Returns -1 like queuePush.
+*/
+int queuePushBuffer(Queue* queue, QueueBuffer* buffer)
+{
+    struct _QueueChunk* chunk = allocChunk(queue, sizeof(*chunk));
+
+    if (chunk == NULL)
+        return -1;
+    if ((queue->pool != NULL) && (poolCharge(queue->pool, buffer->size) == -1)) {
+        poolFree(queue->pool, chunk, sizeof(*chunk));
+        return -1;
+    }
+    chunk->next = NULL;
+    chunk->data = buffer->data;
+    chunk->size = buffer->size;
+    chunk->offset = 0;
+    chunk->shared = queueBufferRetain(buffer);
+    append(queue, chunk);
+    return 0;
+}
@@ -0,0 +1,36 @@
+#ifndef _QUEUE_H
+#define _QUEUE_H
+
+struct iovec;
+struct _Pool;
+struct _QueueChunk;
+struct _QueueBuffer;
+
+/* immutable reference counted payload, may be queued on many connections */
+typedef struct _QueueBuffer QueueBuffer;
+
+/* FIFO of output chunks waiting to be sent on one connection */
+typedef struct _Queue {
+    struct _QueueChunk* head;
+    struct _QueueChunk* tail;
+    unsigned long bytes; /* total bytes not sent yet */
+    struct _Pool* pool; /* where chunks come from, NULL for heap */
+} Queue;
+
+QueueBuffer* queueBufferCreate(const void* buffer, unsigned size);
+const char* queueBufferData(const QueueBuffer* buffer);
+void queueBufferRelease(QueueBuffer* buffer);
+QueueBuffer* queueBufferRetain(QueueBuffer* buffer);
+unsigned queueBufferSize(const QueueBuffer* buffer);
+
+unsigned queueChunkSize(unsigned size);
+void queueInit(Queue* queue, struct _Pool* pool);
+void queueClear(Queue* queue);
+void queueConsume(Queue* queue, unsigned long bytes);
+void queueConsumeHeld(Queue* queue, unsigned long bytes, Queue* held, unsigned tag);
+int queueIovec(const Queue* queue, struct iovec* iov, int count);
+int queuePush(Queue* queue, const void* buffer, unsigned size);
+int queuePushBuffer(Queue* queue, QueueBuffer* buffer);
+void queueReleaseHeld(Queue* held, unsigned done);
+
+#endif /*_QUEUE_H */
@@ -2,16 +2,177 @@
 #define _SELECT_H
 
 struct Socket;
+struct _QueueBuffer;
 
+#define SELECT_TIMEOUT_IDLE 1 /* neither received nor sent anything */
+#define SELECT_TIMEOUT_READ 2 /* received nothing */
+#define SELECT_TIMEOUT_WRITE 3 /* queued output made no progress */
+
+#define SELECT_SLOW_BLOCK 0 /* pause reading from connections which produce data for it */
+#define SELECT_SLOW_DROP 1 /* drop messages which do not fit under the high watermark */
+#define SELECT_SLOW_CLOSE 2 /* close it, reported by SelectHandlers.serverSentErr with ENOBUFS */
+
+#define SELECT_FRAME_NONE 0 /* data goes to SelectHandlers.serverRecvOk as it comes */
+#define SELECT_FRAME_LENGTH 1 /* big-endian length of frameLengthBytes, then the message */
+#define SELECT_FRAME_DELIMITER 2 /* the message ends with frameDelimiter */
+
+#define SELECT_HISTOGRAM_BUCKETS 32
+
+/* bucket 0 counts zeros, bucket i values in [2^(i-1), 2^i), the last one the rest */
+typedef struct _SelectHistogram {
+    unsigned long count;
+    unsigned long long sum;
+    unsigned long bucket[SELECT_HISTOGRAM_BUCKETS];
+} SelectHistogram;
+
+/* counters of one loop since start, see selectMetrics() */
+typedef struct _SelectMetrics {
+    unsigned long accepts;
+    unsigned long disconnects; /* every closed connection */
+    unsigned long recvCalls; /* socketRecv calls or recv completions */
+    unsigned long recvAgain; /* of them found no data */
+    unsigned long long recvBytes;
+    unsigned long sendCalls;
+    unsigned long sendAgain; /* of them found no room */
+    unsigned long long sendBytes;
+    unsigned long zeroCopySends; /* send calls made with MSG_ZEROCOPY */
+    unsigned long zeroCopyCopied; /* of them the kernel has copied anyway */
+    unsigned long wakeups; /* returns from poll */
+    unsigned long events; /* ready events handled */
+    unsigned long posted; /* sends and closes from other threads, see selectPostSend() */
+    unsigned long offloaded; /* received data handed to SelectOptions.workers */
+    unsigned long connected; /* connections now */
+    unsigned long slotsUsed; /* the most connections so far */
+    SelectHistogram waitTime; /* us blocked in poll */
+    SelectHistogram eventsPerWakeup;
+    SelectHistogram callbackTime; /* ns spent in SelectHandlers.serverRecvOk */
+    SelectHistogram queueDepth; /* output bytes of a connection after queuing more */
+} SelectMetrics;
+
+/* names a connection for other threads, see selectHandle() */
+typedef struct _SelectHandle {
+    const void* context; /* loop of the connection */
+    int slot;
+    unsigned serial; /* tells apart connections which used the slot */
+} SelectHandle;
+
+/*
+Callbacks of one server instance, see SelectOptions.handlers. NULL ones
+are not called. context is the loop of the connection, data is what
+selectSetData() has stored for it, NULL until then. A connection of
+selectConnect starts with data = arg.
+workerRecv runs in a thread of SelectOptions.workers instead of
+serverRecvOk or serverMessage, in order for every connection. It may
+call only thread-safe functions, such as selectPostSend(). A connection
+is not closed while it has jobs, a failure or timeout is reported after
+them, so data stays valid for them unless it is freed after selectClose().
+*/
+typedef struct _SelectHandlers {
+    void (*clientConnect)(const Socket* sock, void* arg, const void* context);
+    void (*clientConnectErr)(void* arg, const void* context);
+    void (*serverConnect)(const Socket* sock, const void* context);
+    void (*serverDisconnect)(const Socket* sock, void* data, const void* context);
+    void (*serverMessage)(const Socket* sock, void* data, char* message, unsigned size, const void* context);
+    void (*serverRecvErr)(const Socket* sock, void* data, const void* context);
+    void (*serverRecvOk)(const Socket* sock, void* data, char* buffer, unsigned size, const void* context);
+    void (*serverSentErr)(const Socket* sock, void* data, const void* context);
+    void (*serverSentOk)(const Socket* sock, void* data, char* buffer, unsigned size, const void* context);
+    void (*serverTimeout)(const Socket* sock, void* data, int reason, const void* context);
+    void (*workerRecv)(const SelectHandle* handle, void* data, char* buffer, unsigned size);
+} SelectHandlers;
+
+/* timer of one loop, must be used only from its callbacks */
+typedef struct _SelectTimer SelectTimer;
+typedef void (*SelectTimerCallback)(void* arg, const void* context);
+
+/* tuning of one server instance, selectOptionsInit() sets defaults */
+typedef struct _SelectOptions {
+    const SelectHandlers* handlers; /* must stay valid while the server runs */
+    void* user; /* of the server instance, see selectUser() */
+    int maxChunkSize; /* bytes per one socketRecv call */
+    int acceptBatch; /* connections taken by one socketAcceptMany call */
+    int acceptBudget; /* connections accepted per loop wakeup */
+    unsigned long memoryBudget; /* bytes queued for sending by all loops, shared data counts per connection, 0 if unlimited */
+    unsigned long readBudget; /* bytes read from one connection per loop wakeup */
+    int readCalls; /* socketRecv calls on one connection per loop wakeup */
+    unsigned long idleTimeout; /* ms, connections are closed by SELECT_TIMEOUT_XXX, 0 if none */
+    unsigned long readTimeout;
+    unsigned long writeTimeout;
+    unsigned long highWatermark; /* output bytes of one connection which make it slow, 0 if unlimited */
+    unsigned long lowWatermark; /* output bytes below which a slow connection is fine again */
+    int slowPolicy; /* SELECT_SLOW_XXX, what to do with slow connections */
+    unsigned long metricsInterval; /* ms between dumps of metrics to stderr, 0 if never */
+    int metricsSignal; /* signal which dumps metrics to stderr, 0 if none */
+    const char* traceFile; /* traces of all loops are written there on a crash, NULL if not */
+    int framing; /* SELECT_FRAME_XXX, other than NONE delivers messages to SelectHandlers.serverMessage */
+    int frameLengthBytes; /* 1 to 4 */
+    char frameDelimiter;
+    unsigned long maxFrameSize; /* bytes of a message, longer ones close the connection with EMSGSIZE */
+    int upstreamIdle; /* connections kept for reuse per selectConnect address, 0 if none */
+    unsigned long upstreamIdleTimeout; /* ms a kept connection waits for reuse */
+    SocketProfile profile; /* applied to accepted and connected sockets */
+    unsigned long zeroCopyThreshold; /* bytes of one send call from which MSG_ZEROCOPY is used, 0 if never */
+    int relaySplice; /* selectRelay moves data by splice(2) where it can, 0 copies it through user space */
+    unsigned long duplexOutput; /* output bytes of a connection below which it is still read, 0 reads only without output */
+    int workers; /* threads running SelectHandlers.workerRecv, 0 runs all handlers in the loops */
+    unsigned long workerBacklog; /* bytes of a connection waiting for workers above which it is not read */
+} SelectOptions;
+
+typedef struct _SelectMemoryStats {
+    unsigned long blocks; /* pool blocks allocated from heap */
+    unsigned long blocksUsed; /* blocks holding data in flight */
+    unsigned long blockSize;
+    unsigned long bytesUsed; /* bytes in flight, including chunks larger than a block and shared buffers */
+    unsigned long budget; /* SelectOptions.memoryBudget shared by all loops, 0 if unlimited */
+} SelectMemoryStats;
+
+/* flow control actions of one loop since start */
+typedef struct _SelectFlowStats {
+    unsigned long slow; /* connections above the high watermark now */
+    unsigned long paused; /* times reading from a producing connection was paused */
+    unsigned long resumed;
+    unsigned long droppedMessages;
+    unsigned long droppedBytes;
+    unsigned long closed; /* slow connections closed */
+} SelectFlowStats;
+
+int selectBroadcast(const Socket** sock, int count, const char* buffer, unsigned size, const void* context);
+int selectBroadcastAll(const char* buffer, unsigned size, const void* context);
+void* selectData(const Socket* sock, const void* context);
+void selectClose(const Socket* sock, const void* context);
+int selectConnect(unsigned int ip4, unsigned short port, unsigned long timeout, void* arg, const void* context);
+void selectFlowStats(const void* context, SelectFlowStats* stats);
+void selectHandle(const Socket* sock, const void* context, SelectHandle* handle);
+unsigned long long selectHistogramPercentile(const SelectHistogram* histogram, double fraction);
 int selectMaxConnections(void);
-void selectSend(const Socket* sock, const char* buffer, unsigned size, const void* context);
-int selectServer(const Socket* listen, int maxChunkSize);
-void onSelectServerConnect(const Socket* sock);
-void onSelectServerDisconnect(const Socket* sock);
-void onSelectServerRecvErr(const Socket* sock);
-void onSelectServerRecvOk(const Socket* sock, char* buffer, unsigned size, const void* context);
-void onSelectServerSentErr(const Socket* sock);
-void onSelectServerSentOk(const Socket* sock, char* buffer, unsigned size, const void* context);
+void selectMemoryStats(const void* context, SelectMemoryStats* stats);
+void selectMetrics(const void* context, SelectMetrics* metrics);
+int selectMetricsFormat(const SelectMetrics* metrics, char* buffer, unsigned size);
+void selectOptionsInit(SelectOptions* options);
+int selectPostClose(const SelectHandle* handle);
+int selectPostSend(const SelectHandle* handle, const char* buffer, unsigned size);
+int selectPublish(const char* topic, unsigned length, const char* buffer, unsigned size, const void* context);
+int selectRelay(const Socket* sock, unsigned int ip4, unsigned short port, unsigned long timeout,
+    const void* context);
+void selectRelease(const Socket* sock, const void* context);
+int selectSlot(const Socket* sock, const void* context);
+int selectSend(const Socket* sock, const char* buffer, unsigned size, const void* context);
+int selectSendBuffer(const Socket* sock, QueueBuffer* buffer, const void* context);
+int selectServer(const Socket* listen, int maxChunkSize, const SelectHandlers* handlers, void* user);
+int selectServerListeners(const Socket** listen, int count, const SelectOptions* options);
+int selectServerOptions(const Socket* listen, const SelectOptions* options);
+int selectServerThreads(const Socket** listen, int count, const SelectOptions* options, int pinned);
+void selectSetData(const Socket* sock, void* data, const void* context);
+void selectSetTimeouts(const Socket* sock, unsigned long idle, unsigned long read, unsigned long write,
+    const void* context);
+void selectSetWatermarks(const Socket* sock, unsigned long high, unsigned long low, const void* context);
+int selectSubscribe(const Socket* sock, const char* topic, unsigned length, const void* context);
+SelectTimer* selectTimerStart(unsigned long delay, unsigned long period, SelectTimerCallback callback, void* arg,
+    const void* context);
+void selectTimerStop(SelectTimer* timer, const void* context);
+int selectTraceDump(int fd);
+int selectUnsubscribe(const Socket* sock, const char* topic, unsigned length, const void* context);
+void* selectUser(const void* context);
 
 #endif /*_SELECT_H */
 
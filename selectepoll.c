@@ -0,0 +1,142 @@
+#if defined(EPOLL) || defined(URING)
+
+#if !defined(LINUX)
+#error "epoll is available only with -DLINUX"
+#endif
+
+#include <assert.h>
+#include <sys/epoll.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "debug.h"
+#include "selectpoll.h"
+
+struct SelectEpoll {
+    struct SelectPoll base;
+    int epfd; /* epoll instance descriptor */
+    struct epoll_event* ready; /* buffer for epoll_wait() */
+    int readySize;
+};
+
+static unsigned toEpoll(unsigned events)
+{
+    unsigned ev = 0;
+    if (events & SELECT_POLL_IN) ev |= EPOLLIN;
+    if (events & SELECT_POLL_OUT) ev |= EPOLLOUT;
+    return ev;
+}
+
+static int control(struct SelectEpoll* poll, int op, int fd, unsigned events, void* data)
+{
+    struct epoll_event ev;
+
+    ev.events = toEpoll(events);
+    ev.data.ptr = data;
+    return epoll_ctl(poll->epfd, op, fd, &ev);
+}
+
+static void epollDestroy(struct SelectPoll* base)
+{
+    struct SelectEpoll* poll = (struct SelectEpoll*)base;
+
+    close(poll->epfd);
+    free(poll->ready);
+    free(poll);
+}
+
+/*
+epoll reports EPOLLERR and EPOLLHUP even with no events requested, so a
+reset peer of a paused connection would wake every wait. A descriptor
+which waits for nothing is not in the epoll set until it wants events.
+*/
+static int epollAdd(struct SelectPoll* base, int fd, unsigned events, void* data)
+{
+    if (events == 0)
+        return 0;
+    return control((struct SelectEpoll*)base, EPOLL_CTL_ADD, fd, events, data);
+}
+
+static int epollModify(struct SelectPoll* base, int fd, unsigned events, void* data)
+{
+    struct SelectEpoll* poll = (struct SelectEpoll*)base;
+
+    if (events == 0)
+        return ((control(poll, EPOLL_CTL_DEL, fd, 0, data) == -1) && (errno != ENOENT)) ? -1 : 0;
+    if (control(poll, EPOLL_CTL_MOD, fd, events, data) == 0)
+        return 0;
+    if (errno != ENOENT)
+        return -1;
+    return control(poll, EPOLL_CTL_ADD, fd, events, data); /* wanted nothing until now */
+}
+
+static int epollRemove(struct SelectPoll* base, int fd)
+{
+    struct SelectEpoll* poll = (struct SelectEpoll*)base;
+    struct epoll_event ev; /* ignored, but must be non-NULL before 2.6.9 */
+
+    if ((epoll_ctl(poll->epfd, EPOLL_CTL_DEL, fd, &ev) == -1) && (errno != ENOENT))
+        return -1; /* ENOENT if it has waited for nothing */
+    return 0;
+}
+
+/*
+timeout - in milliseconds, -1 waits forever.
+Returns number of filled events, 0 on timeout or signal, -1 on error.
+Only descriptors which are ready are returned.
+*/
+static int epollWait(struct SelectPoll* base, struct SelectPollEvent* events, int maxEvents, int timeout)
+{
+    struct SelectEpoll* poll = (struct SelectEpoll*)base;
+    int rc, i;
+
+    if (maxEvents > poll->readySize)
+        maxEvents = poll->readySize;
+    rc = epoll_wait(poll->epfd, poll->ready, maxEvents, timeout);
+    if (rc == -1) {
+        if (errno == EINTR) /* was interruped by a signal */
+            return 0;
+        return -1;
+    }
+    for (i = 0; i < rc; i++) {
+        unsigned ev = poll->ready[i].events;
+        events[i].data = poll->ready[i].data.ptr;
+        events[i].events = 0;
+        /* errors and hang up are reported by the following recv/send */
+        if (ev & (EPOLLIN | EPOLLHUP | EPOLLERR))
+            events[i].events |= SELECT_POLL_IN;
+        if (ev & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+            events[i].events |= SELECT_POLL_OUT;
+    }
+    return rc;
+}
+
+static const struct SelectPollOps ops = {
+    epollDestroy, epollAdd, epollModify, epollRemove, epollWait,
+    NULL, NULL, NULL, NULL /* readiness only */
+};
+
+struct SelectPoll* selectEpollCreate(int maxEvents)
+{
+    struct SelectEpoll* poll;
+
+    assert(maxEvents > 0);
+    poll = calloc(1, sizeof(*poll));
+    if (poll == NULL)
+        return NULL;
+    poll->base.ops = &ops;
+    poll->readySize = maxEvents;
+    poll->ready = malloc(maxEvents * sizeof(struct epoll_event));
+    poll->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if ((poll->ready == NULL) || (poll->epfd == -1)) {
+        if (poll->epfd != -1) close(poll->epfd);
+        free(poll->ready);
+        free(poll);
+        return NULL;
+    }
+    return &poll->base;
+}
+
+#endif /* EPOLL || URING */
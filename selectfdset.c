@@ -0,0 +1,144 @@
+#if !defined(EPOLL) && !defined(URING)
+
+#include <assert.h>
+#include <sys/select.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "debug.h"
+#include "selectpoll.h"
+
+struct SelectFdset {
+    struct SelectPoll base;
+    fd_set ractual, wactual;
+    fd_set registered; /* descriptors added and not removed yet */
+    int maxfd; /* highest registered descriptor, -1 if none */
+    void* data[FD_SETSIZE]; /* descriptor -> registered data */
+};
+
+static void update(struct SelectFdset* poll, int fd, unsigned events)
+{
+    if (events & SELECT_POLL_IN)
+        FD_SET(fd, &poll->ractual);
+    else
+        FD_CLR(fd, &poll->ractual);
+    if (events & SELECT_POLL_OUT)
+        FD_SET(fd, &poll->wactual);
+    else
+        FD_CLR(fd, &poll->wactual);
+}
+
+static void fdsetDestroy(struct SelectPoll* poll)
+{
+    free(poll);
+}
+
+static int fdsetAdd(struct SelectPoll* base, int fd, unsigned events, void* data)
+{
+    struct SelectFdset* poll = (struct SelectFdset*)base;
+
+    assert(poll != NULL);
+    if ((fd < 0) || (fd >= FD_SETSIZE)) { /* select() can't watch it */
+        errno = EBADF;
+        return -1;
+    }
+    poll->data[fd] = data;
+    update(poll, fd, events);
+    FD_SET(fd, &poll->registered);
+    if (fd > poll->maxfd)
+        poll->maxfd = fd;
+    return 0;
+}
+
+static int fdsetModify(struct SelectPoll* base, int fd, unsigned events, void* data)
+{
+    struct SelectFdset* poll = (struct SelectFdset*)base;
+
+    assert(poll != NULL);
+    assert((fd >= 0) && (fd <= poll->maxfd));
+    poll->data[fd] = data;
+    update(poll, fd, events);
+    return 0;
+}
+
+static int fdsetRemove(struct SelectPoll* base, int fd)
+{
+    struct SelectFdset* poll = (struct SelectFdset*)base;
+
+    assert(poll != NULL);
+    assert((fd >= 0) && (fd <= poll->maxfd));
+    FD_CLR(fd, &poll->ractual);
+    FD_CLR(fd, &poll->wactual);
+    FD_CLR(fd, &poll->registered);
+    poll->data[fd] = NULL;
+    while ((poll->maxfd >= 0) && !FD_ISSET(poll->maxfd, &poll->registered))
+        poll->maxfd--;
+    return 0;
+}
+
+/*
+timeout - in milliseconds, -1 waits forever.
+Returns number of filled events, 0 on timeout or signal, -1 on error.
+*/
+static int fdsetWait(struct SelectPoll* base, struct SelectPollEvent* events, int maxEvents, int timeout)
+{
+    struct SelectFdset* poll = (struct SelectFdset*)base;
+    fd_set rset = poll->ractual;
+    fd_set wset = poll->wactual;
+    struct timeval tv, *ptv = NULL;
+    int rc, fd, n = 0;
+
+    if (timeout >= 0) {
+        tv.tv_sec = timeout / 1000;
+        tv.tv_usec = (timeout % 1000) * 1000;
+        ptv = &tv;
+    }
+    rc = select(poll->maxfd + 1, &rset, &wset, NULL, ptv);
+    if (rc == -1) {
+        if (errno == EINTR) /* was interruped by a signal */
+            return 0;
+        return -1;
+    }
+    /* only descriptors up to maxfd are looked at */
+    for (fd = 0; (fd <= poll->maxfd) && (rc > 0) && (n < maxEvents); fd++) {
+        unsigned ev = 0;
+        if (FD_ISSET(fd, &rset)) {
+            ev |= SELECT_POLL_IN;
+            rc--;
+        }
+        if (FD_ISSET(fd, &wset)) {
+            ev |= SELECT_POLL_OUT;
+            rc--;
+        }
+        if (ev == 0)
+            continue;
+        events[n].data = poll->data[fd];
+        events[n].events = ev;
+        n++;
+    }
+    return n;
+}
+
+static const struct SelectPollOps ops = {
+    fdsetDestroy, fdsetAdd, fdsetModify, fdsetRemove, fdsetWait,
+    NULL, NULL, NULL, NULL /* readiness only */
+};
+
+struct SelectPoll* selectFdsetCreate(int maxEvents)
+{
+    struct SelectFdset* poll;
+
+    assert(maxEvents > 0);
+    poll = calloc(1, sizeof(*poll));
+    if (poll == NULL)
+        return NULL;
+    poll->base.ops = &ops;
+    FD_ZERO(&poll->ractual);
+    FD_ZERO(&poll->wactual);
+    FD_ZERO(&poll->registered);
+    poll->maxfd = -1;
+    return &poll->base;
+}
+
+#endif /* !EPOLL && !URING */
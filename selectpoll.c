@@ -0,0 +1,109 @@
+#include <assert.h>
+#include <sys/resource.h>
+#include <sys/select.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "debug.h"
+#include "selectpoll.h"
+
+int selectPollAccept(struct SelectPoll* poll, int fd, void* data)
+{
+    assert(poll->ops->accept != NULL);
+    return poll->ops->accept(poll, fd, data);
+}
+
+int selectPollAdd(struct SelectPoll* poll, int fd, unsigned events, void* data)
+{
+    return poll->ops->add(poll, fd, events, data);
+}
+
+int selectPollAsync(const struct SelectPoll* poll)
+{
+    return poll->ops->accept != NULL;
+}
+
+/*
+bufferSize - size of receive buffers for pollers doing I/O themselves.
+The best implementation compiled in is tried first.
+*/
+struct SelectPoll* selectPollCreate(int maxEvents, unsigned bufferSize)
+{
+    struct SelectPoll* poll = NULL;
+
+    assert((maxEvents > 0) && (bufferSize > 0));
+#if defined(URING)
+    poll = selectUringCreate(maxEvents, bufferSize);
+    if (poll != NULL)
+        return poll;
+    debugPrintf("io_uring is not available, falling back to epoll");
+#endif
+#if defined(EPOLL) || defined(URING)
+    poll = selectEpollCreate(maxEvents);
+#else
+    poll = selectFdsetCreate(maxEvents);
+#endif
+    return poll;
+}
+
+void selectPollDestroy(struct SelectPoll* poll)
+{
+    if (poll != NULL)
+        poll->ops->destroy(poll);
+}
+
+/* the maximum descriptor number + 1 the poller can watch */
+int selectPollLimit(void)
+{
+#if defined(EPOLL) || defined(URING)
+    struct rlimit rl; /* the number of connections is bounded only by the descriptor limit */
+
+    if ((getrlimit(RLIMIT_NOFILE, &rl) == -1) || (rl.rlim_cur == RLIM_INFINITY))
+        return FD_SETSIZE;
+    if (rl.rlim_cur > (rlim_t)(1 << 30))
+        return 1 << 30;
+    return (int)rl.rlim_cur;
+#else
+    return FD_SETSIZE;
+#endif
+}
+
+int selectPollModify(struct SelectPoll* poll, int fd, unsigned events, void* data)
+{
+    return poll->ops->modify(poll, fd, events, data);
+}
+
+/* starts or stops delivering SELECT_POLL_RECV completions for fd */
+int selectPollRecv(struct SelectPoll* poll, int fd, int enable)
+{
+    assert(poll->ops->recv != NULL);
+    return poll->ops->recv(poll, fd, enable);
+}
+
+void selectPollRecycle(struct SelectPoll* poll, const struct SelectPollEvent* event)
+{
+    assert(poll->ops->recycle != NULL);
+    poll->ops->recycle(poll, event);
+}
+
+int selectPollRemove(struct SelectPoll* poll, int fd)
+{
+    return poll->ops->remove(poll, fd);
+}
+
+/* iov is copied, but the data must stay valid until SELECT_POLL_SENT for fd */
+int selectPollSend(struct SelectPoll* poll, int fd, const struct iovec* iov, int count)
+{
+    assert(poll->ops->send != NULL);
+    return poll->ops->send(poll, fd, iov, count);
+}
+
+/*
+timeout - in milliseconds, -1 waits forever.
+Returns number of filled events, 0 on timeout or signal, -1 on error.
+*/
+int selectPollWait(struct SelectPoll* poll, struct SelectPollEvent* events, int maxEvents, int timeout)
+{
+    return poll->ops->wait(poll, events, maxEvents, timeout);
+}
@@ -0,0 +1,70 @@
+#ifndef _SELECTPOLL_H
+#define _SELECTPOLL_H
+
+/*
+   Readiness notification used by the selectServer() loop.
+   The implementation is chosen at compile time:
+   selectfdset.c - portable select(2), default
+   selectepoll.c - Linux epoll(7), compile with -DEPOLL
+   selecturing.c - Linux io_uring, compile with -DURING, falls back
+                   to epoll at runtime if the kernel can't run it
+*/
+
+#define SELECT_POLL_IN     0x1 /* readable */
+#define SELECT_POLL_OUT    0x2 /* writable */
+#define SELECT_POLL_ACCEPT 0x4 /* completion, result is new descriptor or -errno */
+#define SELECT_POLL_RECV   0x8 /* completion, result is bytes in buffer, 0 on EOF or -errno */
+#define SELECT_POLL_SENT   0x10 /* completion, result is bytes sent or -errno */
+
+struct iovec;
+struct SelectPoll;
+
+struct SelectPollEvent {
+    void* data; /* pointer registered with selectPollAdd() */
+    unsigned events; /* SELECT_POLL_XXX */
+    int result; /* of completion events */
+    char* buffer; /* SELECT_POLL_RECV data, give back with selectPollRecycle() */
+    unsigned bufferId;
+};
+
+/*
+Pollers which perform I/O themselves (selectPollAsync() is not zero)
+also implement accept, recv, send and recycle. Then data of accepted
+descriptors is not reported as readiness but delivered by completions.
+*/
+struct SelectPollOps {
+    void (*destroy)(struct SelectPoll* poll);
+    int (*add)(struct SelectPoll* poll, int fd, unsigned events, void* data);
+    int (*modify)(struct SelectPoll* poll, int fd, unsigned events, void* data);
+    int (*remove)(struct SelectPoll* poll, int fd);
+    int (*wait)(struct SelectPoll* poll, struct SelectPollEvent* events, int maxEvents, int timeout);
+    int (*accept)(struct SelectPoll* poll, int fd, void* data);
+    int (*recv)(struct SelectPoll* poll, int fd, int enable);
+    int (*send)(struct SelectPoll* poll, int fd, const struct iovec* iov, int count);
+    void (*recycle)(struct SelectPoll* poll, const struct SelectPollEvent* event);
+};
+
+/* first member of every implementation */
+struct SelectPoll {
+    const struct SelectPollOps* ops;
+};
+
+int selectPollAccept(struct SelectPoll* poll, int fd, void* data);
+int selectPollAdd(struct SelectPoll* poll, int fd, unsigned events, void* data);
+int selectPollAsync(const struct SelectPoll* poll);
+struct SelectPoll* selectPollCreate(int maxEvents, unsigned bufferSize);
+void selectPollDestroy(struct SelectPoll* poll);
+int selectPollLimit(void);
+int selectPollModify(struct SelectPoll* poll, int fd, unsigned events, void* data);
+int selectPollRecv(struct SelectPoll* poll, int fd, int enable);
+void selectPollRecycle(struct SelectPoll* poll, const struct SelectPollEvent* event);
+int selectPollRemove(struct SelectPoll* poll, int fd);
+int selectPollSend(struct SelectPoll* poll, int fd, const struct iovec* iov, int count);
+int selectPollWait(struct SelectPoll* poll, struct SelectPollEvent* events, int maxEvents, int timeout);
+
+/* implementations */
+struct SelectPoll* selectEpollCreate(int maxEvents);
+struct SelectPoll* selectFdsetCreate(int maxEvents);
+struct SelectPoll* selectUringCreate(int maxEvents, unsigned bufferSize);
+
+#endif /*_SELECTPOLL_H */
@@ -1,218 +1,2903 @@
+#if defined(LINUX)
+#define _GNU_SOURCE /* pthread_setaffinity_np */
+#endif
+
 #include <assert.h>
-#include <sys/select.h>
+#include <sys/uio.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#if defined(LINUX)
+#include <sys/eventfd.h>
+#endif
 
 #include "debug.h"
 #include "error.h"
+#include "pool.h"
+#include "queue.h"
 #include "socket.h"
 #include "select.h"
+#include "selectpoll.h"
+#include "timer.h"
+#include "topic.h"
+#include "trace.h"
+
+#define MAX_EVENTS 1024 /* events handled per one wakeup */
+#define MAX_IOVEC 64 /* queued chunks written by one socketSendv */
+#define RELAY_CHUNK (64 * 1024) /* bytes spliced by one call, the default pipe capacity */
+
+#define CLIENT_OPEN 0 /* in use by the application */
+#define CLIENT_CONNECTING 1 /* selectConnect waits for the connect to complete */
+#define CLIENT_REUSED 2 /* taken from upstream idle list, SelectHandlers.clientConnect is due */
+#define CLIENT_IDLE 3 /* released to its upstream, waits for reuse */
+
+#define CLOSING_SLOW 1 /* slow with SELECT_SLOW_CLOSE */
+#define CLOSING_ASKED 2 /* by selectClose or selectRelease, no more callbacks */
+#define CLOSING_PEER 3 /* the other end of its relay has gone, or both have sent EOF */
+#define CLOSING_FAILED 4 /* reading or writing failed while workers had jobs, reported after them */
+
+#define FAILED_RECV 1 /* reported by SelectHandlers.serverRecvErr */
+#define FAILED_SENT 2 /* reported by SelectHandlers.serverSentErr */
+
+#define RELAY_EOF 1 /* the end has sent EOF, it is passed on after the data before it */
+#define RELAY_SHUT 2 /* the other end has got the EOF */
+
+struct SelectLoop;
 
 struct SelectPrivate {
     Socket* sock;
-    fd_set* ractual, *wactual; /* pointers to fd_set's in selectServer() */
-    char* buffer; /* internal buffer */
-    unsigned buferSize; /* buffer size equal to maxChunkSize */
-    char* data; /* data offset in buffer */
-    unsigned dataSize; /* size of remaining data  */
+    struct SelectLoop* loop; /* owner of this slot */
+    struct SelectPrivate* nextFree; /* next free slot while sock is NULL */
+    int slot; /* index in SelectLoop.client */
+    int position; /* index in SelectLoop.connected */
+    unsigned events; /* SELECT_POLL_IN/OUT currently registered */
+    int sending; /* selectPollSend() is in flight, async poller only */
+    int notifying; /* SelectHandlers.serverSentOk runs, sends from it wait for poll */
+    unsigned long unreported; /* bytes at the head of output written by startSending, not reported yet */
+    struct SelectPrivate* nextUnreported; /* in SelectLoop.unreported */
+    int listed; /* in SelectLoop.unreported, stays there until reported even if closed */
+    Queue output; /* data waiting to be sent, chunks from SelectLoop.pool */
+    Timer deadline; /* the earliest timeout, rescheduled lazily when it fires */
+    unsigned long idleTimeout, readTimeout, writeTimeout; /* ms, 0 if none */
+    unsigned long long lastRecv; /* ms of the last received data */
+    unsigned long long lastSent; /* ms of the last progress of sending */
+    unsigned long long writeSince; /* ms since output waits without progress */
+    unsigned serial; /* tells apart connections which used this slot */
+    unsigned long highWatermark, lowWatermark; /* output bytes, high is 0 if unlimited */
+    int slow; /* output went above high and has not dropped below low yet */
+    int closing; /* CLOSING_XXX, closed by its deadline timer */
+    int draining; /* closed by selectClose when the output is sent */
+    int ended; /* EOF read while output was queued, not read any more */
+    int waits; /* slow connections this one produced data for, does not read while not 0 */
+    struct SelectWaiter* waiter; /* producers paused because this one is slow */
+    int waiterCount, waiterSize;
+    char* frame; /* beginning of a message split between reads, from SelectLoop.pool */
+    unsigned long frameSize, frameCapacity;
+    int state; /* CLIENT_XXX */
+    unsigned long long stateDeadline; /* ms, when a state other than CLIENT_OPEN expires */
+    void* arg; /* of selectConnect, for the connect callbacks */
+    struct SelectUpstream* upstream; /* address it was connected to, NULL if accepted */
+    struct SelectPrivate* nextIdle; /* list of upstream idle connections */
+    struct SelectPrivate** prevIdle;
+    struct SelectPrivate* relay; /* the other end of selectRelay, NULL if not relayed */
+    int relayed; /* RELAY_XXX, 0 while this end sends data */
+    int internal; /* opened by selectRelay, the application does not know it */
+    int pipe[2]; /* data read from this end on the way to relay, splice(2) relays only, -1 if none */
+    unsigned long piped; /* bytes in pipe */
+    int zeroCopy; /* sends of SelectOptions.zeroCopyThreshold bytes use MSG_ZEROCOPY */
+    unsigned zeroCopySent, zeroCopyDone; /* such calls made and reported complete */
+    Queue held; /* sent output the kernel may still read, released as the calls complete */
+    TopicSubscriber topics; /* of selectSubscribe, left when closed */
+    void* data; /* of selectSetData, passed to the callbacks */
+    unsigned long offloaded; /* received bytes handed to workers and not done yet */
+    int jobs; /* of them */
+    int postponed; /* the deadline came while there were jobs, dispatch() restarts it */
+    int failure; /* FAILED_XXX of CLOSING_FAILED */
+    int error; /* errno of the failure */
 };
 
-int selectMaxConnections(void)
+/* outbound connections to one address, idle ones are kept for reuse */
+struct SelectUpstream {
+    unsigned int ip4;
+    unsigned short port;
+    struct SelectPrivate* idle; /* the most recently released first */
+    int idleCount;
+    struct SelectUpstream* next;
+};
+
+struct SelectWaiter {
+    struct SelectPrivate* client;
+    unsigned serial; /* the slot may be reused by the time it is resumed */
+};
+
+struct _SelectTimer {
+    Timer timer;
+    struct SelectLoop* loop;
+    unsigned long period; /* ms, 0 if one-shot */
+    SelectTimerCallback callback;
+    void* arg;
+    struct _SelectTimer* next; /* all timers of the loop */
+    struct _SelectTimer** prev;
+    int firing; /* callback is running */
+    int stopped; /* by its own callback */
+};
+
+#define MESSAGE_BROADCAST 0 /* buffer to every connection of the loop */
+#define MESSAGE_PUBLISH 1 /* buffer to the subscribers of the topic in bytes */
+#define MESSAGE_SEND 2 /* buffer to the connection of handle */
+#define MESSAGE_CLOSE 3 /* selectClose of the connection of handle */
+#define MESSAGE_WORK 4 /* bytes for SelectHandlers.workerRecv, back in the loop when done */
+
+/* posted to a loop or a worker from another thread */
+struct SelectMessage {
+    struct SelectMessage* next;
+    int kind; /* MESSAGE_XXX */
+    QueueBuffer* buffer; /* NULL if none */
+    SelectHandle handle; /* connection of SEND, CLOSE and WORK */
+    void* data; /* of the connection, WORK only */
+    char* bytes; /* topic of PUBLISH or data of WORK, allocated with the message */
+    unsigned length;
+};
+
+/* passed as context to the callbacks, one per thread */
+struct SelectLoop {
+    struct SelectPoll* poll;
+    int async; /* poller does I/O itself, see selectPollAsync() */
+    struct SelectPollEvent* events; /* being handled by loopRun */
+    int eventNext; /* index of the next one to handle */
+    int eventCount;
+    const Socket** listen; /* listen sockets served by the loop, poll data points to them */
+    int listenCount;
+    struct SelectPrivate* client; /* array of maxConnections slots */
+    struct SelectPrivate** index; /* descriptor -> slot, NULL if not connected */
+    struct SelectPrivate** connected; /* dense list of used slots */
+    int connectedCount;
+    struct SelectPrivate* freeSlot; /* head of free slots list */
+    int usedSlots; /* slots above never used, taken when free list is empty */
+    SelectOptions options;
+    SelectHandlers handlers; /* options.handlers with no-op functions for NULL ones */
+    struct SelectServer* server; /* loops which broadcast and publish to each other */
+    int maxChunkSize;
+    char* buffer; /* receive buffer, shared by all connections of the loop */
+    Pool pool; /* memory for data in flight */
+    Socket** spare; /* options.acceptBatch sockets ready for socketAcceptMany */
+    TimerWheel wheel;
+    struct SelectPrivate* producer; /* whose received data is being handled */
+    struct SelectPrivate* unreported; /* written from callbacks, reported after them by reportSent */
+    unsigned serial; /* of the last accepted connection */
+    SelectFlowStats flow;
+    SelectMetrics metrics; /* gauges are filled by selectMetrics() */
+    TraceRing trace; /* what the loop has been doing lately */
+    unsigned long long now; /* ms, updated once per wakeup */
+    SelectTimer* timers; /* started by selectTimerStart and not freed yet */
+    struct SelectUpstream* upstreams; /* addresses of selectConnect */
+    TopicIndex topics; /* of selectSubscribe */
+    struct SelectPrivate** fanout; /* subscribers of topics being published, callbacks may change topics */
+    int fanoutCount, fanoutSize;
+    int id; /* index in server->loops, printed with metrics */
+    int cpu; /* core to run on, -1 if not pinned */
+    int rc; /* exit code of the loop */
+    int dumped; /* the last metricsGeneration dumped */
+    pthread_t thread;
+    /* the only part touched by other threads */
+    struct SelectMessage* inbox; /* lock-free stack, the newest message first */
+    int wakeup[2]; /* eventfd on Linux, both ends are the same, otherwise pipe, read end is polled */
+    int stop; /* set by stopLoop, the loop returns when it wakes up */
+};
+
+/* thread of SelectOptions.workers, runs the jobs of its connections in order */
+struct SelectWorker {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    struct SelectMessage* first, *last; /* MESSAGE_WORK, oldest first */
+    int stop;
+};
+
+/* loops of one selectServerXXX() call, independent of other calls */
+struct SelectServer {
+    struct SelectLoop** loops;
+    int loopCount;
+    struct SelectWorker* workers; /* SelectOptions.workers of them, NULL if none */
+    int workerCount;
+    PoolBudget budget; /* SelectOptions.memoryBudget, shared by the pools of the loops */
+    struct SelectServer* next; /* in servers */
+};
+
+static int maxConnections = 0; /* size of SelectPrivate array */
+static struct SelectServer* servers = NULL; /* running ones, walked by signal handlers */
+static int signalUsers = 0; /* running servers, the first one installs signal handlers */
+static SelectOptions signalOptions; /* of the first server, restored with the handlers */
+static pthread_mutex_t serversLock = PTHREAD_MUTEX_INITIALIZER;
+static int metricsGeneration = 0; /* bumped by SelectOptions.metricsSignal, read by every loop */
+static const char* traceFile = NULL; /* SelectOptions.traceFile of running loops */
+
+#define CRASH_SIGNALS 5
+static const int crashSignal[CRASH_SIGNALS] = { SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT };
+
+/* handlers replaced while loops run */
+struct SelectSignals {
+    struct sigaction metrics;
+    struct sigaction crash[CRASH_SIGNALS];
+};
+
+static struct SelectSignals oldSignals; /* replaced by the first running server */
+
+/* bucket 0 is for 0, bucket i for [2^(i-1), 2^i) */
+static void record(SelectHistogram* histogram, unsigned long long value)
+{
+    int i = (value == 0) ? 0 : 64 - __builtin_clzll(value);
+
+    if (i >= SELECT_HISTOGRAM_BUCKETS)
+        i = SELECT_HISTOGRAM_BUCKETS - 1;
+    histogram->bucket[i]++;
+    histogram->count++;
+    histogram->sum += value;
+}
+
+static struct SelectPrivate* findClient(const struct SelectLoop* loop, const Socket* sock)
+{
+    int sd = *(int*)sock;
+
+    assert((sd >= 0) && (sd < maxConnections));
+    return loop->index[sd];
+}
+
+static void setEvents(struct SelectPrivate* client, unsigned events)
+{
+    int rc;
+
+    if (client->waits != 0) /* paused by flow control */
+        events &= ~SELECT_POLL_IN;
+    if (client->events == events)
+        return;
+    if (client->loop->async) { /* only reading is switched, sending is started by flushClient */
+        if ((client->events ^ events) & SELECT_POLL_IN)
+            rc = selectPollRecv(client->loop->poll, *(int*)client->sock, (events & SELECT_POLL_IN) != 0);
+        else
+            rc = 0;
+    } else {
+        rc = selectPollModify(client->loop->poll, *(int*)client->sock, events, client);
+    }
+    assert(rc == 0);
+    if (rc == -1) {
+        perror("poll");
+        return;
+    }
+    client->events = events;
+}
+
+static void dropEvents(struct SelectLoop* loop, struct SelectPrivate* client)
+{
+    int i;
+
+    for (i = loop->eventNext; i < loop->eventCount; i++) {
+        if (loop->events[i].data != client)
+            continue;
+        if (loop->events[i].buffer != NULL)
+            selectPollRecycle(loop->poll, &loop->events[i]);
+        loop->events[i].data = NULL;
+        loop->events[i].events = 0;
+    }
+}
+
+/* the earliest deadline of the connection, 0 if none */
+static unsigned long long deadline(const struct SelectPrivate* client, int* reason)
+{
+    unsigned long long when = 0, t;
+
+    if (client->state != CLIENT_OPEN) {
+        *reason = 0;
+        return client->stateDeadline;
+    }
+    if (client->idleTimeout != 0) {
+        t = (client->lastRecv > client->lastSent) ? client->lastRecv : client->lastSent;
+        when = t + client->idleTimeout;
+        *reason = SELECT_TIMEOUT_IDLE;
+    }
+    if (client->readTimeout != 0) {
+        t = client->lastRecv + client->readTimeout;
+        if ((when == 0) || (t < when)) {
+            when = t;
+            *reason = SELECT_TIMEOUT_READ;
+        }
+    }
+    if ((client->writeTimeout != 0) && (client->output.bytes != 0)) {
+        t = client->writeSince + client->writeTimeout;
+        if ((when == 0) || (t < when)) {
+            when = t;
+            *reason = SELECT_TIMEOUT_WRITE;
+        }
+    }
+    return when;
+}
+
+static void armDeadline(struct SelectPrivate* client)
+{
+    int reason;
+    unsigned long long when = deadline(client, &reason);
+
+    if (client->closing) /* already due */
+        return;
+    if (when == 0)
+        timerStop(&client->loop->wheel, &client->deadline);
+    else
+        timerStart(&client->loop->wheel, &client->deadline, when);
+}
+
+/* events the connection waits for, reading and writing are independent */
+static unsigned interest(const struct SelectPrivate* client)
+{
+    const struct SelectPrivate* relay = client->relay;
+    unsigned events;
+
+    if (relay == NULL) {
+        events = (client->output.bytes != 0) ? SELECT_POLL_OUT : 0;
+        /* a client which does not read its replies stops being read at some point */
+        if (!client->ended && ((client->output.bytes == 0)
+                || (client->output.bytes < client->loop->options.duplexOutput))
+                && ((client->offloaded == 0) || (client->offloaded < client->loop->options.workerBacklog)))
+            events |= SELECT_POLL_IN;
+        return events;
+    }
+    /* relay ends read and write at once, but do not read faster than the other end writes */
+    events = ((client->output.bytes != 0) || (relay->piped != 0)) ? SELECT_POLL_OUT : 0;
+    if ((relay->state == CLIENT_OPEN) && (client->relayed == 0)
+            && ((client->pipe[0] != -1) ? (client->piped == 0)
+                : (relay->output.bytes < client->loop->options.readBudget)))
+        events |= SELECT_POLL_IN;
+    return events;
+}
+
+/* resumes producers paused because the client was slow */
+static void releaseWaiters(struct SelectPrivate* client)
+{
+    struct SelectLoop* loop = client->loop;
+    int i;
+
+    for (i = 0; i < client->waiterCount; i++) {
+        struct SelectPrivate* producer = client->waiter[i].client;
+        if ((producer->sock == NULL) || (producer->serial != client->waiter[i].serial))
+            continue; /* closed meanwhile */
+        if (--producer->waits == 0) {
+            loop->flow.resumed++;
+            traceEvent(&loop->trace, TRACE_RESUME, *(int*)producer->sock, 0, 0);
+            setEvents(producer, interest(producer));
+        }
+    }
+    client->waiterCount = 0;
+    client->slow = 0;
+    loop->flow.slow--;
+}
+
+/* the deadline timer closes it, callbacks may still be running */
+static void closeLater(struct SelectPrivate* client, int how)
+{
+    client->closing = how;
+    timerStart(&client->loop->wheel, &client->deadline, client->loop->now);
+}
+
+/* releases output held for MSG_ZEROCOPY sends which the kernel has completed */
+static void reapZeroCopy(struct SelectPrivate* client)
+{
+    unsigned first, last;
+    int copied;
+
+    while (socketZeroCopyDone(client->sock, &first, &last, &copied) == 1) {
+        if ((int)(last + 1 - client->zeroCopyDone) > 0) /* TCP completes calls in order */
+            client->zeroCopyDone = last + 1;
+        if (copied) { /* over loopback for example, then pinning only costs */
+            client->loop->metrics.zeroCopyCopied += last - first + 1;
+            client->zeroCopy = 0;
+        }
+    }
+    queueReleaseHeld(&client->held, client->zeroCopyDone);
+}
+
+static void closeClient(struct SelectPrivate* client)
+{
+    struct SelectLoop* loop = client->loop;
+    Socket* sock = client->sock;
+    int rc;
+
+    selectPollRemove(loop->poll, *(int*)sock);
+    if (client->zeroCopySent != client->zeroCopyDone)
+        reapZeroCopy(client);
+    loop->metrics.disconnects++;
+    loop->index[*(int*)sock] = NULL;
+    loop->connected[client->position] = loop->connected[--loop->connectedCount];
+    loop->connected[client->position]->position = client->position;
+    rc = socketClose(sock);
+    traceEvent(&loop->trace, TRACE_CLOSE, *(int*)sock, (rc == -1) ? -errno : rc, client->output.bytes);
+    socketDestroy(sock);
+    queueClear(&client->output);
+    queueClear(&client->held); /* like unsent output, what the kernel still reads may change */
+    client->zeroCopy = 0;
+    client->zeroCopySent = client->zeroCopyDone = 0;
+    if (client->frame != NULL)
+        poolFree(&loop->pool, client->frame, client->frameCapacity);
+    client->frame = NULL;
+    client->frameSize = client->frameCapacity = 0;
+    timerStop(&loop->wheel, &client->deadline);
+    topicUnsubscribeAll(&loop->topics, &client->topics);
+    if (client->slow)
+        releaseWaiters(client);
+    if (client->state == CLIENT_IDLE) {
+        *client->prevIdle = client->nextIdle;
+        if (client->nextIdle != NULL)
+            client->nextIdle->prevIdle = client->prevIdle;
+        client->upstream->idleCount--;
+    }
+    if (client->relay != NULL) { /* the other end goes too */
+        struct SelectPrivate* relay = client->relay;
+        relay->relay = NULL;
+        client->relay = NULL;
+        setEvents(relay, 0);
+        if (!relay->closing)
+            closeLater(relay, CLOSING_PEER);
+    }
+    if (client->pipe[0] != -1) {
+        close(client->pipe[0]);
+        close(client->pipe[1]);
+    }
+    client->pipe[0] = client->pipe[1] = -1;
+    client->piped = 0;
+    client->relayed = 0;
+    client->internal = 0;
+    client->state = CLIENT_OPEN;
+    client->upstream = NULL;
+    client->arg = NULL;
+    client->data = NULL;
+    client->unreported = 0;
+    client->offloaded = 0;
+    client->jobs = 0;
+    client->postponed = 0;
+    client->waits = 0;
+    client->closing = 0;
+    client->draining = 0;
+    client->ended = 0;
+    client->sock = NULL; /* make available this slot */
+    client->events = 0;
+    client->sending = 0;
+    if (loop->async) /* completions already reaped for the slot must not reach its next owner */
+        dropEvents(loop, client);
+    client->nextFree = loop->freeSlot;
+    loop->freeSlot = client;
+}
+
+/* the application has given the connection up and expects no more callbacks */
+static int quiet(const struct SelectPrivate* client)
+{
+    return (client->closing == CLOSING_ASKED) || (client->closing == CLOSING_PEER)
+        || (client->closing == CLOSING_FAILED) || client->draining
+        || (client->state == CLIENT_IDLE) || client->internal;
+}
+
+/*
+Reading or writing has failed. While workers have jobs of the connection,
+they may still use its data, so the callback and the close wait for them.
+*/
+static void failClient(struct SelectPrivate* client, int failure)
+{
+    struct SelectLoop* loop = client->loop;
+
+    if (client->jobs != 0) { /* closed by deadlineExpired() after them */
+        setEvents(client, 0);
+        if (!quiet(client)) {
+            client->failure = failure;
+            client->error = errno;
+            closeLater(client, CLOSING_FAILED);
+        } else if (!client->closing) {
+            closeLater(client, CLOSING_ASKED);
+        }
+        return;
+    }
+    if (!quiet(client)) {
+        if (failure == FAILED_RECV)
+            loop->handlers.serverRecvErr(client->sock, client->data, loop);
+        else
+            loop->handlers.serverSentErr(client->sock, client->data, loop);
+    }
+    closeClient(client);
+}
+
+/* bytes read from a relay end and not written to the other end yet */
+static unsigned long relayPending(const struct SelectPrivate* client)
+{
+    return (client->pipe[0] != -1) ? client->piped : client->relay->output.bytes;
+}
+
+/*
+Passes EOF of an end on when the data before it is written, closes the relay
+when both ends are done, otherwise updates events of both ends.
+*/
+static void relayUpdate(struct SelectPrivate* client)
+{
+    struct SelectPrivate* end[2];
+    int i;
+
+    end[0] = client;
+    end[1] = client->relay;
+    if (end[1]->state != CLIENT_OPEN) { /* still connecting */
+        setEvents(client, interest(client));
+        return;
+    }
+    for (i = 0; i < 2; i++) {
+        if ((end[i]->relayed == RELAY_EOF) && (relayPending(end[i]) == 0)) {
+            socketShutdownSend(end[1 - i]->sock); /* on failure the next send fails */
+            end[i]->relayed = RELAY_SHUT;
+        }
+    }
+    for (i = 0; i < 2; i++) {
+        if ((end[0]->relayed != RELAY_SHUT) || (end[1]->relayed != RELAY_SHUT)) {
+            setEvents(end[i], interest(end[i]));
+            continue;
+        }
+        setEvents(end[i], 0);
+        if (!end[i]->closing)
+            closeLater(end[i], CLOSING_PEER);
+    }
+}
+
+/* rc bytes of iov have been written */
+static void sentClient(struct SelectPrivate* client, const struct iovec* iov, int count, int rc)
+{
+    unsigned long left;
+    int i;
+
+    /* report every chunk (or its part) before it is released */
+    client->notifying = 1;
+    for (i = 0, left = rc; (i < count) && (left > 0); i++) {
+        unsigned part = (left < iov[i].iov_len) ? left : iov[i].iov_len;
+        client->loop->handlers.serverSentOk(client->sock, client->data, iov[i].iov_base, part, client->loop);
+        left -= part;
+    }
+    client->notifying = 0;
+    if (client->zeroCopySent != client->zeroCopyDone) /* the kernel may still read them */
+        queueConsumeHeld(&client->output, rc, &client->held, client->zeroCopySent);
+    else
+        queueConsume(&client->output, rc);
+    client->loop->metrics.sendBytes += rc;
+    if (rc > 0)
+        client->lastSent = client->writeSince = client->loop->now;
+    if (client->slow && (client->output.bytes <= client->lowWatermark))
+        releaseWaiters(client);
+    if (client->relay != NULL) /* the other end may read again */
+        relayUpdate(client);
+    else
+        setEvents(client, interest(client));
+    if ((client->output.bytes == 0) && client->draining && !client->closing)
+        closeLater(client, CLOSING_ASKED);
+}
+
+static unsigned long iovecBytes(const struct iovec* iov, int count)
+{
+    unsigned long bytes = 0;
+    int i;
+
+    for (i = 0; i < count; i++)
+        bytes += iov[i].iov_len;
+    return bytes;
+}
+
+/*
+Reports data written by startSending, so that SelectHandlers.serverSentOk
+never runs from inside selectSend. Called by the loop between events.
+*/
+static void reportSent(struct SelectLoop* loop)
+{
+    struct iovec iov[MAX_IOVEC];
+    struct SelectPrivate* client;
+    unsigned long bytes;
+
+    while (loop->unreported != NULL) {
+        client = loop->unreported;
+        loop->unreported = client->nextUnreported;
+        client->listed = 0;
+        bytes = client->unreported;
+        client->unreported = 0;
+        if (bytes != 0) /* 0 if closed meanwhile */
+            sentClient(client, iov, queueIovec(&client->output, iov, MAX_IOVEC), bytes);
+    }
+}
+
+/*
+Writes as many queued chunks as possible with one call, an async poller
+only starts the write and sendCompleted() is called when it is done.
+A deferred write is reported later by reportSent().
+Returns -1 if the connection has to be closed.
+*/
+static int flushClient(struct SelectPrivate* client, int deferred)
 {
-    return FD_SETSIZE;
+    struct iovec iov[MAX_IOVEC];
+    Socket* sock = client->sock;
+    int rc, count;
+
+    if (client->unreported != 0) /* the head was sent already */
+        reportSent(client->loop);
+    if (client->output.bytes == 0)
+        return 0;
+    count = queueIovec(&client->output, iov, MAX_IOVEC);
+    assert(count > 0);
+    client->loop->metrics.sendCalls++;
+    if (client->loop->async) {
+        if (selectPollSend(client->loop->poll, *(int*)sock, iov, count) == -1) {
+            perror("poll");
+            return -1;
+        }
+        client->sending = 1;
+        return 0;
+    }
+    if (client->zeroCopy && (iovecBytes(iov, count) >= client->loop->options.zeroCopyThreshold)) {
+        rc = socketSendvZeroCopy(sock, iov, count);
+        if (rc > 0) {
+            client->zeroCopySent++;
+            client->loop->metrics.zeroCopySends++;
+        } else if ((rc == -1) && (errno == ENOBUFS)) { /* out of optmem for notifications */
+            rc = socketSendv(sock, iov, count, 0);
+        }
+    } else {
+        rc = socketSendv(sock, iov, count, 0);
+    }
+    traceEvent(&client->loop->trace, TRACE_SEND, *(int*)sock, (rc == -1) ? -errno : rc, count);
+    if (rc == -1) {
+        if ((errno == EWOULDBLOCK) || (errno == EAGAIN) || (errno == EINTR)) {
+            client->loop->metrics.sendAgain++;
+            return 0; /* need to wait on poll */
+        }
+        return -1;
+    }
+    if (!deferred) {
+        sentClient(client, iov, count, rc);
+        return 0;
+    }
+    client->unreported = rc;
+    if (!client->listed) {
+        client->listed = 1;
+        client->nextUnreported = client->loop->unreported;
+        client->loop->unreported = client;
+    }
+    return 0;
 }
 
-void selectSend(const Socket* sock, const char* buffer, unsigned size, const void* context)
+/* the producer stops reading until client drains below its low watermark */
+static void pauseProducer(struct SelectPrivate* client, struct SelectPrivate* producer)
 {
-    struct SelectPrivate* client = (struct SelectPrivate*)context;
     int i;
-    
-    debugPrintf("socket %p, buffer= %p, size= %u, context= %p", sock, buffer, size, context);
+
+    for (i = 0; i < client->waiterCount; i++)
+        if (client->waiter[i].client == producer)
+            return; /* waits already */
+    if (client->waiterCount == client->waiterSize) {
+        int size = client->waiterSize ? client->waiterSize * 2 : 4;
+        struct SelectWaiter* waiter = realloc(client->waiter, size * sizeof(*waiter));
+        if (waiter == NULL)
+            return; /* not paused, the data is queued anyway */
+        client->waiter = waiter;
+        client->waiterSize = size;
+    }
+    client->waiter[client->waiterCount].client = producer;
+    client->waiter[client->waiterCount].serial = producer->serial;
+    client->waiterCount++;
+    if (producer->waits++ == 0) {
+        client->loop->flow.paused++;
+        traceEvent(&client->loop->trace, TRACE_PAUSE, *(int*)producer->sock, *(int*)client->sock, 0);
+        setEvents(producer, producer->events);
+    }
+}
+
+/*
+Applies SelectOptions.slowPolicy when size more bytes would take the output
+above the high watermark. Returns -1 if they must not be queued.
+*/
+static int admit(struct SelectPrivate* client, unsigned size)
+{
+    struct SelectLoop* loop = client->loop;
+
+    if (client->closing || client->draining)
+        goto drop;
+    if ((client->highWatermark == 0) || (client->output.bytes + size <= client->highWatermark))
+        return 0;
+    if (!client->slow && !client->closing)
+        traceEvent(&loop->trace, TRACE_SLOW, *(int*)client->sock, loop->options.slowPolicy, client->output.bytes);
+    switch (loop->options.slowPolicy) {
+    case SELECT_SLOW_DROP:
+        goto drop;
+    case SELECT_SLOW_CLOSE: /* can't close inside callbacks, the deadline timer does it */
+        closeLater(client, CLOSING_SLOW);
+        loop->flow.closed++;
+        goto drop;
+    default:
+        if (!client->slow) {
+            client->slow = 1;
+            loop->flow.slow++;
+        }
+        /* data coming from other loops or timers has no producer to pause */
+        if (loop->producer != NULL)
+            pauseProducer(client, loop->producer);
+        return 0;
+    }
+drop:
+    traceEvent(&loop->trace, TRACE_DROP, *(int*)client->sock, size, 0);
+    loop->flow.droppedMessages++;
+    loop->flow.droppedBytes += size;
+    return -1;
+}
+
+/*
+Usually the socket has room, so output queued on an idle connection is
+written right away and only the rest waits for poll. Both the write and a
+failure are reported by the loop after the callbacks of the caller return.
+*/
+static void startSending(struct SelectPrivate* client)
+{
+    int idle = !(client->events & SELECT_POLL_OUT);
+
+    record(&client->loop->metrics.queueDepth, client->output.bytes);
+    if (idle) { /* output was empty */
+        client->writeSince = client->loop->now;
+        if ((client->writeTimeout != 0)
+                && ((client->deadline.prev == NULL)
+                    || (client->deadline.expires > client->writeSince + client->writeTimeout)))
+            armDeadline(client);
+    }
+    if (client->loop->async) {
+        setEvents(client, interest(client));
+        /* on failure the data stays queued until the next selectSend */
+        if (!client->sending)
+            flushClient(client, 0);
+        return;
+    }
+    if (idle && !client->notifying && (client->unreported == 0) && (client->state == CLIENT_OPEN)
+            && (flushClient(client, 1) == 0) && (client->output.bytes == client->unreported))
+        return; /* all sent, events are updated when it is reported */
+    setEvents(client, interest(client));
+}
+
+int selectMaxConnections(void)
+{
+    if (maxConnections == 0)
+        maxConnections = selectPollLimit();
+    return maxConnections;
+}
+
+/* what selectSetData() has stored for the connection */
+void* selectData(const Socket* sock, const void* context)
+{
+    struct SelectPrivate* client = findClient(context, sock);
+
+    assert(client != NULL);
+    return client->data;
+}
+
+/* passed to every callback of the connection until it is closed */
+void selectSetData(const Socket* sock, void* data, const void* context)
+{
+    struct SelectPrivate* client = findClient(context, sock);
+
+    assert(client != NULL);
+    client->data = data;
+}
+
+/* SelectOptions.user of the server the loop belongs to, any thread may ask */
+void* selectUser(const void* context)
+{
+    assert(context != NULL);
+    return ((const struct SelectLoop*)context)->options.user;
+}
+
+/* slots are in range [0, selectMaxConnections()) and fixed while connected */
+int selectSlot(const Socket* sock, const void* context)
+{
+    struct SelectPrivate* client = findClient(context, sock);
+
+    assert(client != NULL);
+    return client->slot;
+}
+
+/*
+The buffer is copied to the end of the connection output queue,
+so it may be reused right after the call. If nothing was queued before, it
+is sent before return as far as the socket takes it, SelectHandlers.serverSentOk
+is called by the loop after the current callback returns. Returns -1 if out of memory or memoryBudget,
+or dropped by SelectOptions.slowPolicy.
+*/
+int selectSend(const Socket* sock, const char* buffer, unsigned size, const void* context)
+{
+    struct SelectPrivate* client;
+
     assert(sock != NULL);
     assert(buffer != NULL);
-    assert((size > 0) && (size <= client->buferSize));
+    assert(size > 0);
     assert(context != NULL);
-    for (i = 0; i < FD_SETSIZE; i++, client++) /* not optimized */
-        if (sock == client->sock)
-            break;
-    assert(i != FD_SETSIZE);
-    if (buffer != client->buffer) memmove(client->buffer, buffer, size);
-    client->data = client->buffer;
-    client->dataSize = size;
-    FD_CLR(*(int*)sock, client->ractual); /* do not want to read when writing */
-    FD_SET(*(int*)sock, client->wactual);
+    client = findClient(context, sock);
+    assert(client != NULL);
+    if (admit(client, size) == -1)
+        return -1;
+    if (queuePush(&client->output, buffer, size) == -1) {
+        traceEvent(&client->loop->trace, TRACE_DROP, *(int*)sock, size, 0);
+        return -1;
+    }
+    traceEvent(&client->loop->trace, TRACE_QUEUE, *(int*)sock, size, client->output.bytes);
+    startSending(client);
+    return 0;
 }
 
-/* 
-maxChunkSize - the maximum chunk of data that can be specified per one
-    socketSend/socketRecv call inside selectServer loop.
+/*
+The buffer is queued by reference and released when it has been sent.
+The caller keeps its own reference. Returns -1 if out of memory or memoryBudget,
+or dropped by SelectOptions.slowPolicy.
 */
-int selectServer(const Socket* listen, int maxChunkSize)
+int selectSendBuffer(const Socket* sock, QueueBuffer* buffer, const void* context)
 {
-    fd_set ractual, wactual;
-    struct SelectPrivate* client; /* pointer to array of SelectPrivate structures */
-    int rc, nready, i;
-   
-    assert(listen != NULL);
-    FD_ZERO(&ractual);
-    FD_ZERO(&wactual); 
-    FD_SET(*(int*)listen, &ractual);
-     
-    client = calloc(FD_SETSIZE, sizeof(struct SelectPrivate)); /* allocate and zero array */
+    struct SelectPrivate* client;
+
+    assert(sock != NULL);
+    assert(buffer != NULL);
+    assert(context != NULL);
+    client = findClient(context, sock);
     assert(client != NULL);
-    if (client == NULL) {
-        perror("malloc"); /* fatal */
+    if (admit(client, queueBufferSize(buffer)) == -1)
+        return -1;
+    if (queuePushBuffer(&client->output, buffer) == -1) {
+        traceEvent(&client->loop->trace, TRACE_DROP, *(int*)sock, queueBufferSize(buffer), 0);
         return -1;
     }
-    for (i = 0; i < FD_SETSIZE; i++) { /* init client data */
-         client[i].ractual = &ractual;
-         client[i].wactual = &wactual;
-         client[i].buffer = malloc(maxChunkSize);
-         client[i].buferSize = maxChunkSize;
-         assert(client[i].buffer != NULL);
-         if (client[i].buffer == NULL) {
-             perror("malloc");
-             return -1;
-         }
+    traceEvent(&client->loop->trace, TRACE_QUEUE, *(int*)sock, queueBufferSize(buffer), client->output.bytes);
+    startSending(client);
+    return 0;
+}
+
+/*
+Sends one copy of the buffer to count sockets.
+Returns number of sockets the buffer was queued on or -1 if out of memory.
+*/
+int selectBroadcast(const Socket** sock, int count, const char* buffer, unsigned size, const void* context)
+{
+    QueueBuffer* shared;
+    int i, n = 0;
+
+    assert((sock != NULL) || (count == 0));
+    if (count == 0)
+        return 0;
+    shared = queueBufferCreate(buffer, size);
+    if (shared == NULL)
+        return -1;
+    for (i = 0; i < count; i++)
+        if (selectSendBuffer(sock[i], shared, context) == 0)
+            n++;
+    traceEvent(&((struct SelectLoop*)context)->trace, TRACE_BROADCAST, -1, n, size);
+    queueBufferRelease(shared); /* the queues hold the rest of references */
+    return n;
+}
+
+static int broadcastLocal(struct SelectLoop* loop, QueueBuffer* shared)
+{
+    int i, n = 0;
+
+    for (i = 0; i < loop->connectedCount; i++)
+        if ((loop->connected[i]->state == CLIENT_OPEN) && !quiet(loop->connected[i])
+                && (selectSendBuffer(loop->connected[i]->sock, shared, loop) == 0))
+            n++;
+    return n;
+}
+
+/*
+Sends to the subscribers of the topic in this loop. They are copied first,
+the topic may change while sending.
+Returns the number of them the buffer was queued on, -1 if out of memory.
+*/
+static int publishLocal(struct SelectLoop* loop, const char* name, unsigned length, QueueBuffer* shared)
+{
+    Topic* topic = topicFind(&loop->topics, name, length);
+    int first = loop->fanoutCount, count, i, n = 0;
+
+    if (topic == NULL)
+        return 0;
+    count = topic->count;
+    if (first + count > loop->fanoutSize) {
+        int size = (first + count) * 2;
+        struct SelectPrivate** fanout = realloc(loop->fanout, size * sizeof(*fanout));
+        if (fanout == NULL)
+            return -1;
+        loop->fanout = fanout;
+        loop->fanoutSize = size;
     }
-    for ( ; ; ) {
-        fd_set rset = ractual;
-        fd_set wset = wactual;
-        
-        debugPrintf("waiting on select..");
-        rc = select(FD_SETSIZE, &rset, &wset, NULL, NULL);
-        if (rc == -1) {
-            if (errno == EINTR) /* was interruped by a signal */
-                continue;
-            perror("select"); /* fatal situation */
-            break; /* exit from loop and return error code */
-        }
-        nready = rc;
-        debugPrintf("nready= %d", nready);
-        if (FD_ISSET(*(int*)listen, &rset)) { /* new client connection */
-            Socket* sock = socketConstruct();
-            rc = socketAccept(listen, sock);
-            debugPrintf("socketAccept: %p on listen socket %p, rc= %d. %s", sock, listen,
-                rc, (rc == -1) ? socketError(sock) : "");
-            if (rc == -1) { /* EINTR also maybe here */
-                socketDestroy(sock);
-                continue; /* goto select */
-            } if (rc == 1) { /* non-blocking: EWOULDBLOCK or EAGAIN */
-                socketDestroy(sock);
-                continue;
-            }
-            rc = socketSetBlocking(0/*false*/, sock); /* set to non-blocking mode */
-            debugPrintf("socketSetBlocking: on socket %p, rc= %d. %s", sock,
-                rc, (rc == -1) ? socketError(sock) : "");
-            if (rc == -1) {
-                socketClose(sock); /* return code not interesting */
-                socketDestroy(sock);
-                break;
-            }
-            /* look where to store sock */
-            for (i = 0; i < FD_SETSIZE; i++) { /* not optimized */
-                if (client[i].sock == NULL) {
-                    client[i].sock = sock;
-                    break;
-                }
-            }
-            if (i == FD_SETSIZE) {
-                debugPrintf("clients number exceeded %u\n", FD_SETSIZE);
-                rc = socketClose(sock);
-                debugPrintf("socketClose: socket %p, rc= %d, %s", sock,
-                    rc, (rc == -1) ? socketError(sock) : "");
-                socketDestroy(sock);
-                continue;
-            }
-            FD_SET(*(int*)sock, &ractual); /* add new descriptor to readfds */
-            FD_CLR(*(int*)sock, &wactual);
-            onSelectServerConnect(sock);
-            if (--nready <= 0)
-                continue; /* no more readable descriptors */
-         }
-         /* check all clients for data */
-         for (i = 0; i < FD_SETSIZE; i++) { /* not optimized */
-            Socket* sock = client[i].sock;
-            if (sock == NULL)
-                continue;
-            if (FD_ISSET(*(int*)sock, &rset)) {
-                rc = socketRecv(sock, client[i].buffer, maxChunkSize, 0);
-                if (rc == -1) {
-                    debugPrintf("socketRecv: socket %p, rc= %d. %s", sock, rc, socketError(sock));
-                    if ((errno == EWOULDBLOCK) || (errno == EAGAIN) || (errno == EINTR))
-                        continue; /* no data, goto next socket */
-                    FD_CLR(*(int*)sock, &ractual);
-                    FD_CLR(*(int*)sock, &wactual);
-                    onSelectServerRecvErr(sock);
-                    rc = socketClose(sock);
-                    debugPrintf("socketClose: socket %p, rc= %d. %s", sock,
-                        rc, (rc == -1) ? socketError(sock) : "");
-                    socketDestroy(sock);
-                    client[i].sock = NULL; /* make available this slot */
-                } else if (rc == 0) { /* connection closed by client */
-                    FD_CLR(*(int*)sock, &ractual);
-                    FD_CLR(*(int*)sock, &wactual);
-                    onSelectServerDisconnect(sock);
-                    rc = socketClose(sock);
-                    debugPrintf("socketClose: socket %p, rc= %d. %s", sock,
-                        rc, (rc == -1) ? socketError(sock) : "");
-                    socketDestroy(sock);
-                    client[i].sock = NULL; /* make available this slot */
-                } else {
-                    onSelectServerRecvOk(sock, client[i].buffer, rc, client);
-                }
-                if (--nready <= 0)
-                    break; /* no more readable descriptors */
-            }
-            if (FD_ISSET(*(int*)sock, &wset)) {
-                rc = socketSend(sock, client[i].data, client[i].dataSize, 0);
-                if (rc == -1) {
-                    debugPrintf("socketSend: socket %p, rc= %d. %s", sock, rc, socketError(sock));
-                    if ((errno == EWOULDBLOCK) || (errno == EAGAIN) || (errno == EINTR))
-                        continue; /* need to wait on select, goto next socket */
-                    FD_CLR(*(int*)sock, &wactual); /* ractual already cleared while we are sending */
-                    onSelectServerSentErr(sock);
-                    rc = socketClose(sock);
-                    debugPrintf("socketClose: socket %p, rc= %d. %s", sock,
-                        rc, (rc == -1) ? socketError(sock) : "");
-                    socketDestroy(sock);
-                    client[i].sock = NULL; /* make available this slot */
-                } else {
-                    assert(client[i].dataSize >= rc);
-                    if (client[i].dataSize >= rc) {
-                        onSelectServerSentOk(sock, client[i].data, rc, client);
-                        client[i].data += rc;
-                        client[i].dataSize -= rc;
-                        if (client[i].dataSize == 0) { /* all sent */
-                            FD_SET(*(int*)sock, &ractual);
-                            FD_CLR(*(int*)sock, &wactual);
-                        }
-                    } else { /* BUG: Impossible to be here! */
-                        FD_CLR(*(int*)sock, &ractual);
-                        FD_CLR(*(int*)sock, &wactual);
-                        rc = socketClose(sock);
-                        debugPrintf("socketClose: socket %p, rc= %d. %s", sock,
-                           rc, (rc == -1) ? socketError(sock) : "");
-                        socketDestroy(sock);
-                        client[i].sock = NULL; /* make available this slot */
-                    }
-                }
-                if (--nready <= 0)
-                    break; /* no more readable descriptors */
-            }
-        }
+    for (i = 0; i < count; i++)
+        loop->fanout[first + i] = (struct SelectPrivate*)((char*)topic->member[i].subscriber
+            - offsetof(struct SelectPrivate, topics));
+    loop->fanoutCount = first + count; /* a nested publish goes after them */
+    for (i = 0; i < count; i++) {
+        struct SelectPrivate* client = loop->fanout[first + i];
+        if ((client->state == CLIENT_OPEN) && !quiet(client)
+                && (selectSendBuffer(client->sock, shared, loop) == 0))
+            n++;
     }
-    /* clean up */
-    for (i = 0; i < FD_SETSIZE; i++) {
-        Socket* sock = client[i].sock;
-        if (sock == NULL) continue;
-        socketClose(sock);
-        socketDestroy(sock);
-        free(client[i].buffer);
+    loop->fanoutCount = first;
+    return n;
+}
+
+/* with one reference of the buffer and a copy of bytes, NULL if out of memory */
+static struct SelectMessage* createMessage(int kind, QueueBuffer* buffer, const char* bytes, unsigned length)
+{
+    struct SelectMessage* msg = malloc(sizeof(*msg) + ((bytes != NULL) ? length : 0));
+
+    if (msg == NULL)
+        return NULL;
+    msg->next = NULL;
+    msg->kind = kind;
+    msg->buffer = (buffer != NULL) ? queueBufferRetain(buffer) : NULL;
+    msg->data = NULL;
+    msg->bytes = NULL;
+    msg->length = length;
+    if (bytes != NULL) {
+        msg->bytes = (char*)(msg + 1);
+        memcpy(msg->bytes, bytes, length);
     }
-    free(client);
-    return rc;
+    return msg;
+}
+
+static void freeMessage(struct SelectMessage* msg)
+{
+    if (msg->buffer != NULL)
+        queueBufferRelease(msg->buffer);
+    free(msg);
+}
+
+/* non-blocking, fd[0] is polled and read by the loop, fd[1] is written by others */
+static int openWakeup(int fd[2])
+{
+#if defined(LINUX)
+    fd[0] = fd[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    return (fd[0] == -1) ? -1 : 0;
+#else
+    if (pipe(fd) == -1)
+        return -1;
+    fcntl(fd[0], F_SETFL, O_NONBLOCK);
+    fcntl(fd[1], F_SETFL, O_NONBLOCK);
+    return 0;
+#endif
+}
+
+/* makes the loop return from poll, safe to call from a signal handler */
+static void wake(struct SelectLoop* loop)
+{
+    uint64_t one = 1; /* what eventfd takes, a pipe gets it as bytes */
+
+    if (write(loop->wakeup[1], &one, sizeof(one)) == -1) /* full counter or pipe wakes up anyway */
+        return;
 }
 
+/* makes the loop return from loopRun, from any thread */
+static void stopLoop(struct SelectLoop* loop)
+{
+    __atomic_store_n(&loop->stop, 1, __ATOMIC_RELEASE);
+    wake(loop);
+}
+
+/*
+Any thread pushes without locks, the loop takes all messages at once.
+Only the first message the loop has not taken yet wakes it up.
+*/
+static void enqueue(struct SelectLoop* loop, struct SelectMessage* msg)
+{
+    struct SelectMessage* head = __atomic_load_n(&loop->inbox, __ATOMIC_RELAXED);
+
+    do {
+        msg->next = head;
+    } while (!__atomic_compare_exchange_n(&loop->inbox, &head, msg, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    if (head == NULL)
+        wake(loop);
+}
+
+/* the message takes one reference of the buffer, topic is NULL for everyone */
+static int post(struct SelectLoop* loop, QueueBuffer* shared, const char* topic, unsigned length)
+{
+    struct SelectMessage* msg = createMessage((topic != NULL) ? MESSAGE_PUBLISH : MESSAGE_BROADCAST,
+        shared, topic, length);
+
+    if (msg == NULL)
+        return -1;
+    enqueue(loop, msg);
+    return 0;
+}
+
+/* names the connection for selectPostSend() and selectPostClose() of other threads */
+void selectHandle(const Socket* sock, const void* context, SelectHandle* handle)
+{
+    struct SelectPrivate* client = findClient(context, sock);
+
+    assert((client != NULL) && (handle != NULL));
+    handle->context = context;
+    handle->slot = client->slot;
+    handle->serial = client->serial;
+}
+
+/*
+selectSend for any thread, the loop of the connection sends a copy of the
+buffer after it wakes up. What one thread posts is sent in order, data of a
+connection closed meanwhile is dropped. Returns -1 if out of memory.
+*/
+int selectPostSend(const SelectHandle* handle, const char* buffer, unsigned size)
+{
+    struct SelectMessage* msg;
+    QueueBuffer* shared;
+
+    assert((handle != NULL) && (handle->context != NULL));
+    assert((buffer != NULL) && (size > 0));
+    shared = queueBufferCreate(buffer, size);
+    if (shared == NULL)
+        return -1;
+    msg = createMessage(MESSAGE_SEND, shared, NULL, 0);
+    queueBufferRelease(shared); /* the message has its own reference */
+    if (msg == NULL)
+        return -1;
+    msg->handle = *handle;
+    enqueue((struct SelectLoop*)handle->context, msg);
+    return 0;
+}
+
+/* selectClose for any thread, after the data the same thread has posted before */
+int selectPostClose(const SelectHandle* handle)
+{
+    struct SelectMessage* msg;
+
+    assert((handle != NULL) && (handle->context != NULL));
+    msg = createMessage(MESSAGE_CLOSE, NULL, NULL, 0);
+    if (msg == NULL)
+        return -1;
+    msg->handle = *handle;
+    enqueue((struct SelectLoop*)handle->context, msg);
+    return 0;
+}
+
+static void dumpMetrics(struct SelectLoop* loop)
+{
+    SelectMetrics metrics;
+    char line[1024];
+
+    selectMetrics(loop, &metrics);
+    selectMetricsFormat(&metrics, line, sizeof(line));
+    fprintf(stderr, "loop %d: %s\n", loop->id, line);
+}
+
+static void metricsTimer(void* arg, const void* context)
+{
+    (void)arg;
+    dumpMetrics((struct SelectLoop*)context);
+}
+
+/* wakes up every loop of every server, each of them dumps its metrics in receive() */
+static void metricsSignalled(int sig)
+{
+    struct SelectServer* server;
+    int i, saved = errno;
+
+    (void)sig;
+    __atomic_store_n(&metricsGeneration, __atomic_load_n(&metricsGeneration, __ATOMIC_RELAXED) + 1, __ATOMIC_RELEASE);
+    for (server = __atomic_load_n(&servers, __ATOMIC_ACQUIRE); server != NULL; server = server->next)
+        for (i = 0; i < server->loopCount; i++)
+            wake(server->loops[i]);
+    errno = saved;
+}
+
+/*
+Sends one copy of the buffer to every connection of every loop of the server.
+Connections of other loops get it after their loop wakes up.
+Returns number of local connections the buffer was queued on or -1.
+*/
+int selectBroadcastAll(const char* buffer, unsigned size, const void* context)
+{
+    struct SelectLoop* loop = (struct SelectLoop*)context;
+    QueueBuffer* shared;
+    int i, n;
+
+    assert(context != NULL);
+    shared = queueBufferCreate(buffer, size);
+    if (shared == NULL)
+        return -1;
+    n = broadcastLocal(loop, shared);
+    traceEvent(&loop->trace, TRACE_BROADCAST, -1, n, size);
+    for (i = 0; i < loop->server->loopCount; i++)
+        if ((loop->server->loops[i] != loop) && (post(loop->server->loops[i], shared, NULL, 0) == -1))
+            n = -1;
+    queueBufferRelease(shared);
+    return n;
+}
+
+/*
+Sends one copy of the buffer to the subscribers of the topic in every
+loop of the server, like selectBroadcastAll. Only they are visited, the number
+of other connections does not matter.
+Returns number of local subscribers the buffer was queued on or -1.
+*/
+int selectPublish(const char* topic, unsigned length, const char* buffer, unsigned size, const void* context)
+{
+    struct SelectLoop* loop = (struct SelectLoop*)context;
+    QueueBuffer* shared;
+    int i, n;
+
+    assert((topic != NULL) && (context != NULL));
+    if ((loop->server->loopCount <= 1) && (topicFind(&loop->topics, topic, length) == NULL))
+        return 0; /* nobody listens */
+    shared = queueBufferCreate(buffer, size);
+    if (shared == NULL)
+        return -1;
+    n = publishLocal(loop, topic, length, shared);
+    traceEvent(&loop->trace, TRACE_BROADCAST, -1, n, size);
+    for (i = 0; i < loop->server->loopCount; i++)
+        if ((loop->server->loops[i] != loop) && (post(loop->server->loops[i], shared, topic, length) == -1))
+            n = -1;
+    queueBufferRelease(shared);
+    return n;
+}
+
+/*
+The connection gets what is published to the topic from now on, topics of
+other loops are not affected. A topic is length bytes of any kind.
+Returns 0, 1 if it is subscribed already, -1 if out of memory or closing.
+*/
+int selectSubscribe(const Socket* sock, const char* topic, unsigned length, const void* context)
+{
+    struct SelectPrivate* client = findClient(context, sock);
+
+    assert((client != NULL) && (topic != NULL));
+    if ((client->state != CLIENT_OPEN) || quiet(client))
+        return -1;
+    return topicSubscribe(&client->loop->topics, &client->topics, topic, length);
+}
+
+/* returns -1 if the connection is not subscribed, topics are left when it is closed anyway */
+int selectUnsubscribe(const Socket* sock, const char* topic, unsigned length, const void* context)
+{
+    struct SelectPrivate* client = findClient(context, sock);
+
+    assert((client != NULL) && (topic != NULL));
+    return topicUnsubscribe(&client->loop->topics, &client->topics, topic, length);
+}
+
+/*
+Hands a copy of received data to the worker of the connection, the same
+one every time, so its jobs run in order. The connection is not read
+while too much of its data waits. Returns -1 if out of memory.
+*/
+static int offload(struct SelectPrivate* client, const char* data, unsigned long size)
+{
+    struct SelectLoop* loop = client->loop;
+    struct SelectServer* server = loop->server;
+    struct SelectWorker* worker = &server->workers[(unsigned)(loop->id + client->slot) % server->workerCount];
+    struct SelectMessage* msg = createMessage(MESSAGE_WORK, NULL, data, size);
+    int idle;
+
+    if (msg == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    msg->handle.context = loop;
+    msg->handle.slot = client->slot;
+    msg->handle.serial = client->serial;
+    msg->data = client->data;
+    pthread_mutex_lock(&worker->lock);
+    idle = (worker->first == NULL);
+    if (idle)
+        worker->first = msg;
+    else
+        worker->last->next = msg;
+    worker->last = msg;
+    pthread_mutex_unlock(&worker->lock);
+    if (idle)
+        pthread_cond_signal(&worker->ready);
+    loop->metrics.offloaded++;
+    client->offloaded += size;
+    client->jobs++;
+    setEvents(client, interest(client));
+    return 0;
+}
+
+/* bytes of the frame at data with its length or delimiter, 0 if not complete yet, -1 if too long */
+static long frameLength(const SelectOptions* options, const char* data, unsigned long size)
+{
+    unsigned long length = 0;
+    const char* end;
+    int i;
+
+    if (options->framing == SELECT_FRAME_DELIMITER) {
+        end = memchr(data, options->frameDelimiter, size);
+        length = (end != NULL) ? (unsigned long)(end - data) : size;
+        if (length > options->maxFrameSize)
+            return -1;
+        return (end != NULL) ? (long)length + 1 : 0;
+    }
+    if (size < (unsigned long)options->frameLengthBytes)
+        return 0;
+    for (i = 0; i < options->frameLengthBytes; i++)
+        length = (length << 8) | (unsigned char)data[i];
+    if (length > options->maxFrameSize)
+        return -1;
+    length += options->frameLengthBytes;
+    return (size >= length) ? (long)length : 0;
+}
+
+/* bytes of data which may belong to the frame started in client->frame */
+static unsigned long frameMissing(const struct SelectPrivate* client, const char* data, unsigned long size)
+{
+    const SelectOptions* options = &client->loop->options;
+    unsigned long want;
+    const char* end;
+    int i;
+
+    if (options->framing == SELECT_FRAME_DELIMITER) {
+        end = memchr(data, options->frameDelimiter, size);
+        return (end != NULL) ? (unsigned long)(end - data) + 1 : size;
+    }
+    if (client->frameSize < (unsigned long)options->frameLengthBytes) {
+        want = options->frameLengthBytes - client->frameSize; /* the rest of length first */
+    } else {
+        for (i = 0, want = 0; i < options->frameLengthBytes; i++)
+            want = (want << 8) | (unsigned char)client->frame[i];
+        want += options->frameLengthBytes - client->frameSize;
+    }
+    return (want < size) ? want : size;
+}
+
+/* keeps size more bytes of a split frame, -1 if out of memory */
+static int frameAppend(struct SelectPrivate* client, const char* data, unsigned long size)
+{
+    Pool* pool = &client->loop->pool;
+
+    if (client->frameSize + size > client->frameCapacity) {
+        unsigned long capacity = client->frameCapacity ? client->frameCapacity * 2 : pool->blockSize;
+        char* frame;
+        while (capacity < client->frameSize + size)
+            capacity *= 2;
+        frame = poolAlloc(pool, capacity);
+        if (frame == NULL)
+            return -1;
+        if (client->frame != NULL) {
+            memcpy(frame, client->frame, client->frameSize);
+            poolFree(pool, client->frame, client->frameCapacity);
+        }
+        client->frame = frame;
+        client->frameCapacity = capacity;
+    }
+    memcpy(client->frame + client->frameSize, data, size);
+    client->frameSize += size;
+    return 0;
+}
+
+/* -1 if out of memory */
+static int deliver(struct SelectPrivate* client, char* frame, unsigned long length)
+{
+    const SelectOptions* options = &client->loop->options;
+    char* message = frame;
+    unsigned long size = length - 1;
+
+    if (options->framing != SELECT_FRAME_DELIMITER) {
+        message = frame + options->frameLengthBytes;
+        size = length - options->frameLengthBytes;
+    }
+    if (client->loop->server->workerCount != 0)
+        return offload(client, message, size);
+    client->loop->handlers.serverMessage(client->sock, client->data, message, size, client->loop);
+    return 0;
+}
+
+/*
+Delivers every complete message of data, right from the receive buffer,
+only a message split between reads is copied. Returns -1 with errno set
+if the connection has to be closed.
+*/
+static int frameClient(struct SelectPrivate* client, char* data, unsigned long size)
+{
+    const SelectOptions* options = &client->loop->options;
+    unsigned long take;
+    long length;
+
+    while (size > 0) {
+        if (client->frameSize != 0) { /* complete the split frame first */
+            take = frameMissing(client, data, size);
+            if (frameAppend(client, data, take) == -1) {
+                errno = ENOMEM;
+                return -1;
+            }
+            data += take;
+            size -= take;
+            length = frameLength(options, client->frame, client->frameSize);
+            if (length > 0) {
+                if (deliver(client, client->frame, length) == -1)
+                    return -1;
+                client->frameSize = 0;
+            }
+        } else {
+            length = frameLength(options, data, size);
+            if (length == 0) { /* the rest waits for more data */
+                if (frameAppend(client, data, size) == -1) {
+                    errno = ENOMEM;
+                    return -1;
+                }
+                break;
+            }
+            if (length > 0) {
+                if (deliver(client, data, length) == -1)
+                    return -1;
+                data += length;
+                size -= length;
+            }
+        }
+        if (length < 0) {
+            errno = EMSGSIZE;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* hands received data to the callbacks, timing them, -1 with errno set if the connection has to be closed */
+static int received(struct SelectPrivate* client, char* buffer, unsigned size)
+{
+    struct SelectLoop* loop = client->loop;
+    unsigned long long start;
+    int rc = 0;
+
+    if (client->relay != NULL) { /* selectRelay copying through user space */
+        client->lastRecv = loop->now;
+        loop->metrics.recvBytes += size;
+        if (queuePush(&client->relay->output, buffer, size) == -1) {
+            errno = ENOMEM;
+            return -1;
+        }
+        startSending(client->relay);
+        relayUpdate(client);
+        return 0;
+    }
+    if (quiet(client)) { /* nothing is expected on an idle connection */
+        if ((client->state == CLIENT_IDLE) && !client->closing)
+            closeLater(client, CLOSING_ASKED);
+        return 0;
+    }
+    start = timerNowNs();
+    client->lastRecv = loop->now;
+    loop->metrics.recvBytes += size;
+    loop->producer = client;
+    if (loop->options.framing != SELECT_FRAME_NONE)
+        rc = frameClient(client, buffer, size);
+    else if (loop->server->workerCount != 0)
+        rc = offload(client, buffer, size);
+    else
+        loop->handlers.serverRecvOk(client->sock, client->data, buffer, size, loop);
+    loop->producer = NULL;
+    record(&loop->metrics.callbackTime, timerNowNs() - start);
+    return rc;
+}
+
+/*
+EOF has been read. The output queued by then is still sent, as the client
+may only have shut down its sending side. Returns -1 if it has been closed.
+*/
+static int inputEnded(struct SelectPrivate* client)
+{
+    if (client->relay != NULL) { /* passed on to the other end */
+        client->relayed = RELAY_EOF;
+        relayUpdate(client);
+        return 0;
+    }
+    if (client->jobs != 0) { /* workers may still reply, dispatch() comes back when they are done */
+        client->ended = 1;
+        setEvents(client, interest(client));
+        return 0;
+    }
+    if (!quiet(client))
+        client->loop->handlers.serverDisconnect(client->sock, client->data, client->loop);
+    if ((client->output.bytes == 0) || client->closing) {
+        closeClient(client);
+        return -1;
+    }
+    client->ended = 1;
+    client->draining = 1; /* no callbacks any more, closed by sentClient */
+    setEvents(client, interest(client));
+    return 0;
+}
+
+/* a message from another thread, for a connection which may be closed meanwhile */
+static void dispatch(struct SelectLoop* loop, struct SelectMessage* msg)
+{
+    struct SelectPrivate* client;
+
+    if (msg->kind == MESSAGE_BROADCAST) {
+        broadcastLocal(loop, msg->buffer);
+        return;
+    }
+    if (msg->kind == MESSAGE_PUBLISH) {
+        publishLocal(loop, msg->bytes, msg->length, msg->buffer);
+        return;
+    }
+    client = &loop->client[msg->handle.slot];
+    if ((client->sock == NULL) || (client->serial != msg->handle.serial))
+        return;
+    if (msg->kind == MESSAGE_WORK) { /* done, the connection may be read again */
+        client->offloaded -= msg->length;
+        client->jobs--;
+        if ((client->jobs == 0) && client->postponed) { /* deadlineExpired() comes back */
+            client->postponed = 0;
+            timerStart(&loop->wheel, &client->deadline, loop->now);
+        }
+        if (client->ended && !client->draining && !client->closing && (client->jobs == 0))
+            inputEnded(client); /* EOF came while the workers had jobs */
+        else if (!client->closing)
+            setEvents(client, interest(client));
+        return;
+    }
+    loop->metrics.posted++;
+    if ((client->state != CLIENT_OPEN) || quiet(client))
+        return;
+    if (msg->kind == MESSAGE_SEND)
+        selectSendBuffer(client->sock, msg->buffer, loop);
+    else
+        selectClose(client->sock, loop);
+}
+
+static void receive(struct SelectLoop* loop)
+{
+    struct SelectMessage* msg, *next, *first = NULL;
+    char bytes[64];
+    int generation;
+
+    while (read(loop->wakeup[0], bytes, sizeof(bytes)) > 0)
+        ;
+    generation = __atomic_load_n(&metricsGeneration, __ATOMIC_ACQUIRE);
+    if (loop->dumped != generation) {
+        loop->dumped = generation;
+        dumpMetrics(loop);
+    }
+    msg = __atomic_exchange_n(&loop->inbox, NULL, __ATOMIC_ACQUIRE);
+    for ( ; msg != NULL; msg = next) { /* the oldest first again */
+        next = msg->next;
+        msg->next = first;
+        first = msg;
+    }
+    for (msg = first; msg != NULL; msg = next) {
+        next = msg->next;
+        dispatch(loop, msg);
+        freeMessage(msg);
+    }
+}
+
+/*
+Reads until the socket is drained, but not more than readBudget bytes
+and readCalls socketRecv calls, so one busy client can't starve others.
+Returns -1 if the connection has been closed.
+*/
+static int readClient(struct SelectPrivate* client)
+{
+    struct SelectLoop* loop = client->loop;
+    Socket* sock = client->sock;
+    unsigned long bytes = 0;
+    int rc, calls;
+
+    for (calls = 0; calls < loop->options.readCalls; calls++) {
+        rc = socketRecv(sock, loop->buffer, loop->maxChunkSize, 0);
+        loop->metrics.recvCalls++;
+        traceEvent(&loop->trace, TRACE_RECV, *(int*)sock, (rc == -1) ? -errno : rc, 0);
+        if (rc == -1) {
+            if ((errno == EWOULDBLOCK) || (errno == EAGAIN) || (errno == EINTR)) {
+                loop->metrics.recvAgain++;
+                return 0; /* no data, goto next socket */
+            }
+            failClient(client, FAILED_RECV);
+            return -1;
+        } else if (rc == 0) { /* connection closed by client */
+            return inputEnded(client);
+        }
+        if (received(client, loop->buffer, rc) == -1) {
+            failClient(client, FAILED_RECV);
+            return -1;
+        }
+        bytes += rc;
+        if (rc < loop->maxChunkSize) /* short read, socket buffer is empty */
+            break;
+        if (client->closing)
+            break;
+        if (bytes >= loop->options.readBudget)
+            break;
+        if (!(client->events & SELECT_POLL_IN)) /* too much output waits */
+            break;
+    }
+    return 0;
+}
+
+/* moves the pipe of client->relay to client, returns -1 with errno set on failure */
+static int relayWrite(struct SelectPrivate* client)
+{
+    struct SelectLoop* loop = client->loop;
+    struct SelectPrivate* relay = client->relay;
+    int rc;
+
+    while (relay->piped != 0) {
+        rc = socketSpliceTo(client->sock, relay->pipe[0], relay->piped);
+        loop->metrics.sendCalls++;
+        traceEvent(&loop->trace, TRACE_SEND, *(int*)client->sock, (rc == -1) ? -errno : rc, 0);
+        if (rc == -1) {
+            if ((errno == EWOULDBLOCK) || (errno == EAGAIN) || (errno == EINTR)) {
+                loop->metrics.sendAgain++;
+                break; /* need to wait on poll */
+            }
+            return -1;
+        }
+        relay->piped -= rc;
+        loop->metrics.sendBytes += rc;
+        client->lastSent = client->writeSince = loop->now;
+    }
+    relayUpdate(client);
+    return 0;
+}
+
+/*
+Moves received data of a splice(2) relay end through its pipe to the other
+end, it never comes to user space. The pipe is filled again only when it is
+empty, so EAGAIN always means no data. Returns -1 if the connection has been closed.
+*/
+static int relayRead(struct SelectPrivate* client)
+{
+    struct SelectLoop* loop = client->loop;
+    struct SelectPrivate* relay = client->relay;
+    Socket* sock = client->sock;
+    int rc, calls;
+
+    for (calls = 0; (calls < loop->options.readCalls) && (client->piped == 0) && !client->closing; calls++) {
+        rc = socketSpliceFrom(sock, client->pipe[1], RELAY_CHUNK);
+        loop->metrics.recvCalls++;
+        traceEvent(&loop->trace, TRACE_RECV, *(int*)sock, (rc == -1) ? -errno : rc, 0);
+        if (rc == -1) {
+            if ((errno == EWOULDBLOCK) || (errno == EAGAIN) || (errno == EINTR)) {
+                loop->metrics.recvAgain++;
+                break;
+            }
+            failClient(client, FAILED_RECV);
+            return -1;
+        }
+        if (rc == 0) { /* passed on to the other end */
+            client->relayed = RELAY_EOF;
+            break;
+        }
+        client->piped += rc;
+        client->lastRecv = loop->now;
+        loop->metrics.recvBytes += rc;
+        if (relay->output.bytes == 0) /* a failure is reported when relay is writable */
+            relayWrite(relay);
+    }
+    relayUpdate(client);
+    return 0;
+}
+
+/* closes a connection of selectConnect and reports the error, a relay closes its other end instead */
+static void connectFailed(struct SelectPrivate* client, int error)
+{
+    struct SelectLoop* loop = client->loop;
+    void* arg = client->arg;
+    int internal = client->internal;
+
+    traceEvent(&loop->trace, TRACE_CONNECT, *(int*)client->sock, -error, 0);
+    closeClient(client); /* the slot is free again when the callback runs */
+    if (internal)
+        return;
+    errno = error;
+    loop->handlers.clientConnectErr(arg, loop);
+}
+
+/* the socket of selectConnect is writable, so the connect has completed */
+static void connectCompleted(struct SelectPrivate* client)
+{
+    struct SelectLoop* loop = client->loop;
+    int fd = *(int*)client->sock;
+
+    if (socketConnected(client->sock) == -1) {
+        connectFailed(client, errno);
+        return;
+    }
+    /* from now on it is served like accepted ones */
+    if ((selectPollModify(loop->poll, fd, loop->async ? 0 : SELECT_POLL_IN, client) == -1)
+            || (loop->async && (selectPollRecv(loop->poll, fd, 1) == -1))) {
+        connectFailed(client, errno);
+        return;
+    }
+    client->events = SELECT_POLL_IN;
+    client->state = CLIENT_OPEN;
+    client->lastRecv = client->lastSent = client->writeSince = loop->now;
+    armDeadline(client);
+    traceEvent(&loop->trace, TRACE_CONNECT, fd, 0, 0);
+    if (client->relay != NULL) { /* of selectRelay, data starts moving */
+        relayUpdate(client);
+        return;
+    }
+    loop->handlers.clientConnect(client->sock, client->arg, loop);
+}
+
+/* deadlines are checked when the timer fires, traffic only moves timestamps */
+static void deadlineExpired(Timer* timer)
+{
+    struct SelectPrivate* client = timer->arg;
+    struct SelectLoop* loop = client->loop;
+    int reason = 0;
+    unsigned long long when;
+
+    if (client->jobs != 0) { /* the workers still use its data */
+        client->postponed = 1;
+        return;
+    }
+    if (client->closing == CLOSING_FAILED) {
+        errno = client->error;
+        if (client->failure == FAILED_RECV)
+            loop->handlers.serverRecvErr(client->sock, client->data, loop);
+        else
+            loop->handlers.serverSentErr(client->sock, client->data, loop);
+        closeClient(client);
+        return;
+    }
+    if (client->closing == CLOSING_SLOW) {
+        traceEvent(&loop->trace, TRACE_TIMEOUT, *(int*)client->sock, 0, client->output.bytes);
+        errno = ENOBUFS;
+        loop->handlers.serverSentErr(client->sock, client->data, loop);
+        closeClient(client);
+        return;
+    }
+    if (client->closing == CLOSING_ASKED) {
+        closeClient(client);
+        return;
+    }
+    if (client->closing == CLOSING_PEER) {
+        if (!client->internal && !client->draining)
+            loop->handlers.serverDisconnect(client->sock, client->data, loop);
+        closeClient(client);
+        return;
+    }
+    when = deadline(client, &reason);
+    if (when == 0)
+        return;
+    if (when > loop->now) {
+        timerStart(&loop->wheel, timer, when);
+        return;
+    }
+    traceEvent(&loop->trace, TRACE_TIMEOUT, *(int*)client->sock, reason, client->output.bytes);
+    switch (client->state) {
+    case CLIENT_CONNECTING:
+        connectFailed(client, ETIMEDOUT);
+        break;
+    case CLIENT_REUSED: /* connected long ago, now it is handed over */
+        client->state = CLIENT_OPEN;
+        client->lastRecv = client->lastSent = client->writeSince = loop->now;
+        armDeadline(client);
+        traceEvent(&loop->trace, TRACE_CONNECT, *(int*)client->sock, 0, 1);
+        loop->handlers.clientConnect(client->sock, client->arg, loop);
+        break;
+    case CLIENT_IDLE:
+        closeClient(client);
+        break;
+    default:
+        if (!quiet(client))
+            loop->handlers.serverTimeout(client->sock, client->data, reason, loop);
+        closeClient(client);
+    }
+}
+
+/*
+Takes a free slot for the non-blocking sock and registers it, connecting ones
+wait for writability. Returns NULL with errno set if it can't be served.
+*/
+static struct SelectPrivate* attachClient(struct SelectLoop* loop, Socket* sock, int connecting)
+{
+    struct SelectPrivate* client;
+
+    client = loop->freeSlot; /* take the first free slot */
+    if ((client == NULL) && (loop->usedSlots < maxConnections)) {
+        client = &loop->client[loop->usedSlots];
+        client->loop = loop;
+        client->slot = loop->usedSlots;
+    }
+    if ((client == NULL) || (*(int*)sock >= maxConnections)) {
+        debugPrintf("clients number exceeded %u\n", maxConnections);
+        errno = EMFILE;
+        return NULL;
+    }
+    /* async pollers deliver data by recv completions, not readiness */
+    if (connecting) {
+        if (selectPollAdd(loop->poll, *(int*)sock, SELECT_POLL_OUT, client) == -1)
+            return NULL;
+    } else if ((selectPollAdd(loop->poll, *(int*)sock, loop->async ? 0 : SELECT_POLL_IN, client) == -1)
+            || (loop->async && (selectPollRecv(loop->poll, *(int*)sock, 1) == -1))) {
+        return NULL;
+    }
+    if (client == loop->freeSlot)
+        loop->freeSlot = client->nextFree;
+    else
+        loop->usedSlots++;
+    loop->index[*(int*)sock] = client;
+    client->position = loop->connectedCount;
+    loop->connected[loop->connectedCount++] = client;
+    client->sock = sock;
+    client->events = connecting ? SELECT_POLL_OUT : SELECT_POLL_IN; /* add new descriptor to readfds */
+    client->state = connecting ? CLIENT_CONNECTING : CLIENT_OPEN;
+    queueInit(&client->output, &loop->pool);
+    queueInit(&client->held, &loop->pool);
+    client->pipe[0] = client->pipe[1] = -1;
+    /* readiness pollers only, async ones send by themselves */
+    client->zeroCopy = (loop->options.zeroCopyThreshold != 0) && !loop->async
+        && (socketSetOptZeroCopy(sock) == 0);
+    client->idleTimeout = loop->options.idleTimeout;
+    client->readTimeout = loop->options.readTimeout;
+    client->writeTimeout = loop->options.writeTimeout;
+    client->lastRecv = client->lastSent = client->writeSince = loop->now;
+    client->serial = ++loop->serial;
+    client->highWatermark = loop->options.highWatermark;
+    client->lowWatermark = loop->options.lowWatermark;
+    client->deadline.callback = deadlineExpired;
+    client->deadline.arg = client;
+    return client;
+}
+
+/* sock is already accepted and non-blocking */
+static void addClient(struct SelectLoop* loop, Socket* sock)
+{
+    struct SelectPrivate* client = attachClient(loop, sock, 0);
+
+    if (client == NULL) {
+        if (errno != EMFILE)
+            perror("accept");
+        if (socketClose(sock) == -1)
+            debugPrintf("socketClose: socket %p, %s", sock, socketError(sock));
+        socketDestroy(sock);
+        return;
+    }
+    if (socketSetProfile(&loop->options.profile, 0, sock) == -1) /* served anyway */
+        debugPrintf("socketSetProfile: %s", socketError(sock));
+    armDeadline(client);
+    loop->metrics.accepts++;
+    traceEvent(&loop->trace, TRACE_ACCEPT, *(int*)sock, client->slot, client->serial);
+    loop->handlers.serverConnect(sock, loop);
+}
+
+/*
+Drains the accept queue in batches, but takes no more than
+options.acceptBudget connections per wakeup, the rest waits for
+the next one so established connections are served meanwhile.
+*/
+static void acceptClients(struct SelectLoop* loop, const Socket* listen)
+{
+    int budget = loop->options.acceptBudget;
+    int want, rc, i;
+
+    while (budget > 0) {
+        want = (budget < loop->options.acceptBatch) ? budget : loop->options.acceptBatch;
+        for (i = 0; i < want; i++) {
+            if (loop->spare[i] == NULL)
+                loop->spare[i] = socketConstruct();
+            if (loop->spare[i] == NULL) { /* accept less */
+                want = i;
+                break;
+            }
+        }
+        if (want == 0)
+            return;
+        rc = socketAcceptMany(listen, loop->spare, want);
+        if (rc <= 0) /* queue is empty or error */
+            return;
+        for (i = 0; i < rc; i++) {
+            addClient(loop, loop->spare[i]);
+            loop->spare[i] = NULL;
+        }
+        if (rc < want) /* queue is drained */
+            return;
+        budget -= rc;
+    }
+}
+
+/* new descriptor accepted by an async poller, or -errno */
+static void acceptCompleted(struct SelectLoop* loop, const Socket* listen, int result)
+{
+    Socket* sock;
+
+    if (result < 0) {
+        traceEvent(&loop->trace, TRACE_ACCEPT, *(int*)listen, result, 0);
+        return;
+    }
+    sock = socketConstruct();
+    if (sock == NULL) {
+        close(result);
+        return;
+    }
+    socketSetDescriptor(result, sock);
+    addClient(loop, sock);
+}
+
+/* data received by an async poller into event->buffer, 0 on EOF or -errno */
+static void recvCompleted(struct SelectPrivate* client, const struct SelectPollEvent* event)
+{
+    struct SelectLoop* loop = client->loop;
+    Socket* sock = client->sock;
+    int rc;
+
+    loop->metrics.recvCalls++;
+    traceEvent(&loop->trace, TRACE_RECV, *(int*)sock, event->result, 0);
+    if (event->result > 0) {
+        rc = received(client, event->buffer, event->result);
+        selectPollRecycle(loop->poll, event);
+        if (rc == -1) {
+            failClient(client, FAILED_RECV);
+        }
+    } else if (event->result == 0) { /* connection closed by client */
+        inputEnded(client);
+    } else {
+        errno = -event->result;
+        failClient(client, FAILED_RECV);
+    }
+}
+
+/* result - bytes written by an async poller or -errno */
+static void sendCompleted(struct SelectPrivate* client, int result)
+{
+    struct iovec iov[MAX_IOVEC];
+    int count;
+
+    client->sending = 0;
+    traceEvent(&client->loop->trace, TRACE_SEND, *(int*)client->sock, result, 0);
+    if (result >= 0) {
+        count = queueIovec(&client->output, iov, MAX_IOVEC); /* the same as sent */
+        sentClient(client, iov, count, result);
+        if ((client->output.bytes == 0) || (flushClient(client, 0) == 0))
+            return;
+    } else {
+        errno = -result;
+    }
+    failClient(client, FAILED_SENT);
+}
+
+static void freeTimer(SelectTimer* timer)
+{
+    timerStop(&timer->loop->wheel, &timer->timer);
+    *timer->prev = timer->next;
+    if (timer->next != NULL)
+        timer->next->prev = timer->prev;
+    free(timer);
+}
+
+static void timerExpired(Timer* base)
+{
+    SelectTimer* timer = base->arg;
+
+    if (timer->period != 0) /* the next period counts from when this one was due */
+        timerStart(&timer->loop->wheel, base, base->expires + timer->period);
+    traceEvent(&timer->loop->trace, TRACE_TIMER, -1, timer->period, 0);
+    timer->firing = 1;
+    timer->callback(timer->arg, timer->loop);
+    timer->firing = 0;
+    if ((timer->period == 0) || timer->stopped)
+        freeTimer(timer);
+}
+
+static void loopDestroy(struct SelectLoop* loop)
+{
+    int i;
+
+    if (loop == NULL)
+        return;
+    if (loop->client != NULL) {
+        for (i = loop->connectedCount - 1; i >= 0; i--)
+            closeClient(loop->connected[i]);
+        for (i = 0; i < loop->usedSlots; i++) {
+            free(loop->client[i].waiter);
+            topicSubscriberClear(&loop->client[i].topics);
+        }
+    }
+    topicClear(&loop->topics);
+    free(loop->fanout);
+    while (loop->inbox != NULL) {
+        struct SelectMessage* next = loop->inbox->next;
+        freeMessage(loop->inbox);
+        loop->inbox = next;
+    }
+    while (loop->timers != NULL)
+        freeTimer(loop->timers);
+    while (loop->upstreams != NULL) {
+        struct SelectUpstream* next = loop->upstreams->next;
+        free(loop->upstreams);
+        loop->upstreams = next;
+    }
+    if (loop->spare != NULL) {
+        for (i = 0; i < loop->options.acceptBatch; i++)
+            if (loop->spare[i] != NULL) socketDestroy(loop->spare[i]);
+    }
+    if (loop->wakeup[0] != -1) close(loop->wakeup[0]);
+    if ((loop->wakeup[1] != -1) && (loop->wakeup[1] != loop->wakeup[0])) close(loop->wakeup[1]);
+    selectPollDestroy(loop->poll);
+    poolClear(&loop->pool);
+    free(loop->buffer);
+    free(loop->spare);
+    free(loop->listen);
+    free(loop->connected);
+    free(loop->index);
+    free(loop->client);
+    free(loop);
+}
+
+/* stand in for NULL members of SelectOptions.handlers */
+static void noClientConnect(const Socket* sock, void* arg, const void* context)
+{
+    (void)sock; (void)arg; (void)context;
+}
+
+static void noClientConnectErr(void* arg, const void* context)
+{
+    (void)arg; (void)context;
+}
+
+static void noServerConnect(const Socket* sock, const void* context)
+{
+    (void)sock; (void)context;
+}
+
+static void noServerEvent(const Socket* sock, void* data, const void* context)
+{
+    (void)sock; (void)data; (void)context;
+}
+
+static void noServerData(const Socket* sock, void* data, char* buffer, unsigned size, const void* context)
+{
+    (void)sock; (void)data; (void)buffer; (void)size; (void)context;
+}
+
+static void noServerTimeout(const Socket* sock, void* data, int reason, const void* context)
+{
+    (void)sock; (void)data; (void)reason; (void)context;
+}
+
+static void setHandlers(SelectHandlers* to, const SelectHandlers* from)
+{
+    *to = *from;
+    if (to->clientConnect == NULL)
+        to->clientConnect = noClientConnect;
+    if (to->clientConnectErr == NULL)
+        to->clientConnectErr = noClientConnectErr;
+    if (to->serverConnect == NULL)
+        to->serverConnect = noServerConnect;
+    if (to->serverDisconnect == NULL)
+        to->serverDisconnect = noServerEvent;
+    if (to->serverMessage == NULL)
+        to->serverMessage = noServerData;
+    if (to->serverRecvErr == NULL)
+        to->serverRecvErr = noServerEvent;
+    if (to->serverRecvOk == NULL)
+        to->serverRecvOk = noServerData;
+    if (to->serverSentErr == NULL)
+        to->serverSentErr = noServerEvent;
+    if (to->serverSentOk == NULL)
+        to->serverSentOk = noServerData;
+    if (to->serverTimeout == NULL)
+        to->serverTimeout = noServerTimeout;
+}
+
+/* listen - count sockets accepted by this loop */
+static struct SelectLoop* loopCreate(struct SelectServer* server, const Socket** listen, int count,
+    const SelectOptions* options)
+{
+    struct SelectLoop* loop;
+    int i;
+
+    selectMaxConnections();
+    loop = calloc(1, sizeof(*loop));
+    if (loop == NULL)
+        return NULL;
+    topicInit(&loop->topics);
+    loop->options = *options;
+    setHandlers(&loop->handlers, options->handlers);
+    loop->server = server;
+    loop->maxChunkSize = options->maxChunkSize;
+    /* a block fits a copy of the biggest received chunk */
+    poolInit(&loop->pool, queueChunkSize(options->maxChunkSize),
+        (options->memoryBudget != 0) ? &server->budget : NULL);
+    loop->now = timerNow();
+    timerInit(&loop->wheel, loop->now);
+    traceInit(&loop->trace, 0);
+    traceClock(&loop->trace, timerNowNs());
+    loop->cpu = -1;
+    loop->wakeup[0] = loop->wakeup[1] = -1;
+    /* slots are initialized when taken first time */
+    loop->client = calloc(maxConnections, sizeof(struct SelectPrivate)); /* allocate and zero array */
+    loop->index = calloc(maxConnections, sizeof(struct SelectPrivate*));
+    loop->connected = malloc(maxConnections * sizeof(struct SelectPrivate*));
+    loop->spare = calloc(options->acceptBatch, sizeof(Socket*));
+    loop->buffer = malloc(options->maxChunkSize);
+    loop->listen = malloc(count * sizeof(Socket*));
+    loop->poll = selectPollCreate(MAX_EVENTS, options->maxChunkSize);
+    if ((loop->client == NULL) || (loop->index == NULL) || (loop->connected == NULL) || (loop->spare == NULL)
+            || (loop->buffer == NULL) || (loop->listen == NULL)
+            || (loop->poll == NULL) || (openWakeup(loop->wakeup) == -1)) {
+        perror("malloc"); /* fatal */
+        loopDestroy(loop);
+        return NULL;
+    }
+    loop->async = selectPollAsync(loop->poll);
+    if (selectPollAdd(loop->poll, loop->wakeup[0], SELECT_POLL_IN, &loop->inbox) == -1) {
+        perror("poll");
+        loopDestroy(loop);
+        return NULL;
+    }
+    /* listen sockets have no data */
+    for (i = 0; i < count; i++) {
+        loop->listen[i] = listen[i];
+        if ((loop->async ? selectPollAccept(loop->poll, *(int*)listen[i], &loop->listen[i])
+                : selectPollAdd(loop->poll, *(int*)listen[i], SELECT_POLL_IN, &loop->listen[i])) == -1) {
+            perror("poll");
+            loopDestroy(loop);
+            return NULL;
+        }
+        loop->listenCount++;
+    }
+    if ((options->metricsInterval != 0)
+            && (selectTimerStart(options->metricsInterval, options->metricsInterval, metricsTimer, NULL, loop) == NULL)) {
+        perror("malloc");
+        loopDestroy(loop);
+        return NULL;
+    }
+    return loop;
+}
+
+static int loopRun(struct SelectLoop* loop)
+{
+    struct SelectPollEvent events[MAX_EVENTS];
+    unsigned long long start, end;
+    int nready, timeout, rc;
+
+    loop->events = events;
+    for ( ; ; ) {
+        if (__atomic_load_n(&loop->stop, __ATOMIC_ACQUIRE))
+            return 0;
+        reportSent(loop); /* written by the timers or before the loop started */
+        timeout = timerNext(&loop->wheel, loop->now);
+        traceEvent(&loop->trace, TRACE_WAIT, -1, timeout, 0);
+        start = timerNowNs();
+        nready = selectPollWait(loop->poll, events, MAX_EVENTS, timeout);
+        if (nready == -1) {
+            perror("poll"); /* fatal situation */
+            return -1; /* exit from loop and return error code */
+        }
+        end = timerNowNs();
+        traceClock(&loop->trace, end);
+        traceEvent(&loop->trace, TRACE_WAKEUP, -1, nready, (end - start) / 1000);
+        loop->now = end / 1000000; /* the same clock as timerNow() */
+        loop->metrics.wakeups++;
+        loop->metrics.events += nready;
+        record(&loop->metrics.waitTime, (end - start) / 1000);
+        record(&loop->metrics.eventsPerWakeup, nready);
+        /* only ready descriptors are visited */
+        loop->eventCount = nready;
+        for (loop->eventNext = 0; loop->eventNext < nready; ) {
+            struct SelectPollEvent* ev = &events[loop->eventNext++];
+            struct SelectPrivate* c = ev->data;
+            unsigned ready;
+
+            if (loop->unreported != NULL) /* written by the callbacks of the previous event */
+                reportSent(loop);
+            if (ev->events == 0) /* dropped by closeClient */
+                continue;
+            if ((uintptr_t)ev->data - (uintptr_t)loop->listen < loop->listenCount * sizeof(Socket*)) {
+                const Socket* listen = *(const Socket**)ev->data; /* new client connections */
+                if (ev->events & SELECT_POLL_ACCEPT)
+                    acceptCompleted(loop, listen, ev->result);
+                else
+                    acceptClients(loop, listen);
+                continue;
+            }
+            if (ev->data == &loop->inbox) { /* woken up by other loop */
+                receive(loop);
+                continue;
+            }
+            if (ev->events & SELECT_POLL_RECV) {
+                recvCompleted(c, ev);
+                continue;
+            }
+            if (ev->events & SELECT_POLL_SENT) {
+                sendCompleted(c, ev->result);
+                continue;
+            }
+            if (c->state == CLIENT_CONNECTING) {
+                if (!c->closing) /* errors are reported even if no events are wanted */
+                    connectCompleted(c);
+                continue;
+            }
+            if (loop->async) /* readiness left from connecting */
+                continue;
+            if (c->zeroCopySent != c->zeroCopyDone) /* completions come as errors */
+                reapZeroCopy(c);
+            ready = ev->events & c->events; /* ignore not requested events */
+            if (ready & SELECT_POLL_IN) {
+                if ((((c->relay != NULL) && (c->pipe[0] != -1)) ? relayRead(c) : readClient(c)) == -1)
+                    continue; /* closed, goto next socket */
+            }
+            if (ready & SELECT_POLL_OUT) {
+                if (c->output.bytes != 0)
+                    rc = flushClient(c, 0);
+                else if (c->relay != NULL) /* relayed data goes after queued output */
+                    rc = relayWrite(c);
+                else
+                    rc = 0;
+                if (rc == -1) {
+                    failClient(c, FAILED_SENT);
+                }
+            }
+        }
+        loop->eventCount = 0;
+        reportSent(loop);
+        timerAdvance(&loop->wheel, loop->now);
+    }
+}
+
+void selectOptionsInit(SelectOptions* options)
+{
+    assert(options != NULL);
+    options->handlers = NULL;
+    options->user = NULL;
+    options->maxChunkSize = 512;
+    options->acceptBatch = 16;
+    options->acceptBudget = 64;
+    options->memoryBudget = 0;
+    options->readBudget = 64 * 1024;
+    options->readCalls = 16;
+    options->idleTimeout = 0;
+    options->readTimeout = 0;
+    options->writeTimeout = 0;
+    options->highWatermark = 0;
+    options->lowWatermark = 0;
+    options->slowPolicy = SELECT_SLOW_BLOCK;
+    options->metricsInterval = 0;
+    options->metricsSignal = 0;
+    options->traceFile = NULL;
+    options->framing = SELECT_FRAME_NONE;
+    options->frameLengthBytes = 4;
+    options->frameDelimiter = '\n';
+    options->maxFrameSize = 64 * 1024;
+    options->upstreamIdle = 16;
+    options->upstreamIdleTimeout = 30 * 1000;
+    socketProfileInit(&options->profile);
+    options->zeroCopyThreshold = 0;
+    options->relaySplice = 1;
+    options->duplexOutput = 256 * 1024;
+    options->workers = 0;
+    options->workerBacklog = 256 * 1024;
+}
+
+/* flow control of the loop which calls, approximate if read from other thread */
+void selectFlowStats(const void* context, SelectFlowStats* stats)
+{
+    const struct SelectLoop* loop = context;
+
+    assert((loop != NULL) && (stats != NULL));
+    *stats = loop->flow;
+}
+
+/* memory of the loop which calls, approximate if read from other thread */
+void selectMemoryStats(const void* context, SelectMemoryStats* stats)
+{
+    const struct SelectLoop* loop = context;
+
+    assert((loop != NULL) && (stats != NULL));
+    stats->blocks = loop->pool.blocks;
+    stats->blocksUsed = loop->pool.blocksUsed;
+    stats->blockSize = loop->pool.blockSize;
+    stats->bytesUsed = loop->pool.bytesUsed;
+    stats->budget = loop->options.memoryBudget;
+}
+
+static void addHistogram(SelectHistogram* to, const SelectHistogram* from)
+{
+    int i;
+
+    to->count += from->count;
+    to->sum += from->sum;
+    for (i = 0; i < SELECT_HISTOGRAM_BUCKETS; i++)
+        to->bucket[i] += from->bucket[i];
+}
+
+static void addMetrics(SelectMetrics* metrics, const struct SelectLoop* loop)
+{
+    const SelectMetrics* m = &loop->metrics;
+
+    metrics->accepts += m->accepts;
+    metrics->disconnects += m->disconnects;
+    metrics->recvCalls += m->recvCalls;
+    metrics->recvAgain += m->recvAgain;
+    metrics->recvBytes += m->recvBytes;
+    metrics->sendCalls += m->sendCalls;
+    metrics->sendAgain += m->sendAgain;
+    metrics->sendBytes += m->sendBytes;
+    metrics->zeroCopySends += m->zeroCopySends;
+    metrics->zeroCopyCopied += m->zeroCopyCopied;
+    metrics->wakeups += m->wakeups;
+    metrics->events += m->events;
+    metrics->posted += m->posted;
+    metrics->offloaded += m->offloaded;
+    metrics->connected += loop->connectedCount;
+    metrics->slotsUsed += loop->usedSlots;
+    addHistogram(&metrics->waitTime, &m->waitTime);
+    addHistogram(&metrics->eventsPerWakeup, &m->eventsPerWakeup);
+    addHistogram(&metrics->callbackTime, &m->callbackTime);
+    addHistogram(&metrics->queueDepth, &m->queueDepth);
+}
+
+/* metrics of the loop which calls, or the sum of all running loops if context is NULL, approximate if read from other thread */
+void selectMetrics(const void* context, SelectMetrics* metrics)
+{
+    const struct SelectLoop* loop = context;
+    const struct SelectServer* server;
+    int i;
+
+    assert(metrics != NULL);
+    if (loop != NULL) {
+        *metrics = loop->metrics;
+        metrics->connected = loop->connectedCount;
+        metrics->slotsUsed = loop->usedSlots;
+        return;
+    }
+    memset(metrics, 0, sizeof(*metrics));
+    pthread_mutex_lock(&serversLock);
+    for (server = servers; server != NULL; server = server->next)
+        for (i = 0; i < server->loopCount; i++)
+            addMetrics(metrics, server->loops[i]);
+    pthread_mutex_unlock(&serversLock);
+}
+
+/* the upper bound of the bucket holding the given fraction (0..1) of values, 0 if empty */
+unsigned long long selectHistogramPercentile(const SelectHistogram* histogram, double fraction)
+{
+    unsigned long rank, seen = 0;
+    int i;
+
+    assert((histogram != NULL) && (fraction >= 0) && (fraction <= 1));
+    if (histogram->count == 0)
+        return 0;
+    rank = (unsigned long)(fraction * (histogram->count - 1)) + 1;
+    for (i = 0; i < SELECT_HISTOGRAM_BUCKETS - 1; i++) {
+        seen += histogram->bucket[i];
+        if (seen >= rank)
+            break;
+    }
+    return (i == 0) ? 0 : (1ULL << i) - 1;
+}
+
+/* one line of key=value pairs, returns its length like snprintf */
+int selectMetricsFormat(const SelectMetrics* m, char* buffer, unsigned size)
+{
+    assert((m != NULL) && (buffer != NULL));
+    return snprintf(buffer, size,
+        "connected=%lu slots=%lu accepts=%lu disconnects=%lu"
+        " recv=%lu recvAgain=%lu recvBytes=%llu send=%lu sendAgain=%lu sendBytes=%llu"
+        " zeroCopy=%lu zeroCopyCopied=%lu"
+        " wakeups=%lu events=%lu events.p50=%llu events.p99=%llu posted=%lu offloaded=%lu"
+        " waitUs.p50=%llu waitUs.p99=%llu callbackNs.p50=%llu callbackNs.p99=%llu"
+        " queueBytes.p50=%llu queueBytes.p99=%llu",
+        m->connected, m->slotsUsed, m->accepts, m->disconnects,
+        m->recvCalls, m->recvAgain, m->recvBytes, m->sendCalls, m->sendAgain, m->sendBytes,
+        m->zeroCopySends, m->zeroCopyCopied,
+        m->wakeups, m->events,
+        selectHistogramPercentile(&m->eventsPerWakeup, 0.5), selectHistogramPercentile(&m->eventsPerWakeup, 0.99),
+        m->posted, m->offloaded,
+        selectHistogramPercentile(&m->waitTime, 0.5), selectHistogramPercentile(&m->waitTime, 0.99),
+        selectHistogramPercentile(&m->callbackTime, 0.5), selectHistogramPercentile(&m->callbackTime, 0.99),
+        selectHistogramPercentile(&m->queueDepth, 0.5), selectHistogramPercentile(&m->queueDepth, 0.99));
+}
+
+/* written by traceWrite(), so it is safe to call from a signal handler */
+int selectTraceDump(int fd)
+{
+    const struct SelectServer* server;
+    int i, rc = 0;
+
+    for (server = __atomic_load_n(&servers, __ATOMIC_ACQUIRE); server != NULL; server = server->next)
+        for (i = 0; i < server->loopCount; i++)
+            if (traceWrite(&server->loops[i]->trace, fd) == -1)
+                rc = -1;
+    return rc;
+}
+
+/* dumps traces to SelectOptions.traceFile and dies by the same signal */
+static void crashed(int sig)
+{
+    int fd = open(traceFile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if (fd != -1) {
+        selectTraceDump(fd);
+        close(fd);
+    }
+    raise(sig); /* delivered with the default action after return */
+}
+
+static int installSignal(int sig, void (*handler)(int), int flags, struct sigaction* old)
+{
+    struct sigaction action;
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handler;
+    action.sa_flags = flags;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(sig, &action, old) == -1) {
+        perror("sigaction");
+        return -1;
+    }
+    return 0;
+}
+
+/* handlers for SelectOptions.metricsSignal and traceFile, old - the ones to restore */
+static int installSignals(const SelectOptions* options, struct SelectSignals* old)
+{
+    int i;
+
+    if ((options->metricsSignal != 0)
+            && (installSignal(options->metricsSignal, metricsSignalled, SA_RESTART, &old->metrics) == -1))
+        return -1;
+    if (options->traceFile == NULL)
+        return 0;
+    traceFile = options->traceFile;
+    for (i = 0; i < CRASH_SIGNALS; i++)
+        if (installSignal(crashSignal[i], crashed, SA_RESETHAND, &old->crash[i]) == -1)
+            return -1;
+    return 0;
+}
+
+static void restoreSignals(const SelectOptions* options, const struct SelectSignals* old)
+{
+    int i;
+
+    if (options->metricsSignal != 0)
+        sigaction(options->metricsSignal, &old->metrics, NULL);
+    if (options->traceFile == NULL)
+        return;
+    for (i = 0; i < CRASH_SIGNALS; i++)
+        sigaction(crashSignal[i], &old->crash[i], NULL);
+}
+
+/*
+Makes the loops of the server visible to signal handlers and selectMetrics(NULL).
+The first running server installs signal handlers with its options, the last one restores them.
+*/
+static int serverStart(struct SelectServer* server, const SelectOptions* options)
+{
+    int rc = 0;
+
+    pthread_mutex_lock(&serversLock);
+    if ((signalUsers == 0) && (installSignals(options, &oldSignals) == -1)) {
+        rc = -1;
+    } else {
+        if (signalUsers++ == 0)
+            signalOptions = *options;
+        server->next = servers;
+        __atomic_store_n(&servers, server, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&serversLock);
+    return rc;
+}
+
+static void serverStop(struct SelectServer* server)
+{
+    struct SelectServer** prev;
+
+    pthread_mutex_lock(&serversLock);
+    for (prev = &servers; *prev != server; prev = &(*prev)->next)
+        ;
+    __atomic_store_n(prev, server->next, __ATOMIC_RELEASE);
+    if (--signalUsers == 0)
+        restoreSignals(&signalOptions, &oldSignals);
+    pthread_mutex_unlock(&serversLock);
+}
+
+/* runs jobs until stopped and none is left, each one goes back to its loop when done */
+static void* workerThread(void* arg)
+{
+    struct SelectWorker* worker = arg;
+    struct SelectMessage* msg;
+    struct SelectLoop* loop;
+
+    for ( ; ; ) {
+        pthread_mutex_lock(&worker->lock);
+        while ((worker->first == NULL) && !worker->stop)
+            pthread_cond_wait(&worker->ready, &worker->lock);
+        msg = worker->first;
+        if (msg != NULL)
+            worker->first = msg->next;
+        pthread_mutex_unlock(&worker->lock);
+        if (msg == NULL)
+            return NULL;
+        loop = (struct SelectLoop*)msg->handle.context;
+        loop->handlers.workerRecv(&msg->handle, msg->data, msg->bytes, msg->length);
+        enqueue(loop, msg); /* after the replies it has posted */
+    }
+}
+
+static void stopWorkers(struct SelectServer* server)
+{
+    int i;
+
+    for (i = 0; i < server->workerCount; i++) {
+        pthread_mutex_lock(&server->workers[i].lock);
+        server->workers[i].stop = 1;
+        pthread_mutex_unlock(&server->workers[i].lock);
+        pthread_cond_signal(&server->workers[i].ready);
+    }
+    for (i = 0; i < server->workerCount; i++) {
+        pthread_join(server->workers[i].thread, NULL);
+        pthread_cond_destroy(&server->workers[i].ready);
+        pthread_mutex_destroy(&server->workers[i].lock);
+    }
+    free(server->workers);
+    server->workers = NULL;
+    server->workerCount = 0;
+}
+
+/* SelectOptions.workers threads, they must be running before the loops */
+static int startWorkers(struct SelectServer* server, int count)
+{
+    struct SelectWorker* worker;
+
+    server->workers = NULL;
+    server->workerCount = 0;
+    if (count == 0)
+        return 0;
+    server->workers = calloc(count, sizeof(struct SelectWorker));
+    if (server->workers == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    while (server->workerCount < count) {
+        worker = &server->workers[server->workerCount];
+        pthread_mutex_init(&worker->lock, NULL);
+        pthread_cond_init(&worker->ready, NULL);
+        if (pthread_create(&worker->thread, NULL, workerThread, worker) != 0) {
+            perror("pthread_create");
+            pthread_cond_destroy(&worker->ready);
+            pthread_mutex_destroy(&worker->lock);
+            stopWorkers(server);
+            return -1;
+        }
+        server->workerCount++;
+    }
+    return 0;
+}
+
+/*
+maxChunkSize - the maximum chunk of data that can be specified per one
+    socketSend/socketRecv call inside selectServer loop.
+*/
+int selectServer(const Socket* listen, int maxChunkSize, const SelectHandlers* handlers, void* user)
+{
+    SelectOptions options;
+
+    selectOptionsInit(&options);
+    options.handlers = handlers;
+    options.user = user;
+    options.maxChunkSize = maxChunkSize;
+    return selectServerOptions(listen, &options);
+}
+
+int selectServerOptions(const Socket* listen, const SelectOptions* options)
+{
+    assert(listen != NULL);
+    return selectServerListeners(&listen, 1, options);
+}
+
+/*
+Serves connections of all count listen sockets in one loop, e.g. TCP and
+Unix ones. Callbacks do not tell them apart, the loop is the same.
+*/
+int selectServerListeners(const Socket** listen, int count, const SelectOptions* options)
+{
+    struct SelectServer server;
+    struct SelectLoop* loop;
+    int rc;
+
+    assert((listen != NULL) && (count > 0) && (options->handlers != NULL));
+    assert((options->workers >= 0) && ((options->workers == 0) || (options->handlers->workerRecv != NULL)));
+    assert((options->maxChunkSize > 0) && (options->acceptBatch > 0) && (options->acceptBudget > 0));
+    assert((options->readBudget > 0) && (options->readCalls > 0));
+    assert((options->framing == SELECT_FRAME_NONE)
+        || ((options->frameLengthBytes >= 1) && (options->frameLengthBytes <= 4)));
+    assert((options->highWatermark == 0) || (options->lowWatermark < options->highWatermark));
+    memset(&server, 0, sizeof(server)); /* no workers and no budget until they are started */
+    if (options->memoryBudget != 0)
+        poolBudgetInit(&server.budget, options->memoryBudget);
+    loop = loopCreate(&server, listen, count, options);
+    if (loop == NULL)
+        return -1;
+    server.loops = &loop;
+    server.loopCount = 1;
+    if (startWorkers(&server, options->workers) == -1) {
+        loopDestroy(loop);
+        return -1;
+    }
+    rc = serverStart(&server, options);
+    if (rc == 0) {
+        rc = loopRun(loop);
+        serverStop(&server);
+    }
+    stopWorkers(&server);
+    loopDestroy(loop);
+    return rc;
+}
+
+static struct SelectUpstream* findUpstream(struct SelectLoop* loop, unsigned int ip4, unsigned short port)
+{
+    struct SelectUpstream* upstream;
+
+    for (upstream = loop->upstreams; upstream != NULL; upstream = upstream->next)
+        if ((upstream->ip4 == ip4) && (upstream->port == port))
+            return upstream;
+    upstream = calloc(1, sizeof(*upstream));
+    if (upstream == NULL)
+        return NULL;
+    upstream->ip4 = ip4;
+    upstream->port = port;
+    upstream->next = loop->upstreams;
+    loop->upstreams = upstream;
+    return upstream;
+}
+
+/* a non-blocking socket connecting to ip4:port, NULL with errno set if it can't */
+static Socket* startConnect(struct SelectLoop* loop, unsigned int ip4, unsigned short port)
+{
+    Socket* sock = socketConstruct();
+    int error;
+
+    if (sock == NULL)
+        return NULL;
+    socketSetAddress(ip4, port, sock);
+    if ((socketCreate(sock) == -1) || (socketSetBlocking(0/*false*/, sock) == -1))
+        goto failed;
+    if (socketSetProfile(&loop->options.profile, 0, sock) == -1) /* connected anyway, like accepted ones */
+        debugPrintf("socketSetProfile: %s", socketError(sock));
+    if (socketConnect(sock) == -1)
+        goto failed;
+    return sock;
+failed:
+    error = errno;
+    socketClose(sock);
+    socketDestroy(sock);
+    errno = error;
+    return NULL;
+}
+
+/*
+Connects to ip4:port, or takes a connection released to this address
+earlier. The result comes later to SelectHandlers.clientConnect, then the connection
+is served like accepted ones, or to SelectHandlers.clientConnectErr with errno set,
+ETIMEDOUT if it has not connected in timeout ms (0 if no limit).
+Returns -1 with errno set if the connect can't be started.
+*/
+int selectConnect(unsigned int ip4, unsigned short port, unsigned long timeout, void* arg, const void* context)
+{
+    struct SelectLoop* loop = (struct SelectLoop*)context;
+    struct SelectUpstream* upstream;
+    struct SelectPrivate* client;
+    Socket* sock;
+    int error;
+
+    assert(loop != NULL);
+    upstream = findUpstream(loop, ip4, port);
+    if (upstream == NULL)
+        return -1;
+    client = upstream->idle;
+    if (client != NULL) { /* reported by the deadline timer, not from inside the caller */
+        *client->prevIdle = client->nextIdle;
+        if (client->nextIdle != NULL)
+            client->nextIdle->prevIdle = client->prevIdle;
+        upstream->idleCount--;
+        client->state = CLIENT_REUSED;
+        client->arg = client->data = arg;
+        client->stateDeadline = loop->now;
+        client->idleTimeout = loop->options.idleTimeout;
+        client->readTimeout = loop->options.readTimeout;
+        client->writeTimeout = loop->options.writeTimeout;
+        client->highWatermark = loop->options.highWatermark;
+        client->lowWatermark = loop->options.lowWatermark;
+        armDeadline(client);
+        return 0;
+    }
+    sock = startConnect(loop, ip4, port);
+    if (sock == NULL)
+        return -1;
+    client = attachClient(loop, sock, 1);
+    if (client == NULL) {
+        error = errno;
+        socketClose(sock);
+        socketDestroy(sock);
+        errno = error;
+        return -1;
+    }
+    client->arg = client->data = arg;
+    client->upstream = upstream;
+    client->stateDeadline = (timeout != 0) ? loop->now + timeout : 0;
+    armDeadline(client);
+    return 0;
+}
+
+/*
+Connects to ip4:port and relays bytes between sock and the new connection
+both ways, nothing is reported for the new one. Output queued for sock
+goes before relayed data, SelectHandlers.serverRecvOk is not called for sock any
+more. EOF of either side is passed on after its data, when both sides have
+sent it, or one fails, or connecting takes timeout ms (0 if no limit),
+sock is closed with SelectHandlers.serverDisconnect.
+With SelectOptions.relaySplice, a readiness poller and Linux the data goes
+through pipes by splice(2) and never comes to user space, then SIGPIPE is
+ignored unless the application handles it. Otherwise it is copied.
+Returns -1 with errno set if the relay can't be started.
+*/
+int selectRelay(const Socket* sock, unsigned int ip4, unsigned short port, unsigned long timeout,
+    const void* context)
+{
+    struct SelectLoop* loop = (struct SelectLoop*)context;
+    struct SelectPrivate* client;
+    struct SelectPrivate* other;
+    Socket* up;
+    int fd[4] = { -1, -1, -1, -1 };
+    int splicing, error, i;
+
+    assert(loop != NULL);
+    client = findClient(loop, sock);
+    assert(client != NULL);
+    if ((client->relay != NULL) || (client->state != CLIENT_OPEN) || quiet(client) || client->closing) {
+        errno = EINVAL;
+        return -1;
+    }
+#if defined(LINUX)
+    splicing = loop->options.relaySplice && !loop->async;
+    if (splicing && ((pipe2(fd, O_NONBLOCK | O_CLOEXEC) == -1) || (pipe2(fd + 2, O_NONBLOCK | O_CLOEXEC) == -1)))
+        goto fail;
+#else
+    splicing = 0;
+#endif
+    up = startConnect(loop, ip4, port);
+    if (up == NULL)
+        goto fail;
+    other = attachClient(loop, up, 1);
+    if (other == NULL) {
+        error = errno;
+        socketClose(up);
+        socketDestroy(up);
+        errno = error;
+        goto fail;
+    }
+    if (splicing) {
+        struct sigaction action;
+        if ((sigaction(SIGPIPE, NULL, &action) == 0) && (action.sa_handler == SIG_DFL))
+            installSignal(SIGPIPE, SIG_IGN, 0, NULL);
+        client->pipe[0] = fd[0];
+        client->pipe[1] = fd[1];
+        other->pipe[0] = fd[2];
+        other->pipe[1] = fd[3];
+    }
+    other->internal = 1;
+    other->relay = client;
+    client->relay = other;
+    other->stateDeadline = (timeout != 0) ? loop->now + timeout : 0;
+    armDeadline(other);
+    relayUpdate(client); /* sock does not read until connected */
+    traceEvent(&loop->trace, TRACE_RELAY, *(int*)sock, *(int*)up, splicing);
+    return 0;
+fail:
+    error = errno;
+    for (i = 0; i < 4; i++)
+        if (fd[i] != -1) close(fd[i]);
+    errno = error;
+    return -1;
+}
+
+/*
+Closes the connection after its queued output is sent, no callbacks are
+called for it after that. Data which comes meanwhile is ignored.
+*/
+void selectClose(const Socket* sock, const void* context)
+{
+    struct SelectPrivate* client = findClient(context, sock);
+
+    assert(client != NULL);
+    if (client->closing || client->draining)
+        return;
+    if (client->output.bytes == 0)
+        closeLater(client, CLOSING_ASKED);
+    else
+        client->draining = 1;
+}
+
+/*
+Gives back a connection of selectConnect for reuse by the next selectConnect
+to the same address. It is closed instead if it has output or a partial
+message, if it is not from selectConnect, or if the upstream already keeps
+SelectOptions.upstreamIdle ones. No callbacks are called for it after that.
+*/
+void selectRelease(const Socket* sock, const void* context)
+{
+    struct SelectPrivate* client = findClient(context, sock);
+    struct SelectUpstream* upstream;
+
+    assert(client != NULL);
+    upstream = client->upstream;
+    if ((upstream == NULL) || (client->state != CLIENT_OPEN) || client->closing || client->draining
+            || (client->output.bytes != 0) || (client->frameSize != 0)
+            || (upstream->idleCount >= client->loop->options.upstreamIdle)) {
+        selectClose(sock, context);
+        return;
+    }
+    topicUnsubscribeAll(&client->loop->topics, &client->topics); /* the next user starts clean */
+    client->state = CLIENT_IDLE;
+    client->arg = client->data = NULL;
+    client->stateDeadline = client->loop->now + client->loop->options.upstreamIdleTimeout;
+    client->nextIdle = upstream->idle;
+    client->prevIdle = &upstream->idle;
+    if (upstream->idle != NULL)
+        upstream->idle->prevIdle = &client->nextIdle;
+    upstream->idle = client;
+    upstream->idleCount++;
+    armDeadline(client);
+}
+
+/* overrides SelectOptions timeouts for one connection, ms, 0 if none */
+void selectSetTimeouts(const Socket* sock, unsigned long idle, unsigned long read, unsigned long write,
+    const void* context)
+{
+    struct SelectPrivate* client = findClient(context, sock);
+
+    assert(client != NULL);
+    client->idleTimeout = idle;
+    client->readTimeout = read;
+    client->writeTimeout = write;
+    armDeadline(client);
+}
+
+/* overrides SelectOptions watermarks for one connection, high is 0 if unlimited */
+void selectSetWatermarks(const Socket* sock, unsigned long high, unsigned long low, const void* context)
+{
+    struct SelectPrivate* client = findClient(context, sock);
+
+    assert(client != NULL);
+    assert((high == 0) || (low < high));
+    client->highWatermark = high;
+    client->lowWatermark = low;
+    if (client->slow && ((high == 0) || (client->output.bytes <= low)))
+        releaseWaiters(client);
+}
+
+/*
+Calls callback after delay ms and then every period ms, once if period is 0.
+A one-shot timer is freed after its callback returns and must not be stopped later.
+Returns NULL if out of memory.
+*/
+SelectTimer* selectTimerStart(unsigned long delay, unsigned long period, SelectTimerCallback callback, void* arg,
+    const void* context)
+{
+    struct SelectLoop* loop = (struct SelectLoop*)context;
+    SelectTimer* timer;
+
+    assert((loop != NULL) && (callback != NULL));
+    timer = calloc(1, sizeof(*timer));
+    if (timer == NULL)
+        return NULL;
+    timer->loop = loop;
+    timer->period = period;
+    timer->callback = callback;
+    timer->arg = arg;
+    timer->timer.callback = timerExpired;
+    timer->timer.arg = timer;
+    timer->next = loop->timers;
+    timer->prev = &loop->timers;
+    if (loop->timers != NULL)
+        loop->timers->prev = &timer->next;
+    loop->timers = timer;
+    timerStart(&loop->wheel, &timer->timer, loop->now + delay);
+    return timer;
+}
+
+/* may be called from the timer own callback */
+void selectTimerStop(SelectTimer* timer, const void* context)
+{
+    assert((timer != NULL) && (timer->loop == context));
+    if (timer->firing) {
+        timerStop(&timer->loop->wheel, &timer->timer);
+        timer->stopped = 1;
+    } else {
+        freeTimer(timer);
+    }
+}
+
+static void* loopThread(void* arg)
+{
+    struct SelectLoop* loop = arg;
+
+    if (loop->cpu >= 0) {
+#if defined(LINUX)
+        cpu_set_t set;
+        int rc;
+        CPU_ZERO(&set);
+        CPU_SET(loop->cpu, &set);
+        rc = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        debugPrintf("pthread_setaffinity_np: cpu %d, rc= %d", loop->cpu, rc);
+        (void)rc;
+#else
+        debugPrintf("pinning to cpu %d is not supported", loop->cpu);
+#endif
+    }
+    loop->rc = loopRun(loop);
+    return NULL;
+}
+
+/*
+Runs one loop per listen socket, each in own thread with own connections.
+Listen sockets are expected to be bound to the same address with
+SO_REUSEPORT, so the kernel spreads new connections among the loops.
+pinned - if not zero, loop i runs on core (i % number of cores).
+Returns when all loops have exited.
+*/
+int selectServerThreads(const Socket** listen, int count, const SelectOptions* options, int pinned)
+{
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    struct SelectServer server;
+    struct SelectLoop** loops;
+    int rc = 0, i, started = 0;
+
+    assert((listen != NULL) && (count > 0) && (options->handlers != NULL));
+    assert((options->workers >= 0) && ((options->workers == 0) || (options->handlers->workerRecv != NULL)));
+    assert((options->maxChunkSize > 0) && (options->acceptBatch > 0) && (options->acceptBudget > 0));
+    assert((options->readBudget > 0) && (options->readCalls > 0));
+    assert((options->framing == SELECT_FRAME_NONE)
+        || ((options->frameLengthBytes >= 1) && (options->frameLengthBytes <= 4)));
+    assert((options->highWatermark == 0) || (options->lowWatermark < options->highWatermark));
+    if (cores < 1)
+        cores = 1;
+    memset(&server, 0, sizeof(server)); /* stopWorkers is safe if a loop fails before they start */
+    loops = calloc(count, sizeof(struct SelectLoop*));
+    if (loops == NULL)
+        return -1;
+    if (options->memoryBudget != 0)
+        poolBudgetInit(&server.budget, options->memoryBudget);
+    for (i = 0; i < count; i++) {
+        loops[i] = loopCreate(&server, &listen[i], 1, options);
+        if (loops[i] == NULL) {
+            rc = -1;
+            break;
+        }
+        loops[i]->id = loops[i]->trace.id = i;
+        loops[i]->cpu = pinned ? (int)(i % cores) : -1;
+    }
+    server.loops = loops;
+    server.loopCount = count; /* must be set before any loop runs */
+    if ((rc == 0) && (startWorkers(&server, options->workers) == -1))
+        rc = -1;
+    if ((rc == 0) && (serverStart(&server, options) == 0)) {
+        for ( ; started < count; started++) {
+            if (pthread_create(&loops[started]->thread, NULL, loopThread, loops[started]) != 0) {
+                perror("pthread_create");
+                rc = -1;
+                break;
+            }
+        }
+        if (rc == -1) /* the started ones would run forever */
+            for (i = 0; i < started; i++)
+                stopLoop(loops[i]);
+        for (i = 0; i < started; i++) {
+            pthread_join(loops[i]->thread, NULL);
+            if (loops[i]->rc == -1)
+                rc = -1;
+        }
+        serverStop(&server);
+    } else {
+        rc = -1;
+    }
+    stopWorkers(&server);
+    for (i = 0; i < count; i++)
+        loopDestroy(loops[i]);
+    free(loops);
+    return rc;
+}
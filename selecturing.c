@@ -0,0 +1,636 @@
+#if defined(URING)
+
+#if !defined(LINUX)
+#error "io_uring is available only with -DLINUX"
+#endif
+
+#include <assert.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/utsname.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "debug.h"
+#include "selectpoll.h"
+
+/*
+   Completion based poller. Accepted connections are read with multishot
+   recv into a ring of provided buffers and written with sendmsg, all
+   submitted in one io_uring_enter() per wait. Other descriptors (the
+   wakeup pipe) are watched with multishot poll.
+   Multishot recv and buffer rings need Linux 6.0, older kernels make
+   selectUringCreate() fail so the caller falls back to epoll.
+*/
+
+#define URING_ENTRIES 1024 /* submission queue, completion queue is 4 times bigger */
+#define URING_BUFFERS 256 /* provided receive buffers, must be power of 2 */
+#define URING_GROUP 0 /* id of the buffer group */
+#define URING_IOVEC 64 /* iovecs per one send */
+
+/* kind of request, low 3 bits of user_data */
+#define OP_ACCEPT 1
+#define OP_RECV 2
+#define OP_SEND 3 /* user_data is struct UringSend* | OP_SEND */
+#define OP_POLL 4
+#define OP_IGNORE 5 /* cancel and update requests */
+#define OP_MASK 7
+
+#define FD_ACCEPT 0x1 /* multishot accept armed */
+#define FD_RECV 0x2 /* multishot recv armed */
+#define FD_RECV_WANTED 0x4 /* recv enabled by selectPollRecv() */
+#define FD_POLL 0x8 /* multishot poll armed */
+
+/* sendmsg in flight, must be 8 aligned */
+struct UringSend {
+    struct UringSend* next; /* free list */
+    struct UringSend* nextAll; /* every allocated one */
+    int fd;
+    unsigned gen;
+    struct msghdr msg;
+    struct iovec iov[URING_IOVEC];
+};
+
+struct UringFd {
+    void* data; /* pointer registered with add/accept */
+    unsigned gen; /* incremented by remove, completions of older requests are dropped */
+    unsigned flags; /* FD_XXX */
+    unsigned events; /* SELECT_POLL_IN/OUT watched by poll */
+};
+
+struct SelectUring {
+    struct SelectPoll base;
+    int ringfd;
+    /* submission queue */
+    void* sqRing;
+    size_t sqRingSize;
+    unsigned* sqHead;
+    unsigned* sqTail;
+    unsigned sqMask;
+    unsigned* sqArray;
+    struct io_uring_sqe* sqes;
+    size_t sqesSize;
+    unsigned toSubmit;
+    /* completion queue, in sqRing mapping if cqRing is NULL */
+    void* cqRing;
+    size_t cqRingSize;
+    unsigned* cqHead;
+    unsigned* cqTail;
+    unsigned cqMask;
+    struct io_uring_cqe* cqes;
+    /* provided receive buffers */
+    struct io_uring_buf_ring* bufRing;
+    size_t bufRingSize;
+    unsigned short bufTail;
+    char* buffers;
+    unsigned bufferSize;
+    /* descriptor -> state */
+    struct UringFd* fds;
+    int fdCount;
+    struct UringSend* freeSend;
+    struct UringSend* allSend;
+};
+
+static int uringSetup(unsigned entries, struct io_uring_params* p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uringEnter(int fd, unsigned submit, unsigned complete, unsigned flags, void* arg, size_t size)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, submit, complete, flags, arg, size);
+}
+
+static int uringRegister(int fd, unsigned op, void* arg, unsigned count)
+{
+    return (int)syscall(__NR_io_uring_register, fd, op, arg, count);
+}
+
+static uint64_t userData(struct SelectUring* poll, int fd, unsigned op)
+{
+    return ((uint64_t)poll->fds[fd].gen << 32) | ((uint64_t)fd << 3) | op;
+}
+
+static int submit(struct SelectUring* poll)
+{
+    int rc;
+
+    if (poll->toSubmit == 0)
+        return 0;
+    rc = uringEnter(poll->ringfd, poll->toSubmit, 0, 0, NULL, 0);
+    if (rc == -1)
+        return -1;
+    poll->toSubmit -= ((unsigned)rc < poll->toSubmit) ? (unsigned)rc : poll->toSubmit;
+    return 0;
+}
+
+/* returns cleared entry, it is submitted by the next wait */
+static struct io_uring_sqe* getSqe(struct SelectUring* poll, int fd, unsigned char opcode, uint64_t data)
+{
+    unsigned tail = *poll->sqTail;
+    unsigned index = tail & poll->sqMask;
+    struct io_uring_sqe* sqe;
+
+    if (tail - __atomic_load_n(poll->sqHead, __ATOMIC_ACQUIRE) > poll->sqMask) { /* full */
+        if ((submit(poll) == -1)
+                || (tail - __atomic_load_n(poll->sqHead, __ATOMIC_ACQUIRE) > poll->sqMask)) {
+            errno = EBUSY;
+            return NULL;
+        }
+    }
+    sqe = &poll->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->user_data = data;
+    poll->sqArray[index] = index;
+    __atomic_store_n(poll->sqTail, tail + 1, __ATOMIC_RELEASE);
+    poll->toSubmit++;
+    return sqe;
+}
+
+static unsigned toPoll(unsigned events)
+{
+    unsigned ev = 0;
+    if (events & SELECT_POLL_IN) ev |= POLLIN;
+    if (events & SELECT_POLL_OUT) ev |= POLLOUT;
+    return ev;
+}
+
+static int armPoll(struct SelectUring* poll, int fd)
+{
+    struct io_uring_sqe* sqe = getSqe(poll, fd, IORING_OP_POLL_ADD, userData(poll, fd, OP_POLL));
+
+    if (sqe == NULL)
+        return -1;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->poll32_events = toPoll(poll->fds[fd].events);
+    poll->fds[fd].flags |= FD_POLL;
+    return 0;
+}
+
+static int armAccept(struct SelectUring* poll, int fd)
+{
+    struct io_uring_sqe* sqe = getSqe(poll, fd, IORING_OP_ACCEPT, userData(poll, fd, OP_ACCEPT));
+
+    if (sqe == NULL)
+        return -1;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    poll->fds[fd].flags |= FD_ACCEPT;
+    return 0;
+}
+
+static int armRecv(struct SelectUring* poll, int fd)
+{
+    struct io_uring_sqe* sqe = getSqe(poll, fd, IORING_OP_RECV, userData(poll, fd, OP_RECV));
+
+    if (sqe == NULL)
+        return -1;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_GROUP;
+    poll->fds[fd].flags |= FD_RECV;
+    return 0;
+}
+
+/* cancels one request, its last completion has -ECANCELED */
+static int cancel(struct SelectUring* poll, int fd, unsigned op)
+{
+    struct io_uring_sqe* sqe = getSqe(poll, -1, IORING_OP_ASYNC_CANCEL, userData(poll, fd, OP_IGNORE));
+
+    if (sqe == NULL)
+        return -1;
+    sqe->addr = userData(poll, fd, op);
+    return 0;
+}
+
+static void giveBuffer(struct SelectUring* poll, unsigned id)
+{
+    struct io_uring_buf* buf = &poll->bufRing->bufs[poll->bufTail & (URING_BUFFERS - 1)];
+
+    buf->addr = (uint64_t)(uintptr_t)(poll->buffers + (size_t)id * poll->bufferSize);
+    buf->len = poll->bufferSize;
+    buf->bid = (unsigned short)id;
+    poll->bufTail++;
+    __atomic_store_n(&poll->bufRing->tail, poll->bufTail, __ATOMIC_RELEASE);
+}
+
+static void uringDestroy(struct SelectPoll* base)
+{
+    struct SelectUring* poll = (struct SelectUring*)base;
+
+    if (poll->ringfd != -1) close(poll->ringfd); /* cancels everything in flight */
+    if (poll->sqes != NULL) munmap(poll->sqes, poll->sqesSize);
+    if (poll->cqRing != NULL) munmap(poll->cqRing, poll->cqRingSize);
+    if (poll->sqRing != NULL) munmap(poll->sqRing, poll->sqRingSize);
+    if (poll->bufRing != NULL) munmap(poll->bufRing, poll->bufRingSize);
+    while (poll->allSend != NULL) {
+        struct UringSend* next = poll->allSend->nextAll;
+        free(poll->allSend);
+        poll->allSend = next;
+    }
+    free(poll->buffers);
+    free(poll->fds);
+    free(poll);
+}
+
+static int checkFd(const struct SelectUring* poll, int fd)
+{
+    if ((fd < 0) || (fd >= poll->fdCount)) {
+        errno = EBADF;
+        return -1;
+    }
+    return 0;
+}
+
+static int uringAdd(struct SelectPoll* base, int fd, unsigned events, void* data)
+{
+    struct SelectUring* poll = (struct SelectUring*)base;
+
+    if (checkFd(poll, fd) == -1)
+        return -1;
+    poll->fds[fd].data = data;
+    poll->fds[fd].flags = 0;
+    poll->fds[fd].events = events;
+    return (events != 0) ? armPoll(poll, fd) : 0;
+}
+
+static int uringModify(struct SelectPoll* base, int fd, unsigned events, void* data)
+{
+    struct SelectUring* poll = (struct SelectUring*)base;
+    struct UringFd* state;
+    struct io_uring_sqe* sqe;
+
+    assert(checkFd(poll, fd) == 0);
+    state = &poll->fds[fd];
+    state->data = data;
+    if (state->events == events)
+        return 0;
+    state->events = events;
+    if (!(state->flags & FD_POLL))
+        return (events != 0) ? armPoll(poll, fd) : 0;
+    if (events == 0) /* FD_POLL is cleared by the last completion */
+        return cancel(poll, fd, OP_POLL);
+    sqe = getSqe(poll, -1, IORING_OP_POLL_REMOVE, userData(poll, fd, OP_IGNORE));
+    if (sqe == NULL)
+        return -1;
+    sqe->addr = userData(poll, fd, OP_POLL);
+    sqe->len = IORING_POLL_UPDATE_EVENTS | IORING_POLL_ADD_MULTI;
+    sqe->poll32_events = toPoll(events);
+    return 0;
+}
+
+/*
+Cancels everything in flight for fd and submits right away,
+because the descriptor is usually closed next.
+*/
+static int uringRemove(struct SelectPoll* base, int fd)
+{
+    struct SelectUring* poll = (struct SelectUring*)base;
+    struct io_uring_sqe* sqe;
+
+    assert(checkFd(poll, fd) == 0);
+    sqe = getSqe(poll, fd, IORING_OP_ASYNC_CANCEL, userData(poll, fd, OP_IGNORE));
+    if (sqe != NULL)
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    poll->fds[fd].gen++;
+    poll->fds[fd].data = NULL;
+    poll->fds[fd].flags = 0;
+    poll->fds[fd].events = 0;
+    return ((sqe == NULL) || (submit(poll) == -1)) ? -1 : 0;
+}
+
+static int uringAccept(struct SelectPoll* base, int fd, void* data)
+{
+    struct SelectUring* poll = (struct SelectUring*)base;
+
+    if (checkFd(poll, fd) == -1)
+        return -1;
+    poll->fds[fd].data = data;
+    poll->fds[fd].flags = 0;
+    poll->fds[fd].events = 0;
+    return armAccept(poll, fd);
+}
+
+static int uringRecv(struct SelectPoll* base, int fd, int enable)
+{
+    struct SelectUring* poll = (struct SelectUring*)base;
+    struct UringFd* state;
+
+    assert(checkFd(poll, fd) == 0);
+    state = &poll->fds[fd];
+    if (enable) {
+        state->flags |= FD_RECV_WANTED;
+        if (!(state->flags & FD_RECV)) /* else rearmed by the last completion */
+            return armRecv(poll, fd);
+    } else if (state->flags & FD_RECV_WANTED) {
+        state->flags &= ~FD_RECV_WANTED;
+        if (state->flags & FD_RECV)
+            return cancel(poll, fd, OP_RECV);
+    }
+    return 0;
+}
+
+static int uringSend(struct SelectPoll* base, int fd, const struct iovec* iov, int count)
+{
+    struct SelectUring* poll = (struct SelectUring*)base;
+    struct UringSend* send = poll->freeSend;
+    struct io_uring_sqe* sqe;
+
+    assert(checkFd(poll, fd) == 0);
+    assert(count > 0);
+    if (send == NULL) {
+        send = malloc(sizeof(*send));
+        if (send == NULL)
+            return -1;
+        send->nextAll = poll->allSend;
+        poll->allSend = send;
+    } else {
+        poll->freeSend = send->next;
+    }
+    if (count > URING_IOVEC)
+        count = URING_IOVEC;
+    send->fd = fd;
+    send->gen = poll->fds[fd].gen;
+    memcpy(send->iov, iov, count * sizeof(struct iovec));
+    memset(&send->msg, 0, sizeof(send->msg));
+    send->msg.msg_iov = send->iov;
+    send->msg.msg_iovlen = count;
+    sqe = getSqe(poll, fd, IORING_OP_SENDMSG, (uint64_t)(uintptr_t)send | OP_SEND);
+    if (sqe == NULL) {
+        send->next = poll->freeSend;
+        poll->freeSend = send;
+        return -1;
+    }
+    sqe->addr = (uint64_t)(uintptr_t)&send->msg;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    return 0;
+}
+
+static void uringRecycle(struct SelectPoll* base, const struct SelectPollEvent* event)
+{
+    struct SelectUring* poll = (struct SelectUring*)base;
+
+    assert(event->buffer != NULL);
+    giveBuffer(poll, event->bufferId);
+}
+
+/* converts one completion, returns 1 if event is filled */
+static int complete(struct SelectUring* poll, const struct io_uring_cqe* cqe, struct SelectPollEvent* event)
+{
+    unsigned op = (unsigned)(cqe->user_data & OP_MASK);
+    int more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+    struct UringFd* state;
+    int fd;
+
+    if (op == OP_IGNORE)
+        return 0;
+    if (op == OP_SEND) {
+        struct UringSend* send = (struct UringSend*)(uintptr_t)(cqe->user_data & ~(uint64_t)OP_MASK);
+        fd = send->fd;
+        send->next = poll->freeSend;
+        poll->freeSend = send;
+        if (send->gen != poll->fds[fd].gen) /* removed meanwhile */
+            return 0;
+        event->data = poll->fds[fd].data;
+        event->events = SELECT_POLL_SENT;
+        event->result = cqe->res;
+        event->buffer = NULL;
+        return 1;
+    }
+    fd = (int)((cqe->user_data >> 3) & 0x1fffffff);
+    state = &poll->fds[fd];
+    if ((unsigned)(cqe->user_data >> 32) != state->gen) { /* removed meanwhile */
+        if (cqe->flags & IORING_CQE_F_BUFFER)
+            giveBuffer(poll, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        else if ((op == OP_ACCEPT) && (cqe->res >= 0))
+            close(cqe->res);
+        return 0;
+    }
+    event->data = state->data;
+    event->result = cqe->res;
+    event->buffer = NULL;
+    switch (op) {
+    case OP_ACCEPT:
+        if (!more) {
+            state->flags &= ~FD_ACCEPT;
+            if (cqe->res != -ECANCELED)
+                armAccept(poll, fd);
+        }
+        if (cqe->res == -ECANCELED)
+            return 0;
+        event->events = SELECT_POLL_ACCEPT;
+        return 1;
+    case OP_RECV:
+        if (!more) {
+            state->flags &= ~FD_RECV;
+            /* stopped by cancel, end of buffers or multishot limit */
+            if ((state->flags & FD_RECV_WANTED)
+                    && ((cqe->res > 0) || (cqe->res == -ECANCELED) || (cqe->res == -ENOBUFS)))
+                armRecv(poll, fd);
+        }
+        if ((cqe->res == -ECANCELED) || (cqe->res == -ENOBUFS))
+            return 0;
+        if (cqe->flags & IORING_CQE_F_BUFFER) {
+            event->bufferId = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+            event->buffer = poll->buffers + (size_t)event->bufferId * poll->bufferSize;
+        }
+        event->events = SELECT_POLL_RECV;
+        return 1;
+    case OP_POLL:
+        if (!more) {
+            state->flags &= ~FD_POLL;
+            if ((cqe->res != -ECANCELED) && (state->events != 0))
+                armPoll(poll, fd);
+        }
+        if (cqe->res <= 0)
+            return 0;
+        event->events = 0;
+        /* errors and hang up are reported by the following recv/send */
+        if (cqe->res & (POLLIN | POLLHUP | POLLERR))
+            event->events |= SELECT_POLL_IN;
+        if (cqe->res & (POLLOUT | POLLHUP | POLLERR))
+            event->events |= SELECT_POLL_OUT;
+        return 1;
+    }
+    return 0;
+}
+
+static int reap(struct SelectUring* poll, struct SelectPollEvent* events, int maxEvents)
+{
+    unsigned head = *poll->cqHead;
+    unsigned tail = __atomic_load_n(poll->cqTail, __ATOMIC_ACQUIRE);
+    int n = 0;
+
+    for ( ; (head != tail) && (n < maxEvents); head++)
+        n += complete(poll, &poll->cqes[head & poll->cqMask], &events[n]);
+    __atomic_store_n(poll->cqHead, head, __ATOMIC_RELEASE);
+    return n;
+}
+
+/*
+timeout - in milliseconds, -1 waits forever.
+Returns number of filled events, 0 on timeout or signal, -1 on error.
+Submits everything prepared since the previous call in the same syscall.
+*/
+static int uringWait(struct SelectPoll* base, struct SelectPollEvent* events, int maxEvents, int timeout)
+{
+    struct SelectUring* poll = (struct SelectUring*)base;
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    int n, rc;
+
+    n = reap(poll, events, maxEvents);
+    if ((n > 0) || (timeout == 0)) {
+        if (submit(poll) == -1 && errno != EINTR && errno != EBUSY)
+            return -1;
+        return n;
+    }
+    memset(&arg, 0, sizeof(arg));
+    if (timeout > 0) {
+        ts.tv_sec = timeout / 1000;
+        ts.tv_nsec = (timeout % 1000) * 1000000L;
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+    }
+    rc = uringEnter(poll->ringfd, poll->toSubmit, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+        &arg, sizeof(arg));
+    if (rc == -1) {
+        if ((errno == EINTR) || (errno == ETIME)) /* was interruped by a signal or timed out */
+            return reap(poll, events, maxEvents);
+        if (errno != EBUSY) /* completion queue is full, reap it */
+            return -1;
+    } else {
+        poll->toSubmit -= ((unsigned)rc < poll->toSubmit) ? (unsigned)rc : poll->toSubmit;
+    }
+    return reap(poll, events, maxEvents);
+}
+
+static const struct SelectPollOps ops = {
+    uringDestroy, uringAdd, uringModify, uringRemove, uringWait,
+    uringAccept, uringRecv, uringSend, uringRecycle
+};
+
+static int kernelSupported(void)
+{
+    struct utsname name;
+    int major = 0;
+
+    if (uname(&name) == -1)
+        return 0;
+    sscanf(name.release, "%d", &major);
+    return major >= 6; /* multishot recv and buffer rings */
+}
+
+static int mapRings(struct SelectUring* poll, const struct io_uring_params* p)
+{
+    char* sq;
+    char* cq;
+
+    poll->sqRingSize = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+    poll->cqRingSize = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+    if (p->features & IORING_FEAT_SINGLE_MMAP) {
+        if (poll->cqRingSize > poll->sqRingSize)
+            poll->sqRingSize = poll->cqRingSize;
+    }
+    sq = mmap(NULL, poll->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        poll->ringfd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED)
+        return -1;
+    poll->sqRing = sq;
+    if (p->features & IORING_FEAT_SINGLE_MMAP) {
+        cq = sq;
+    } else {
+        cq = mmap(NULL, poll->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            poll->ringfd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED)
+            return -1;
+        poll->cqRing = cq;
+    }
+    poll->sqesSize = p->sq_entries * sizeof(struct io_uring_sqe);
+    poll->sqes = mmap(NULL, poll->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        poll->ringfd, IORING_OFF_SQES);
+    if (poll->sqes == MAP_FAILED) {
+        poll->sqes = NULL;
+        return -1;
+    }
+    poll->sqHead = (unsigned*)(sq + p->sq_off.head);
+    poll->sqTail = (unsigned*)(sq + p->sq_off.tail);
+    poll->sqMask = *(unsigned*)(sq + p->sq_off.ring_mask);
+    poll->sqArray = (unsigned*)(sq + p->sq_off.array);
+    poll->cqHead = (unsigned*)(cq + p->cq_off.head);
+    poll->cqTail = (unsigned*)(cq + p->cq_off.tail);
+    poll->cqMask = *(unsigned*)(cq + p->cq_off.ring_mask);
+    poll->cqes = (struct io_uring_cqe*)(cq + p->cq_off.cqes);
+    return 0;
+}
+
+static int registerBuffers(struct SelectUring* poll)
+{
+    struct io_uring_buf_reg reg;
+    unsigned i;
+
+    poll->bufRingSize = URING_BUFFERS * sizeof(struct io_uring_buf);
+    poll->bufRing = mmap(NULL, poll->bufRingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (poll->bufRing == MAP_FAILED) {
+        poll->bufRing = NULL;
+        return -1;
+    }
+    poll->buffers = malloc((size_t)URING_BUFFERS * poll->bufferSize);
+    if (poll->buffers == NULL)
+        return -1;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)poll->bufRing;
+    reg.ring_entries = URING_BUFFERS;
+    reg.bgid = URING_GROUP;
+    if (uringRegister(poll->ringfd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1)
+        return -1;
+    for (i = 0; i < URING_BUFFERS; i++)
+        giveBuffer(poll, i);
+    return 0;
+}
+
+/*
+bufferSize - size of each receive buffer, a recv completion has at most that much.
+Returns NULL if the kernel has no required io_uring features.
+*/
+struct SelectPoll* selectUringCreate(int maxEvents, unsigned bufferSize)
+{
+    struct SelectUring* poll;
+    struct io_uring_params p;
+
+    assert((maxEvents > 0) && (bufferSize > 0));
+    if (!kernelSupported())
+        return NULL;
+    poll = calloc(1, sizeof(*poll));
+    if (poll == NULL)
+        return NULL;
+    poll->base.ops = &ops;
+    poll->bufferSize = bufferSize;
+    poll->fdCount = selectPollLimit();
+    poll->fds = calloc(poll->fdCount, sizeof(struct UringFd));
+    memset(&p, 0, sizeof(p));
+    /* not SINGLE_ISSUER, the loop thread is not the one which creates the ring */
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+    p.cq_entries = URING_ENTRIES * 4;
+    poll->ringfd = (poll->fds != NULL) ? uringSetup(URING_ENTRIES, &p) : -1;
+    if ((poll->ringfd == -1) || !(p.features & IORING_FEAT_EXT_ARG)
+            || (mapRings(poll, &p) == -1) || (registerBuffers(poll) == -1)) {
+        debugPrintf("io_uring setup failed: %s", strerror(errno));
+        uringDestroy(&poll->base);
+        return NULL;
+    }
+    return &poll->base;
+}
+
+#endif /* URING */
@@ -2,135 +2,374 @@
    Example of a cross-platform non-blocking echo server.
    Supported platforms: Linux, Darwin. FreeBSD.
    To compile:
-   $ gcc -osrv -D[DEFINE] server.c selectunix.c socketunix.c error.c
+   $ gcc -osrv -D[DEFINE] server.c selectunix.c selectpoll.c selectfdset.c selectepoll.c selecturing.c pool.c queue.c socketunix.c timer.c topic.c trace.c error.c -lpthread
    Where [DEFINE] may be:
    -DLINUX
    -DDARWIN
    -DFREEBSD
+   Optionally with -DLINUX add -DEPOLL to use epoll(7) instead of select(2),
+   then the number of connections is limited only by RLIMIT_NOFILE.
+   Or add -DURING to use io_uring (Linux 6.0+), it falls back to epoll
+   when the kernel does not support it.
+   To run:
+   $ ./srv <port> [loops] [echo|lines|pubsub|broadcast|relay:<port>] [profile]
+   With loops > 1 every loop runs in own thread pinned to a core and has
+   own SO_REUSEPORT listen socket.
+   port may be a comma separated list of TCP ports and Unix socket paths
+   served by one loop, e.g. 5000,/tmp/srv.sock or 5000,@srv for a name
+   in the abstract namespace. A stale socket file is removed.
+   By default received data is broadcast to everyone, with echo it is
+   sent back only to its sender, with lines every complete line is sent
+   back as a separate message, with relay every connection is relayed
+   to the given port of 127.0.0.1. With pubsub lines are commands:
+   SUB <topic>, UNSUB <topic> and PUB <topic> <data>, which sends the
+   line "<topic> <data>" to every subscriber. See bench.c to load it.
+   profile tunes sockets, it is latency, throughput or a comma separated
+   list of name=value of nodelay, sndbuf, rcvbuf, defer, quickack,
+   busypoll, notsent and backlog, e.g. latency,busypoll=0,backlog=128,
+   also zerocopy=<bytes> to send that much at once with MSG_ZEROCOPY
+   and splice=0 to make relays copy data, duplex=<bytes> is the output
+   below which a connection is still read, duplex=0 reads it only when
+   its output is sent, workers=<n> answers echo and lines in n threads
+   off the loops.
+   throughput defers accept until data comes, so it delays broadcast
+   clients which never send, add defer=0 for them.
+   $ kill -USR1 <pid>
+   prints metrics of every loop to stderr.
+   If it crashes, recent events of every loop are in srv.trace,
+   see tracedump.c to read them.
    Author: 2dimka@gmail.com
 */
 
 #include <assert.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "debug.h"
+#include "queue.h"
 #include "socket.h"
 #include "select.h"
 
-static Socket** client = NULL;
-static int clientMax = 0;
 static int maxChunkSize = 512;
+static unsigned long idleTimeout = 5 * 60 * 1000; /* ms, silent clients are dropped */
+static unsigned long highWatermark = 1024 * 1024; /* slow readers pause the senders at this output */
+static unsigned long lowWatermark = 256 * 1024;
 
-static int findSlot(const Socket* sock);
-static void removeSlot(int slot);
+/* what the server does with data, the user pointer of the server */
+typedef struct _Mode {
+    int echo; /* send back to the sender only */
+    int lines; /* framed by '\n', messages are sent back */
+    int pubsub; /* framed by '\n', messages are commands of topics */
+    unsigned short relayPort; /* connections are relayed there */
+} Mode;
+
+#define PUBSUB_LINE 4096 /* the longest command with '\n' */
+
+static void onClientConnect(const Socket* sock, void* arg, const void* context);
+static void onClientConnectErr(void* arg, const void* context);
+static void onServerConnect(const Socket* sock, const void* context);
+static void onServerDisconnect(const Socket* sock, void* data, const void* context);
+static void onServerMessage(const Socket* sock, void* data, char* message, unsigned size, const void* context);
+static void onServerRecvErr(const Socket* sock, void* data, const void* context);
+static void onServerRecvOk(const Socket* sock, void* data, char* buffer, unsigned size, const void* context);
+static void onServerSentErr(const Socket* sock, void* data, const void* context);
+static void onServerSentOk(const Socket* sock, void* data, char* buffer, unsigned size, const void* context);
+static void onServerTimeout(const Socket* sock, void* data, int reason, const void* context);
+static void onWorkerRecv(const SelectHandle* handle, void* data, char* buffer, unsigned size);
+
+static const SelectHandlers handlers = {
+    onClientConnect,
+    onClientConnectErr,
+    onServerConnect,
+    onServerDisconnect,
+    onServerMessage,
+    onServerRecvErr,
+    onServerRecvOk,
+    onServerSentErr,
+    onServerSentOk,
+    onServerTimeout,
+    onWorkerRecv
+};
+
+static Socket* createListen(unsigned short port, int reusePort, const SocketProfile* profile);
+static Socket* createUnixListen(const char* path, const SocketProfile* profile);
+static void parseProfile(const char* spec, SelectOptions* options);
 static void terminate(const char* fmt, ...);
 
 int main(int argc, char* argv[])
 {
-    Socket* listen;
-    unsigned short port;
-    int rc;
+    Socket** listen;
+    SelectOptions options;
+    Mode mode = { 0, 0, 0, 0 };
+    char* item, *next;
+    int rc, loops = 1, count = 0, i;
 
-    if (argc != 2) terminate("Usage: %s <port>\n", argv[0]);
-    port = (unsigned short)atoi(argv[1]);
-    clientMax = selectMaxConnections();
-    debugPrintf("%d supported connections", clientMax);
-    client = calloc(clientMax, sizeof(const Socket*)); /* allocate and zero array */
-    if (client == NULL) terminate("Can't allocate memory!");
-    listen = socketConstruct();
+    if ((argc < 2) || (argc > 5)) terminate("Usage: %s <port> [loops] [echo|lines|pubsub|broadcast|relay:<port>] [profile]\n", argv[0]);
+    if (argc >= 3) loops = atoi(argv[2]);
+    if (argc >= 4) mode.echo = (strcmp(argv[3], "echo") == 0);
+    if (argc >= 4) mode.lines = (strcmp(argv[3], "lines") == 0);
+    if (argc >= 4) mode.pubsub = (strcmp(argv[3], "pubsub") == 0);
+    if ((argc >= 4) && (strncmp(argv[3], "relay:", 6) == 0)) mode.relayPort = (unsigned short)atoi(argv[3] + 6);
+    if (loops < 1) terminate("Number of loops must be positive!");
+    selectOptionsInit(&options);
+    if (argc == 5) parseProfile(argv[4], &options);
+    if ((options.workers > 0) && !mode.echo && !mode.lines) terminate("Workers serve echo and lines only!");
+    debugPrintf("%d supported connections", selectMaxConnections());
+    listen = calloc(loops + strlen(argv[1]), sizeof(Socket*)); /* more than items */
     if (listen == NULL) terminate("Can't allocate memory!");
-    rc = socketCreate(listen);
-    if (rc == -1) terminate("Can't create socket: %s!", socketError(listen));
-    rc = socketSetBlocking(0/*false*/, listen);
-    if (rc == -1) terminate("Can't set socket to non-blocking: %s!", socketError(listen));
-    rc = socketSetOptReuse(listen);
-    if (rc == -1) terminate("Can't set so_reuseaddr on socket: %s!", socketError(listen));
-    socketSetPort(port, listen);
-    rc = socketBind(listen);
-    if (rc == -1) terminate("Can't bind socket: %s!", socketError(listen));
-    rc = socketListen(listen);
-    if (rc == -1) terminate("Can't listen on socket: %s!", socketError(listen));
-    rc = selectServer(listen, maxChunkSize);
-    /* almost impossible to get here */
-    terminate("Something went wrong!"); 
-    return 0;
+    for (item = argv[1]; item != NULL; item = next) {
+        next = strchr(item, ',');
+        if (next != NULL) *next++ = '\0';
+        if ((loops > 1) && ((count > 0) || (next != NULL))) terminate("Only one port is served by several loops!");
+        if ((*item != '\0') && (strspn(item, "0123456789") == strlen(item))) {
+            for (i = 0; i < loops; i++) /* one listen socket per loop */
+                listen[count++] = createListen((unsigned short)atoi(item), loops > 1, &options.profile);
+        } else {
+            if (loops > 1) terminate("Unix sockets are served by one loop only!");
+            listen[count++] = createUnixListen(item, &options.profile);
+        }
+    }
+    options.handlers = &handlers;
+    options.user = &mode;
+    options.maxChunkSize = maxChunkSize;
+    options.idleTimeout = idleTimeout;
+    options.highWatermark = highWatermark;
+    options.lowWatermark = lowWatermark;
+    options.metricsSignal = SIGUSR1;
+    options.traceFile = "srv.trace";
+    if (mode.lines || mode.pubsub) {
+        options.framing = SELECT_FRAME_DELIMITER;
+        options.frameDelimiter = '\n';
+    }
+    if (mode.pubsub)
+        options.maxFrameSize = PUBSUB_LINE - 1;
+    if (loops == 1)
+        rc = selectServerListeners((const Socket**)listen, count, &options);
+    else
+        rc = selectServerThreads((const Socket**)listen, loops, &options, 1/*pinned*/);
+    if (rc == -1) /* almost impossible to get here */
+        terminate("Something went wrong!");
+    return EXIT_SUCCESS;
+}
+
+static void onClientConnect(const Socket* sock, void* arg, const void* context)
+{
+    debugPrintf("socket %p, arg= %p", sock, arg);
 }
 
-void onSelectServerConnect(const Socket* sock)
+static void onClientConnectErr(void* arg, const void* context)
 {
-    int slot;
+    debugPrintf("arg= %p", arg);
+}
+
+static void onServerConnect(const Socket* sock, const void* context)
+{
+    const Mode* mode = selectUser(context);
+
     debugPrintf("socket %p", sock);
-    slot = findSlot(NULL); /* find empty slot */
-    assert(slot >= 0);
-    client[slot] = (Socket*)sock; /* store client's new pointer */
+    if ((mode->relayPort != 0) && (selectRelay(sock, 0x7f000001/*127.0.0.1*/, mode->relayPort, 1000, context) == -1))
+        selectClose(sock, context);
 }
 
-void onSelectServerDisconnect(const Socket* sock)
+static void onServerDisconnect(const Socket* sock, void* data, const void* context)
 {
-    int slot;
     debugPrintf("socket %p", sock);
-    slot = findSlot(sock);
-    assert(slot >= 0);
-    if (slot >= 0)
-        removeSlot(slot);
 }
-void onSelectServerRecvErr(const Socket* sock)
+
+static void onServerRecvErr(const Socket* sock, void* data, const void* context)
 {
-    int slot;
     debugPrintf("socket %p", sock);
-    slot = findSlot(sock);
-    assert(slot >= 0);
-    if (slot >= 0)
-        removeSlot(slot);
 }
 
 /*
     received data may come in chunks!
 */
-void onSelectServerRecvOk(const Socket* sock, char* buffer, unsigned size, const void* context)
+static void onServerRecvOk(const Socket* sock, void* data, char* buffer, unsigned size, const void* context)
 {
-    int slot, i;
+    const Mode* mode = selectUser(context);
+
     debugPrintf("socket %p, buffer= %p, cb= %u", sock, buffer, size);
-    slot = findSlot(sock);
-    assert(slot >= 0);
-    if (slot == -1)
+    if (mode->echo)
+        selectSend(sock, buffer, size, context);
+    else /* send data to yourself and everyone who connected to any loop, one shared copy */
+        selectBroadcastAll(buffer, size, context);
+}
+
+/*
+    SUB, UNSUB or PUB line of pubsub
+*/
+static void command(const Socket* sock, const char* message, unsigned size, const void* context)
+{
+    char line[PUBSUB_LINE];
+    const char* topic;
+    unsigned length;
+
+    if ((size > 4) && (memcmp(message, "SUB ", 4) == 0)) {
+        selectSubscribe(sock, message + 4, size - 4, context);
+    } else if ((size > 6) && (memcmp(message, "UNSUB ", 6) == 0)) {
+        selectUnsubscribe(sock, message + 6, size - 6, context);
+    } else if ((size > 4) && (memcmp(message, "PUB ", 4) == 0)) {
+        topic = message + 4;
+        size -= 4;
+        length = 0;
+        while ((length < size) && (topic[length] != ' '))
+            length++;
+        memcpy(line, topic, size); /* the topic, the data and '\n' go in one send */
+        line[size] = '\n';
+        selectPublish(topic, length, line, size + 1, context);
+    } else {
+        debugPrintf("socket %p, unknown command", sock);
+    }
+}
+
+/*
+    one complete line without '\n', only with lines or pubsub
+*/
+static void onServerMessage(const Socket* sock, void* data, char* message, unsigned size, const void* context)
+{
+    const Mode* mode = selectUser(context);
+
+    debugPrintf("socket %p, message= %p, size= %u", sock, message, size);
+    if (mode->pubsub) {
+        command(sock, message, size, context);
         return;
-    /* send data to yourself and everyone who connected */
-    for (i = 0; i < clientMax; i++)
-        if (client[i] != NULL) selectSend(client[i], buffer, size, context);
+    }
+    if (size > 0)
+        selectSend(sock, message, size, context);
+    selectSend(sock, "\n", 1, context);
 }
 
-void onSelectServerSentErr(const Socket* sock)
+static void onServerSentErr(const Socket* sock, void* data, const void* context)
 {
-    int slot;
     debugPrintf("socket %p", sock);
-    slot = findSlot(sock);
-    assert(slot >= 0);
-    if (slot >= 0)
-        removeSlot(slot);
 }
 
 /*
    sent data may leave in parts!
 */
-void onSelectServerSentOk(const Socket* sock, char* buffer, unsigned size, const void* context)
+static void onServerSentOk(const Socket* sock, void* data, char* buffer, unsigned size, const void* context)
 {
     debugPrintf("socket %p, buffer= %p, size= %u, context= %p", sock, buffer, size, context);
 }
 
-static int findSlot(const Socket* sock)
+static void onServerTimeout(const Socket* sock, void* data, int reason, const void* context)
 {
-    int slot;
-    for (slot = 0; slot < clientMax; slot++)
-        if (client[slot] == sock) return slot;
-    return -1;
+    debugPrintf("socket %p, reason= %d", sock, reason);
 }
 
-static void removeSlot(int slot)
+/*
+    received data or one line, in a worker thread with workers=<n>
+*/
+static void onWorkerRecv(const SelectHandle* handle, void* data, char* buffer, unsigned size)
 {
-    client[slot] = NULL;
+    const Mode* mode = selectUser(handle->context);
+
+    if (size > 0)
+        selectPostSend(handle, buffer, size);
+    if (mode->lines)
+        selectPostSend(handle, "\n", 1);
+}
+
+/* presets first, then overrides, unknown names terminate */
+static void parseProfile(const char* spec, SelectOptions* options)
+{
+    SocketProfile* profile = &options->profile;
+    char copy[256], *item, *next;
+
+    if (strlen(spec) >= sizeof(copy)) terminate("Profile is too long!");
+    strcpy(copy, spec);
+    for (item = copy; item != NULL; item = next) {
+        char* value = strchr(item, '=');
+        int n;
+        next = strchr(item, ',');
+        if (next != NULL) *next++ = '\0';
+        if (strcmp(item, "latency") == 0) {
+            profile->noDelay = 1;
+            profile->quickAck = 1;
+            profile->busyPoll = 50;
+            profile->notSentLowat = 16 * 1024;
+            continue;
+        }
+        if (strcmp(item, "throughput") == 0) {
+            profile->noDelay = 0;
+            profile->sendBuffer = 4 * 1024 * 1024;
+            profile->recvBuffer = 4 * 1024 * 1024;
+            profile->deferAccept = 1;
+            profile->backlog = 4096;
+            continue;
+        }
+        if (value == NULL) terminate("Unknown profile %s!", item);
+        *value++ = '\0';
+        n = atoi(value);
+        if (strcmp(item, "nodelay") == 0) profile->noDelay = n;
+        else if (strcmp(item, "sndbuf") == 0) profile->sendBuffer = n;
+        else if (strcmp(item, "rcvbuf") == 0) profile->recvBuffer = n;
+        else if (strcmp(item, "defer") == 0) profile->deferAccept = n;
+        else if (strcmp(item, "quickack") == 0) profile->quickAck = n;
+        else if (strcmp(item, "busypoll") == 0) profile->busyPoll = n;
+        else if (strcmp(item, "notsent") == 0) profile->notSentLowat = n;
+        else if (strcmp(item, "backlog") == 0) profile->backlog = n;
+        else if (strcmp(item, "zerocopy") == 0) options->zeroCopyThreshold = n;
+        else if (strcmp(item, "splice") == 0) options->relaySplice = n;
+        else if (strcmp(item, "duplex") == 0) options->duplexOutput = n;
+        else if (strcmp(item, "workers") == 0) options->workers = n;
+        else terminate("Unknown profile option %s!", item);
+    }
+}
+
+static Socket* createListen(unsigned short port, int reusePort, const SocketProfile* profile)
+{
+    Socket* listen;
+    int rc;
+
+    listen = socketConstruct();
+    if (listen == NULL) terminate("Can't allocate memory!");
+    rc = socketCreate(listen);
+    if (rc == -1) terminate("Can't create socket: %s!", socketError(listen));
+    rc = socketSetBlocking(0/*false*/, listen);
+    if (rc == -1) terminate("Can't set socket to non-blocking: %s!", socketError(listen));
+    rc = socketSetOptReuse(listen);
+    if (rc == -1) terminate("Can't set so_reuseaddr on socket: %s!", socketError(listen));
+    if (reusePort) {
+        rc = socketSetOptReusePort(listen);
+        if (rc == -1) terminate("Can't set so_reuseport on socket: %s!", socketError(listen));
+    }
+    rc = socketSetProfile(profile, 1/*listening*/, listen);
+    if (rc == -1) terminate("Can't tune socket: %s!", socketError(listen));
+    socketSetPort(port, listen);
+    rc = socketBind(listen);
+    if (rc == -1) terminate("Can't bind socket: %s!", socketError(listen));
+    rc = socketListen(listen);
+    if (rc == -1) terminate("Can't listen on socket: %s!", socketError(listen));
+    return listen;
+}
+
+static Socket* createUnixListen(const char* path, const SocketProfile* profile)
+{
+    Socket* listen;
+    int rc;
+
+    listen = socketConstruct();
+    if (listen == NULL) terminate("Can't allocate memory!");
+    rc = socketSetPath(path, listen);
+    if (rc == -1) terminate("Can't use path %s: %s!", path, socketError(listen));
+    if (path[0] != '@') /* left by the previous run */
+        unlink(path);
+    rc = socketCreate(listen);
+    if (rc == -1) terminate("Can't create socket: %s!", socketError(listen));
+    rc = socketSetBlocking(0/*false*/, listen);
+    if (rc == -1) terminate("Can't set socket to non-blocking: %s!", socketError(listen));
+    rc = socketSetProfile(profile, 1/*listening*/, listen);
+    if (rc == -1) terminate("Can't tune socket: %s!", socketError(listen));
+    rc = socketBind(listen);
+    if (rc == -1) terminate("Can't bind socket: %s!", socketError(listen));
+    rc = socketListen(listen);
+    if (rc == -1) terminate("Can't listen on socket: %s!", socketError(listen));
+    return listen;
 }
 
 static void terminate(const char* fmt, ...)
@@ -1,12 +1,27 @@
 #ifndef _SOCKET_H
 #define _SOCKET_H
 
+struct iovec;
 struct _Socket;
 typedef struct _Socket Socket;
 
+/* options of socketSetProfile(), -1 keeps the system default */
+typedef struct _SocketProfile {
+    int noDelay; /* TCP_NODELAY, 0 or 1 */
+    int sendBuffer; /* SO_SNDBUF, bytes */
+    int recvBuffer; /* SO_RCVBUF, bytes */
+    int deferAccept; /* TCP_DEFER_ACCEPT, seconds to wait for data, listen sockets only */
+    int quickAck; /* TCP_QUICKACK, 0 or 1, the kernel may turn it off later */
+    int busyPoll; /* SO_BUSY_POLL, us */
+    int notSentLowat; /* TCP_NOTSENT_LOWAT, bytes */
+    int backlog; /* of socketListen, listen sockets only */
+} SocketProfile;
+
 int socketAccept(const Socket* sock, Socket* conn);
+int socketAcceptMany(const Socket* sock, Socket** conn, int count);
 int socketBind(Socket* sock);
 int socketConnect(const Socket* sock);
+int socketConnected(const Socket* sock);
 int socketConnectTo(const char* host, Socket* sock);
 int socketClose(Socket* sock);
 Socket* socketConstruct(void);
@@ -14,13 +29,25 @@ int socketCreate(Socket* sock);
 void socketDestroy(Socket* sock);
 const char* socketError(const Socket* sock);
 int socketListen(const Socket* sock);
+void socketProfileInit(SocketProfile* profile);
 int socketRecv(const Socket* sock, void* buffer, unsigned bytes, int flags);
 int socketSend(const Socket* sock, const void* buffer, unsigned bytes, int flags);
+int socketSendv(const Socket* sock, const struct iovec* iov, int count, int flags);
+int socketSendvZeroCopy(const Socket* sock, const struct iovec* iov, int count);
 void socketSetAddress(unsigned int ip4, unsigned short port, Socket* sock);
 int socketSetBlocking(int block, Socket* sock);
+void socketSetDescriptor(int sd, Socket* sock);
 void socketSetIp(unsigned int ip4, Socket* sock);
 int socketSetOptReuse(Socket* sock);
+int socketSetOptReusePort(Socket* sock);
+int socketSetOptZeroCopy(Socket* sock);
+int socketSetPath(const char* path, Socket* sock);
 void socketSetPort(unsigned short port, Socket* sock);
+int socketSetProfile(const SocketProfile* profile, int listening, Socket* sock);
+int socketShutdownSend(const Socket* sock);
+int socketSpliceFrom(const Socket* sock, int pipe, unsigned bytes);
+int socketSpliceTo(const Socket* sock, int pipe, unsigned bytes);
+int socketZeroCopyDone(const Socket* sock, unsigned* first, unsigned* last, int* copied);
 
 #endif /*_SOCKET_H */
 
@@ -1,15 +1,28 @@
+#if defined(LINUX)
+#define _GNU_SOURCE /* accept4, splice */
+#endif
+
 #include <assert.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 #include <errno.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <strings.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <pthread.h>
+#if defined(LINUX)
+#include <linux/errqueue.h>
+#endif
 
 #include "debug.h"
 #include "error.h"
@@ -19,48 +32,166 @@
 #error "You must compile with -DLINUX or -DDARWIN or -DFREEBSD"
 #endif
 
+#define SOCKET_CACHE 256 /* free sockets kept by one thread, the rest go back to the heap */
+
+/* what has failed, the message is formatted only by socketError() */
+enum {
+    ERROR_NONE,
+    ERROR_ACCEPT,
+    ERROR_ADDRINFO,
+    ERROR_BIND,
+    ERROR_BLOCKING,
+    ERROR_CLOSE,
+    ERROR_CONNECT,
+    ERROR_CREATE,
+    ERROR_GETFL,
+    ERROR_LISTEN,
+    ERROR_NONBLOCKING,
+    ERROR_PATH,
+    ERROR_REUSEADDR,
+    ERROR_REUSEPORT,
+    ERROR_SHUTDOWN,
+    ERROR_SOCKOPT
+};
+
+static const char* errorFormat[] = {
+    "",
+    "Failed to accept new socket on listen socket %d.",
+    "Failed to get address info: %s.",
+    "Failed to bind socket %d.",
+    "Failed to set blocking mode for socket %d.",
+    "Failed to close socket %d.",
+    "Failed to connect socket %d.",
+    "Failed to create socket.",
+    "Failed to get flags for socket %d.",
+    "Failed to listen on socket %d.",
+    "Failed to set non-blocking mode for socket %d.",
+    "Failed to set Unix path for socket %d.",
+    "Failed to set SO_REUSEADDR option for socket %d.",
+    "Failed to set SO_REUSEPORT option for socket %d.",
+    "Failed to shutdown socket %d.",
+    "Failed to set SocketProfile option for socket %d."
+};
+
+/* TCP or Unix address, sa_family tells which */
+union SocketAddress {
+    struct sockaddr any;
+    struct sockaddr_in in;
+    struct sockaddr_un un;
+};
+
 struct _Socket {
     int sd; /* socket descriptor, must be first */
-    char* error;
-    struct sockaddr_in addr;
+    int errorSite; /* ERROR_XXX of the last failure */
+    int error; /* errno or getaddrinfo() code of the last failure */
+    int errorSd; /* sd at the moment of the last failure */
+    union SocketAddress addr;
+    socklen_t addrSize; /* bytes of addr used, abstract Unix names are not terminated */
+    int backlog; /* of socketListen, -1 for the system maximum */
+    struct _Socket* nextFree; /* link while the socket is in the cache of a thread */
 };
 
+/*
+Every thread, so every loop, keeps its own free sockets without a lock.
+A socket may be destroyed by another thread than the one which has
+constructed it, then it simply moves to the cache of that thread.
+*/
+static __thread Socket* cacheFree = NULL;
+static __thread int cacheCount = 0;
+static pthread_key_t cacheKey; /* only to empty the cache when the thread exits */
+static pthread_once_t cacheOnce = PTHREAD_ONCE_INIT;
+
 static void invalidate(Socket* sock)
 {
     sock->sd = -1;
-    sock->error = NULL;
+    sock->errorSite = ERROR_NONE;
+    sock->error = 0;
+    sock->backlog = -1;
     bzero(&sock->addr, sizeof(sock->addr));
+    sock->addrSize = sizeof(sock->addr.in);
+}
+
+/* error is stored in the socket even if it is passed as const */
+static void fail(const Socket* sock, int site, int error)
+{
+    Socket* s = (Socket*)sock;
+
+    s->errorSite = site;
+    s->error = error;
+    s->errorSd = sock->sd;
 }
 
 int socketAccept(const Socket* sock, Socket* conn)
 {
-    struct sockaddr_in addr;
+    union SocketAddress addr;
     socklen_t size;
 
     assert(sock->sd != -1);
     invalidate(conn);
     size = sizeof(addr);
-    conn->sd = accept(sock->sd, (struct sockaddr*)&addr, &size);
+    conn->sd = accept(sock->sd, &addr.any, &size);
     if (conn->sd == -1) {
         /* if the socket is marked nonblocking and no pending connections
            are present on the queue, accept() fails with the error EAGAIN or EWOULDBLOCK. */
         if ((errno == EWOULDBLOCK) || (errno == EAGAIN))
             return 1;
-        errorString(errno, sock->error, "Failed to accept new socket on listen socket %d.", sock->sd);
+        fail(sock, ERROR_ACCEPT, errno);
         return -1;
     }
     conn->addr = addr;
+    conn->addrSize = size;
     return 0;
 }
 
+/*
+Accepts up to count pending connections into conn[0..count).
+Accepted sockets are already non-blocking and close-on-exec.
+Returns number of accepted sockets, 0 if none is pending, -1 on error.
+*/
+int socketAcceptMany(const Socket* sock, Socket** conn, int count)
+{
+    union SocketAddress addr;
+    socklen_t size;
+    int n, sd;
+
+    assert(sock->sd != -1);
+    for (n = 0; n < count; ) {
+        size = sizeof(addr);
+#if defined(LINUX) || defined(FREEBSD)
+        sd = accept4(sock->sd, &addr.any, &size, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+        sd = accept(sock->sd, &addr.any, &size);
+        if (sd != -1) {
+            fcntl(sd, F_SETFL, fcntl(sd, F_GETFL) | O_NONBLOCK);
+            fcntl(sd, F_SETFD, FD_CLOEXEC);
+        }
+#endif
+        if (sd == -1) {
+            if ((errno == EWOULDBLOCK) || (errno == EAGAIN))
+                break; /* queue is empty */
+            if ((errno == ECONNABORTED) || (errno == EINTR))
+                continue; /* try the next pending connection */
+            if (n > 0)
+                break; /* report accepted ones, error will be seen next time */
+            fail(sock, ERROR_ACCEPT, errno);
+            return -1;
+        }
+        conn[n]->sd = sd;
+        conn[n]->addr = addr;
+        conn[n]->addrSize = size;
+        n++;
+    }
+    return n;
+}
+
 int socketBind(Socket* sock)
 {
     int rc; /* rc - return code */
 
     assert(sock->sd != -1);
-    rc = bind(sock->sd, (const struct sockaddr*)&sock->addr, sizeof(sock->addr));
+    rc = bind(sock->sd, &sock->addr.any, sock->addrSize);
     if (rc == -1) {
-        errorString(errno, sock->error, "Failed to bind socket %d.", sock->sd);
+        fail(sock, ERROR_BIND, errno);
         return -1;
     }
     return 0;
@@ -79,12 +210,12 @@ int socketClose(Socket* sock)
     if (rc == -1) {
         /* kern/146845: [libc] close(2) returns error 54 (connection reset by peer) wrongly */
         if (errno != ENOTCONN) { /* do not return error here */
-            errorString(errno, sock->error, "Failed to shutdown socket %d.", sock->sd);
+            fail(sock, ERROR_SHUTDOWN, errno);
         }
     }
     rc = close(sock->sd);
     if (rc == -1) {
-        errorString(errno, sock->error, "Failed to close socket %d.", sock->sd);
+        fail(sock, ERROR_CLOSE, errno);
         return -1;
     }
 #elif defined(FREEBSD)
@@ -92,13 +223,13 @@ int socketClose(Socket* sock)
     if (rc == -1) {
         /* kern/146845: [libc] close(2) returns error 54 (connection reset by peer) wrongly */
         if ((errno != ENOTCONN) && (errno != ECONNRESET)) { /* do not return error here */
-            errorString(errno, sock->error, "Failed to shutdown socket %d.", sock->sd);
+            fail(sock, ERROR_SHUTDOWN, errno);
         }
     }
     rc = close(sock->sd);
     if (rc == -1) {
         if (errno != ECONNRESET) {
-            errorString(errno, sock->error, "Failed to close socket %d.", sock->sd);
+            fail(sock, ERROR_CLOSE, errno);
             return -1;
         }
     }
@@ -111,11 +242,31 @@ int socketConnect(const Socket* sock)
     int rc;
 
     assert(sock != NULL);
-    rc = connect(sock->sd, (const struct sockaddr*)&sock->addr, sizeof(sock->addr));
+    rc = connect(sock->sd, &sock->addr.any, sock->addrSize);
     if (rc == -1) {
         if ((errno == EINPROGRESS) || (errno == EAGAIN)) /* man connect about EINPROGRESS */
             return 1;
-        errorString(errno, sock->error, "Failed to connect socket %d.", sock->sd);
+        fail(sock, ERROR_CONNECT, errno);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+Completes socketConnect which returned 1, after the socket became writable.
+Returns 0 if connected, -1 with errno set if the connect has failed.
+*/
+int socketConnected(const Socket* sock)
+{
+    int error = 0;
+    socklen_t size = sizeof(error);
+
+    assert(sock != NULL);
+    if (getsockopt(sock->sd, SOL_SOCKET, SO_ERROR, &error, &size) == -1)
+        error = errno;
+    if (error != 0) {
+        fail(sock, ERROR_CONNECT, error);
+        errno = error;
         return -1;
     }
     return 0;
@@ -130,15 +281,16 @@ int socketConnectTo(const char* host, Socket* sock)
     bzero(&hints, sizeof(hints));
     hints.ai_family = AF_INET;
     hints.ai_socktype = SOCK_STREAM;
+    assert(sock->addr.any.sa_family == AF_INET);
     err = getaddrinfo(host, NULL, &hints, &ainfo);
     if (err != 0) {
-        errorString(err, sock->error, "Failed to get address info for host %s.", host);
+        fail(sock, ERROR_ADDRINFO, err);
         return -1;
     }
     for (p = ainfo; p != NULL; p = p->ai_next) {
         struct sockaddr_in* in = (struct sockaddr_in*)p->ai_addr;
-        sock->addr.sin_addr = in->sin_addr;
-        debugPrintf("%s : %u", inet_ntoa(sock->addr.sin_addr), ntohs(sock->addr.sin_port));
+        sock->addr.in.sin_addr = in->sin_addr;
+        debugPrintf("%s : %u", inet_ntoa(sock->addr.in.sin_addr), ntohs(sock->addr.in.sin_port));
         rc = socketConnect(sock);
         if (rc >= 0) {
             freeaddrinfo(ainfo);
@@ -149,46 +301,96 @@ int socketConnectTo(const char* host, Socket* sock)
     return -1;
 }
 
+static void freeCache(void* arg)
+{
+    Socket* sock;
+
+    (void)arg;
+    while (cacheFree != NULL) {
+        sock = cacheFree;
+        cacheFree = sock->nextFree;
+        free(sock);
+    }
+    cacheCount = 0;
+}
+
+static void createCacheKey(void)
+{
+    if (pthread_key_create(&cacheKey, freeCache) != 0) /* the cache of an exiting thread is lost */
+        perror("pthread_key_create");
+}
+
+/* takes a socket from the cache of the thread, from the heap if it is empty */
 Socket* socketConstruct(void)
 {
-    Socket* sock = malloc(sizeof(*sock) + BUFSIZ);
-    assert(sock != NULL);
+    Socket* sock;
+
+    if (cacheFree != NULL) {
+        sock = cacheFree;
+        cacheFree = sock->nextFree;
+        cacheCount--;
+    } else {
+        sock = malloc(sizeof(*sock));
+        if (sock == NULL)
+            return NULL;
+    }
     invalidate(sock);
-    sock->sd = -1;
-    sock->error = (char*)(sock + 1);
-    sock->addr.sin_family = AF_INET;
-    sock->addr.sin_addr.s_addr = htonl(INADDR_ANY);
-    sock->addr.sin_port = 0;
+    sock->addr.in.sin_family = AF_INET;
+    sock->addr.in.sin_addr.s_addr = htonl(INADDR_ANY);
+    sock->addr.in.sin_port = 0;
     return sock;
 }
 
+/* of the address set, AF_INET unless socketSetPath() was called */
 int socketCreate(Socket* sock)
 {
     assert(sock != NULL);
-    sock->sd = socket(AF_INET, SOCK_STREAM, 0);
+    sock->sd = socket(sock->addr.any.sa_family, SOCK_STREAM, 0);
     if (sock->sd == -1) {
-        errorString(errno, sock->error, "Failed to create socket.");
+        fail(sock, ERROR_CREATE, errno);
         return -1;
     }
     return 0;
 }
 
+/* returns the socket to the cache of the thread, to the heap if it is full */
 void socketDestroy(Socket* sock)
 {
     assert(sock != NULL);
-    free(sock);
+    if (cacheCount >= SOCKET_CACHE) {
+        free(sock);
+        return;
+    }
+    if (cacheFree == NULL) { /* the first one, or the thread has taken all back */
+        pthread_once(&cacheOnce, createCacheKey);
+        pthread_setspecific(cacheKey, &cacheFree);
+    }
+    sock->nextFree = cacheFree;
+    cacheFree = sock;
+    cacheCount++;
 }
 
+/*
+Formats the last failure. The returned string is valid
+until the next socketError() call in the same thread.
+*/
 const char* socketError(const Socket* sock)
 {
-    return sock->error;
+    static __thread char buf[BUFSIZ];
+
+    assert(sock != NULL);
+    if (sock->errorSite == ERROR_NONE)
+        return "";
+    if (sock->errorSite == ERROR_ADDRINFO)
+        return errorString(0, buf, sizeof(buf), errorFormat[ERROR_ADDRINFO], gai_strerror(sock->error));
+    return errorString(sock->error, buf, sizeof(buf), errorFormat[sock->errorSite], sock->errorSd);
 }
 
 int socketListen(const Socket* sock)
 {
-    int rc = listen(sock->sd, -1);
+    int rc = listen(sock->sd, sock->backlog);
     if (rc == -1) {
-        errorString(errno, sock->error, "Failed to listen on socket %d.", sock->sd);
+        fail(sock, ERROR_LISTEN, errno);
         return -1;
     }
     return 0;
@@ -207,12 +409,43 @@ int socketSend(const Socket* sock, const void* buffer, unsigned bytes, int flags
     return send(sock->sd, buffer, bytes, flags);
 }
 
+/* gather send, like writev() but without SIGPIPE */
+int socketSendv(const Socket* sock, const struct iovec* iov, int count, int flags)
+{
+    struct msghdr msg;
+
+    bzero(&msg, sizeof(msg));
+    msg.msg_iov = (struct iovec*)iov;
+    msg.msg_iovlen = count;
+#if defined(LINUX) || defined(FREEBSD)
+    flags |= MSG_NOSIGNAL;
+#endif
+    return sendmsg(sock->sd, &msg, flags);
+}
+
+/*
+Like socketSendv, but the kernel may send from the buffers instead of a copy,
+so they must stay unchanged until socketZeroCopyDone() reports the call.
+Only calls which send something count. Needs socketSetOptZeroCopy().
+*/
+int socketSendvZeroCopy(const Socket* sock, const struct iovec* iov, int count)
+{
+#if defined(MSG_ZEROCOPY)
+    return socketSendv(sock, iov, count, MSG_ZEROCOPY);
+#else
+    (void)sock; (void)iov; (void)count;
+    errno = EOPNOTSUPP;
+    return -1;
+#endif
+}
+
 void socketSetAddress(unsigned int ip4, unsigned short port, Socket* sock)
 {
     bzero(&sock->addr, sizeof(sock->addr));
-    sock->addr.sin_family = AF_INET;
-    sock->addr.sin_addr.s_addr = htonl(ip4);
-    sock->addr.sin_port = htons(port);
+    sock->addr.in.sin_family = AF_INET;
+    sock->addr.in.sin_addr.s_addr = htonl(ip4);
+    sock->addr.in.sin_port = htons(port);
+    sock->addrSize = sizeof(sock->addr.in);
 }
 
 int socketSetBlocking(int block, Socket* sock)
@@ -222,7 +455,7 @@ int socketSetBlocking(int block, Socket* sock)
     assert(sock != NULL);
     flags = fcntl(sock->sd, F_GETFL);
     if (flags == -1) {
-        errorString(errno, sock->error, "Failed to get flags for socket %d.", sock->sd);
+        fail(sock, ERROR_GETFL, errno);
         return -1;
     }
     if (block)
@@ -232,19 +465,65 @@ int socketSetBlocking(int block, Socket* sock)
     rc = fcntl(sock->sd, F_SETFL, flags);
     if (rc == -1) {
         if (block)
-            errorString(errno, sock->error, "Failed to set blocking mode for socket %d.", sock->sd);
+            fail(sock, ERROR_BLOCKING, errno);
         else
-            errorString(errno, sock->error, "Failed to set non-blocking mode for socket %d.", sock->sd);
+            fail(sock, ERROR_NONBLOCKING, errno);
         return -1;
     }
-    flags = fcntl(sock->sd, F_GETFL);
     return 0;
 }
 
+/* takes a descriptor accepted elsewhere, the peer address is looked up */
+void socketSetDescriptor(int sd, Socket* sock)
+{
+    socklen_t size = sizeof(sock->addr);
+
+    assert(sock != NULL);
+    sock->sd = sd;
+    if (getpeername(sd, &sock->addr.any, &size) == -1) {
+        bzero(&sock->addr, sizeof(sock->addr));
+        size = sizeof(sock->addr.in);
+    }
+    sock->addrSize = size;
+}
+
 void socketSetIp(unsigned int ip4, Socket* sock)
 {
     assert(sock != NULL);
-    sock->addr.sin_addr.s_addr = htonl(ip4);
+    sock->addr.in.sin_addr.s_addr = htonl(ip4);
+}
+
+/*
+Makes the socket an AF_UNIX one, call it before socketCreate().
+A path starting with '@' is a name in the abstract namespace (Linux only),
+no file is created for it. A file left by a previous bind must be removed
+by the caller. Returns -1 if the path is too long or not supported.
+*/
+int socketSetPath(const char* path, Socket* sock)
+{
+    size_t length;
+
+    assert((path != NULL) && (sock != NULL));
+    length = strlen(path);
+    if (length >= sizeof(sock->addr.un.sun_path)) {
+        fail(sock, ERROR_PATH, ENAMETOOLONG);
+        return -1;
+    }
+#if !defined(LINUX)
+    if (path[0] == '@') {
+        fail(sock, ERROR_PATH, EAFNOSUPPORT);
+        return -1;
+    }
+#endif
+    bzero(&sock->addr, sizeof(sock->addr));
+    sock->addr.un.sun_family = AF_UNIX;
+    memcpy(sock->addr.un.sun_path, path, length);
+    if (path[0] == '@') /* abstract names start with '\0' and take exactly length bytes */
+        sock->addr.un.sun_path[0] = '\0';
+    else
+        length++;
+    sock->addrSize = (socklen_t)(offsetof(struct sockaddr_un, sun_path) + length);
+    return 0;
 }
 
 int socketSetOptReuse(Socket* sock)
@@ -253,14 +532,209 @@ int socketSetOptReuse(Socket* sock)
     assert(sock != NULL);
     rc = setsockopt(sock->sd, SOL_SOCKET, SO_REUSEADDR, &value, sizeof(int));
     if (rc == -1) {
-        errorString(errno, sock->error, "Failed to set SO_REUSEADDR option for socket %d.", sock->sd);
+        fail(sock, ERROR_REUSEADDR, errno);
+        return -1;
+    }
+    return 0;
+}
+
+/* lets several sockets listen on the same port, the kernel balances connections */
+int socketSetOptReusePort(Socket* sock)
+{
+    int rc, value = 1;
+    assert(sock != NULL);
+#if defined(SO_REUSEPORT_LB) /* FreeBSD 12+, SO_REUSEPORT does not balance there */
+    rc = setsockopt(sock->sd, SOL_SOCKET, SO_REUSEPORT_LB, &value, sizeof(int));
+#elif defined(SO_REUSEPORT)
+    rc = setsockopt(sock->sd, SOL_SOCKET, SO_REUSEPORT, &value, sizeof(int));
+#else
+    rc = -1;
+    errno = ENOPROTOOPT;
+#endif
+    if (rc == -1) {
+        fail(sock, ERROR_REUSEPORT, errno);
         return -1;
     }
     return 0;
 }
 
+/* lets socketSendvZeroCopy() avoid the copy, Linux 4.14+ */
+int socketSetOptZeroCopy(Socket* sock)
+{
+    int rc, value = 1;
+    assert(sock != NULL);
+#if defined(SO_ZEROCOPY)
+    rc = setsockopt(sock->sd, SOL_SOCKET, SO_ZEROCOPY, &value, sizeof(int));
+#else
+    (void)value;
+    rc = -1;
+    errno = ENOPROTOOPT;
+#endif
+    if (rc == -1) {
+        fail(sock, ERROR_SOCKOPT, errno);
+        return -1;
+    }
+    return 0;
+}
+
+/* -1 keeps the system default */
+void socketProfileInit(SocketProfile* profile)
+{
+    assert(profile != NULL);
+    profile->noDelay = -1;
+    profile->sendBuffer = -1;
+    profile->recvBuffer = -1;
+    profile->deferAccept = -1;
+    profile->quickAck = -1;
+    profile->busyPoll = -1;
+    profile->notSentLowat = -1;
+    profile->backlog = -1;
+}
+
+static int setOption(Socket* sock, int level, int name, int value)
+{
+    if (value < 0) /* not set */
+        return 0;
+    if ((level == IPPROTO_TCP) && (sock->addr.any.sa_family == AF_UNIX)) /* nothing to tune */
+        return 0;
+    if (name == -1) { /* not supported here */
+        fail(sock, ERROR_SOCKOPT, ENOPROTOOPT);
+        return -1;
+    }
+    if (setsockopt(sock->sd, level, name, &value, sizeof(value)) == -1) {
+        fail(sock, ERROR_SOCKOPT, errno);
+        return -1;
+    }
+    return 0;
+}
+
+#if !defined(TCP_DEFER_ACCEPT)
+#define TCP_DEFER_ACCEPT -1
+#endif
+#if !defined(TCP_QUICKACK)
+#define TCP_QUICKACK -1
+#endif
+#if !defined(SO_BUSY_POLL)
+#define SO_BUSY_POLL -1
+#endif
+#if !defined(TCP_NOTSENT_LOWAT)
+#define TCP_NOTSENT_LOWAT -1
+#endif
+
+/* sets the option, error keeps the first failure of several */
+static void tryOption(Socket* sock, int level, int name, int value, int* error)
+{
+    if ((setOption(sock, level, name, value) == -1) && (*error == 0))
+        *error = sock->error;
+}
+
+/*
+Applies options of the profile which are set. A listen socket gets the
+backlog for socketListen and defer accept, a connection gets the rest.
+Every option is tried, one refused by the kernel does not keep the rest
+off. Returns -1 if any has failed, socketError() tells the first one.
+*/
+int socketSetProfile(const SocketProfile* profile, int listening, Socket* sock)
+{
+    int error = 0;
+
+    assert((profile != NULL) && (sock != NULL));
+    if (listening) {
+        if (profile->backlog >= 0)
+            sock->backlog = profile->backlog;
+        return setOption(sock, IPPROTO_TCP, TCP_DEFER_ACCEPT, profile->deferAccept);
+    }
+    tryOption(sock, IPPROTO_TCP, TCP_NODELAY, profile->noDelay, &error);
+    tryOption(sock, SOL_SOCKET, SO_SNDBUF, profile->sendBuffer, &error);
+    tryOption(sock, SOL_SOCKET, SO_RCVBUF, profile->recvBuffer, &error);
+    tryOption(sock, IPPROTO_TCP, TCP_QUICKACK, profile->quickAck, &error);
+    tryOption(sock, SOL_SOCKET, SO_BUSY_POLL, profile->busyPoll, &error);
+    tryOption(sock, IPPROTO_TCP, TCP_NOTSENT_LOWAT, profile->notSentLowat, &error);
+    if (error == 0)
+        return 0;
+    fail(sock, ERROR_SOCKOPT, error); /* the first one, later ones have overwritten it */
+    errno = error;
+    return -1;
+}
+
 void socketSetPort(unsigned short port, Socket* sock)
 {
     assert(sock != NULL);
-    sock->addr.sin_port = htons(port);
+    sock->addr.in.sin_port = htons(port);
+}
+
+/* the peer reads EOF, receiving goes on */
+int socketShutdownSend(const Socket* sock)
+{
+    assert(sock != NULL);
+    if (shutdown(sock->sd, SHUT_WR) == -1) {
+        fail(sock, ERROR_SHUTDOWN, errno);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+Moves up to bytes of received data into the write end of a pipe without
+copying them to user space. Returns like socketRecv, -1 with EAGAIN also
+if the pipe is full. There is no MSG_NOSIGNAL for splice(2), so
+socketSpliceTo() raises SIGPIPE if the peer has gone.
+*/
+int socketSpliceFrom(const Socket* sock, int pipe, unsigned bytes)
+{
+#if defined(LINUX)
+    return splice(sock->sd, NULL, pipe, NULL, bytes, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+#else
+    (void)sock; (void)pipe; (void)bytes;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/* sends up to bytes from the read end of a pipe, returns like socketSend */
+int socketSpliceTo(const Socket* sock, int pipe, unsigned bytes)
+{
+#if defined(LINUX)
+    return splice(pipe, NULL, sock->sd, NULL, bytes, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+#else
+    (void)sock; (void)pipe; (void)bytes;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/*
+Reads one notification of socketSendvZeroCopy() from the error queue:
+calls first..last, counted from 0 on every socket, do not use their buffers
+any more, copied is not 0 if the kernel has copied them anyway.
+Returns 1 if one is read, 0 if none is pending, -1 on error.
+*/
+int socketZeroCopyDone(const Socket* sock, unsigned* first, unsigned* last, int* copied)
+{
+#if defined(LINUX) && defined(SO_EE_ORIGIN_ZEROCOPY)
+    char control[128];
+    struct msghdr msg;
+    struct cmsghdr* cmsg;
+
+    assert(sock != NULL);
+    for ( ; ; ) {
+        bzero(&msg, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(sock->sd, &msg, MSG_ERRQUEUE) == -1)
+            return ((errno == EAGAIN) || (errno == EWOULDBLOCK)) ? 0 : -1;
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            const struct sock_extended_err* err = (const struct sock_extended_err*)CMSG_DATA(cmsg);
+            if ((err->ee_errno != 0) || (err->ee_origin != SO_EE_ORIGIN_ZEROCOPY))
+                continue; /* other errors are reported by send and recv */
+            *first = err->ee_info;
+            *last = err->ee_data;
+            *copied = (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) != 0;
+            return 1;
+        }
+    }
+#else
+    (void)sock; (void)first; (void)last; (void)copied;
+    return 0;
+#endif
 }
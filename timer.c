@@ -0,0 +1,209 @@
+#include <assert.h>
+#include <limits.h>
+#include <stddef.h>
+#include <time.h>
+
+#include "timer.h"
+
+/*
+   Level 0 holds timers expiring in the next 64 ticks, one slot per tick.
+   Level L holds timers expiring in the next 64^(L+1) ticks, one slot per
+   64^L ticks, they are moved to lower levels when the time comes.
+   Insert and stop are O(1), the next expiry is found with a bit scan
+   per level, so the number of timers does not matter.
+*/
+
+#define SHIFT 6 /* log2(TIMER_SLOTS) */
+#define MASK (TIMER_SLOTS - 1)
+#define SPAN(level) (1ULL << (SHIFT * ((level) + 1))) /* ticks covered by level */
+
+static int lowestBit(unsigned long long bits)
+{
+    return __builtin_ctzll(bits);
+}
+
+/* bits rotated right, so bit shift becomes bit 0 */
+static unsigned long long rotate(unsigned long long bits, unsigned shift)
+{
+    shift &= MASK;
+    return (shift == 0) ? bits : (bits >> shift) | (bits << (TIMER_SLOTS - shift));
+}
+
+static void insert(TimerWheel* wheel, Timer* timer)
+{
+    unsigned long long delta;
+    int level;
+    Timer** head;
+
+    if (timer->expires < wheel->now) /* late, fire on the next tick */
+        timer->expires = wheel->now;
+    delta = timer->expires - wheel->now;
+    if (delta >= SPAN(TIMER_LEVELS - 1)) { /* too far, wait as long as possible and retry */
+        delta = SPAN(TIMER_LEVELS - 1) - 1;
+    }
+    for (level = 0; delta >= SPAN(level); level++)
+        ;
+    timer->level = (unsigned char)level;
+    timer->slot = (unsigned char)(((wheel->now + delta) >> (SHIFT * level)) & MASK);
+    head = &wheel->slot[level][timer->slot];
+    timer->next = *head;
+    timer->prev = head;
+    if (*head != NULL)
+        (*head)->prev = &timer->next;
+    *head = timer;
+    wheel->occupied[level] |= 1ULL << timer->slot;
+}
+
+static void detach(TimerWheel* wheel, Timer* timer)
+{
+    *timer->prev = timer->next;
+    if (timer->next != NULL)
+        timer->next->prev = timer->prev;
+    if (wheel->slot[timer->level][timer->slot] == NULL)
+        wheel->occupied[timer->level] &= ~(1ULL << timer->slot);
+    timer->next = NULL;
+    timer->prev = NULL;
+}
+
+/* moves timers of one slot to lower levels, returns the slot index */
+static unsigned cascade(TimerWheel* wheel, int level, unsigned long long tick)
+{
+    unsigned slot = (unsigned)((tick >> (SHIFT * level)) & MASK);
+    Timer* timer = wheel->slot[level][slot];
+
+    wheel->slot[level][slot] = NULL;
+    wheel->occupied[level] &= ~(1ULL << slot);
+    while (timer != NULL) {
+        Timer* next = timer->next;
+        insert(wheel, timer);
+        timer = next;
+    }
+    return slot;
+}
+
+/* the first tick with something to do, ULLONG_MAX if the wheel is empty */
+static unsigned long long nextTick(const TimerWheel* wheel)
+{
+    unsigned long long best = ULLONG_MAX;
+    int level;
+
+    if (wheel->count == 0)
+        return best;
+    if (wheel->occupied[0] != 0)
+        best = wheel->now + lowestBit(rotate(wheel->occupied[0], (unsigned)wheel->now));
+    for (level = 1; level < TIMER_LEVELS; level++) {
+        unsigned shift = SHIFT * level;
+        unsigned long long first, tick;
+        if (wheel->occupied[level] == 0)
+            continue;
+        /* slots are cascaded at multiples of 64^level, the first one is not behind now */
+        first = (wheel->now + (1ULL << shift) - 1) >> shift;
+        tick = (first + lowestBit(rotate(wheel->occupied[level], (unsigned)first))) << shift;
+        if (tick < best)
+            best = tick;
+    }
+    return best;
+}
+
+/* fires every timer which expires at or before now */
+void timerAdvance(TimerWheel* wheel, unsigned long long now)
+{
+    while (wheel->now <= now) {
+        unsigned long long tick = nextTick(wheel);
+        Timer* expired;
+        int level;
+
+        if (tick > now) {
+            wheel->now = now + 1;
+            break;
+        }
+        wheel->now = tick;
+        for (level = 1; (level < TIMER_LEVELS) && ((tick & ((1ULL << (SHIFT * level)) - 1)) == 0); level++) {
+            if (cascade(wheel, level, tick) != 0)
+                break;
+        }
+        /* detach the slot, callbacks may start and stop any timer */
+        expired = wheel->slot[0][tick & MASK];
+        wheel->slot[0][tick & MASK] = NULL;
+        wheel->occupied[0] &= ~(1ULL << (tick & MASK));
+        if (expired != NULL)
+            expired->prev = &expired;
+        wheel->now = tick + 1;
+        while (expired != NULL) {
+            Timer* timer = expired;
+            *timer->prev = timer->next;
+            if (timer->next != NULL)
+                timer->next->prev = timer->prev;
+            timer->next = NULL;
+            timer->prev = NULL;
+            wheel->count--;
+            timer->callback(timer);
+        }
+    }
+}
+
+void timerInit(TimerWheel* wheel, unsigned long long now)
+{
+    int level, slot;
+
+    assert(wheel != NULL);
+    wheel->now = now;
+    wheel->count = 0;
+    for (level = 0; level < TIMER_LEVELS; level++) {
+        wheel->occupied[level] = 0;
+        for (slot = 0; slot < TIMER_SLOTS; slot++)
+            wheel->slot[level][slot] = NULL;
+    }
+}
+
+/* milliseconds from now to the next timer, 0 if overdue, -1 if none, for poll timeout */
+int timerNext(const TimerWheel* wheel, unsigned long long now)
+{
+    unsigned long long tick = nextTick(wheel);
+
+    if (tick == ULLONG_MAX)
+        return -1;
+    if (tick <= now)
+        return 0;
+    return (tick - now > INT_MAX) ? INT_MAX : (int)(tick - now);
+}
+
+/* monotonic milliseconds */
+unsigned long long timerNow(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* monotonic nanoseconds, for measuring */
+unsigned long long timerNowNs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* expires - absolute ms, restarts the timer if it is scheduled */
+void timerStart(TimerWheel* wheel, Timer* timer, unsigned long long expires)
+{
+    assert((timer != NULL) && (timer->callback != NULL));
+    if (timer->prev != NULL)
+        detach(wheel, timer);
+    else
+        wheel->count++;
+    timer->expires = expires;
+    insert(wheel, timer);
+}
+
+/* does nothing if the timer is not scheduled */
+void timerStop(TimerWheel* wheel, Timer* timer)
+{
+    assert(timer != NULL);
+    if (timer->prev == NULL)
+        return;
+    detach(wheel, timer);
+    wheel->count--;
+}
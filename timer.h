@@ -0,0 +1,34 @@
+#ifndef _TIMER_H
+#define _TIMER_H
+
+#define TIMER_LEVELS 5 /* each level covers 64 times longer span, 2^30 ms in total */
+#define TIMER_SLOTS 64
+
+/* embedded in the owner, scheduled on one wheel at most */
+typedef struct _Timer {
+    struct _Timer* next;
+    struct _Timer** prev; /* NULL if not scheduled */
+    unsigned long long expires; /* ms, see timerNow() */
+    unsigned char level; /* where it is linked */
+    unsigned char slot;
+    void (*callback)(struct _Timer* timer);
+    void* arg; /* for the callback */
+} Timer;
+
+/* hierarchical timing wheel with 1 ms tick, not thread-safe */
+typedef struct _TimerWheel {
+    unsigned long long now; /* next tick to process, earlier ones are done */
+    unsigned long count; /* scheduled timers */
+    unsigned long long occupied[TIMER_LEVELS]; /* bit per non empty slot */
+    Timer* slot[TIMER_LEVELS][TIMER_SLOTS];
+} TimerWheel;
+
+void timerAdvance(TimerWheel* wheel, unsigned long long now);
+void timerInit(TimerWheel* wheel, unsigned long long now);
+int timerNext(const TimerWheel* wheel, unsigned long long now);
+unsigned long long timerNow(void);
+unsigned long long timerNowNs(void);
+void timerStart(TimerWheel* wheel, Timer* timer, unsigned long long expires);
+void timerStop(TimerWheel* wheel, Timer* timer);
+
+#endif /*_TIMER_H */
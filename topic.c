@@ -0,0 +1,317 @@
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "topic.h"
+
+/*
+   A topic keeps its subscribers in a dense array, a subscriber keeps its
+   topics in another one, and every entry knows its position in the other
+   array. Publishing walks one array, subscribe appends to both and
+   unsubscribe moves the last entries into the holes, fixing the one
+   position which points to each of them. A subscriber leaves all of its
+   topics without looking at any other. The link of a subscriber to a
+   topic is found in a hash of pairs, so subscribing twice is noticed and
+   unsubscribing takes constant time however many topics it has.
+*/
+
+#define FIRST_BUCKETS 64
+#define FIRST_SIZE 4
+
+/* FNV-1a */
+static unsigned hashOf(const char* name, unsigned length)
+{
+    unsigned hash = 2166136261u;
+    unsigned i;
+
+    for (i = 0; i < length; i++) {
+        hash ^= (unsigned char)name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/* of the pointers, any bits of them may differ */
+static unsigned long pairHash(const Topic* topic, const TopicSubscriber* subscriber)
+{
+    unsigned long long key = (unsigned long long)(uintptr_t)topic * 0x9e3779b97f4a7c15ull
+        ^ (unsigned long long)(uintptr_t)subscriber;
+
+    key *= 0xbf58476d1ce4e5b9ull;
+    return (unsigned long)(key ^ (key >> 31));
+}
+
+/* slot of the pair, or the free slot where it goes */
+static TopicPair* pairSlot(const TopicIndex* index, const Topic* topic, const TopicSubscriber* subscriber)
+{
+    unsigned long i = pairHash(topic, subscriber) & (index->pairs - 1);
+
+    while ((index->pair[i].topic != NULL)
+            && ((index->pair[i].topic != topic) || (index->pair[i].subscriber != subscriber)))
+        i = (i + 1) & (index->pairs - 1);
+    return &index->pair[i];
+}
+
+/* keeps the pairs at most half full, -1 if out of memory */
+static int pairReserve(TopicIndex* index)
+{
+    unsigned long pairs = (index->pairs == 0) ? FIRST_BUCKETS : index->pairs * 2;
+    TopicPair* old = index->pair;
+    unsigned long i, count = index->pairs;
+
+    if (2 * (index->pairCount + 1) <= index->pairs)
+        return 0;
+    index->pair = calloc(pairs, sizeof(TopicPair));
+    if (index->pair == NULL) {
+        index->pair = old;
+        return -1;
+    }
+    index->pairs = pairs;
+    for (i = 0; i < count; i++)
+        if (old[i].topic != NULL)
+            *pairSlot(index, old[i].topic, old[i].subscriber) = old[i];
+    free(old);
+    return 0;
+}
+
+/* the next pairs of its probe sequence move back into the hole */
+static void pairRemove(TopicIndex* index, TopicPair* hole)
+{
+    unsigned long mask = index->pairs - 1, i = hole - index->pair, j = i, home;
+
+    for ( ; ; ) {
+        j = (j + 1) & mask;
+        if (index->pair[j].topic == NULL)
+            break;
+        home = pairHash(index->pair[j].topic, index->pair[j].subscriber) & mask;
+        if (((j - home) & mask) >= ((j - i) & mask)) { /* its home is not between the hole and it */
+            index->pair[i] = index->pair[j];
+            i = j;
+        }
+    }
+    index->pair[i].topic = NULL;
+    index->pairCount--;
+}
+
+/* makes room for one more entry of elementSize bytes, -1 if out of memory */
+static int reserve(void** array, int count, int* size, size_t elementSize)
+{
+    void* bigger;
+    int wanted;
+
+    if (count < *size)
+        return 0;
+    wanted = (*size == 0) ? FIRST_SIZE : *size * 2;
+    bigger = realloc(*array, wanted * elementSize);
+    if (bigger == NULL)
+        return -1;
+    *array = bigger;
+    *size = wanted;
+    return 0;
+}
+
+/* doubles the buckets, the index works as before if it can't */
+static void rehash(TopicIndex* index)
+{
+    unsigned buckets = (index->buckets == 0) ? FIRST_BUCKETS : index->buckets * 2;
+    Topic** bucket = calloc(buckets, sizeof(Topic*));
+    unsigned i;
+
+    if (bucket == NULL)
+        return;
+    for (i = 0; i < index->buckets; i++) {
+        while (index->bucket[i] != NULL) {
+            Topic* topic = index->bucket[i];
+            index->bucket[i] = topic->next;
+            topic->next = bucket[topic->hash & (buckets - 1)];
+            bucket[topic->hash & (buckets - 1)] = topic;
+        }
+    }
+    free(index->bucket);
+    index->bucket = bucket;
+    index->buckets = buckets;
+}
+
+static Topic* create(TopicIndex* index, const char* name, unsigned length, unsigned hash)
+{
+    Topic* topic;
+
+    if (index->count >= index->buckets)
+        rehash(index);
+    if (index->buckets == 0)
+        return NULL;
+    topic = malloc(offsetof(Topic, name) + length);
+    if (topic == NULL)
+        return NULL;
+    topic->hash = hash;
+    topic->length = length;
+    topic->member = NULL;
+    topic->count = topic->size = 0;
+    memcpy(topic->name, name, length);
+    topic->next = index->bucket[hash & (index->buckets - 1)];
+    index->bucket[hash & (index->buckets - 1)] = topic;
+    index->count++;
+    return topic;
+}
+
+static void destroy(TopicIndex* index, Topic* topic)
+{
+    Topic** prev = &index->bucket[topic->hash & (index->buckets - 1)];
+
+    while (*prev != topic)
+        prev = &(*prev)->next;
+    *prev = topic->next;
+    index->count--;
+    free(topic->member);
+    free(topic);
+}
+
+/* removes link i of the subscriber, the topic goes with its last subscriber */
+static void leave(TopicIndex* index, TopicSubscriber* subscriber, int i)
+{
+    Topic* topic = subscriber->link[i].topic;
+    int position = subscriber->link[i].position;
+
+    pairRemove(index, pairSlot(index, topic, subscriber));
+    if (position != --topic->count) { /* the last member fills the hole */
+        TopicMember* last = &topic->member[topic->count];
+        topic->member[position] = *last;
+        last->subscriber->link[last->position].position = position;
+    }
+    if (i != --subscriber->count) { /* and the last link */
+        TopicLink* last = &subscriber->link[subscriber->count];
+        subscriber->link[i] = *last;
+        last->topic->member[last->position].position = i;
+        pairSlot(index, last->topic, subscriber)->position = i;
+    }
+    if (topic->count == 0)
+        destroy(index, topic);
+}
+
+/* frees every topic, subscribers must not be used with the index any more */
+void topicClear(TopicIndex* index)
+{
+    unsigned i;
+
+    assert(index != NULL);
+    for (i = 0; i < index->buckets; i++) {
+        while (index->bucket[i] != NULL) {
+            Topic* topic = index->bucket[i];
+            index->bucket[i] = topic->next;
+            free(topic->member);
+            free(topic);
+        }
+    }
+    free(index->bucket);
+    free(index->pair);
+    topicInit(index);
+}
+
+/* NULL if nobody is subscribed */
+Topic* topicFind(const TopicIndex* index, const char* name, unsigned length)
+{
+    unsigned hash;
+    Topic* topic;
+
+    assert(index != NULL);
+    if (index->count == 0)
+        return NULL;
+    hash = hashOf(name, length);
+    for (topic = index->bucket[hash & (index->buckets - 1)]; topic != NULL; topic = topic->next)
+        if ((topic->hash == hash) && (topic->length == length) && (memcmp(topic->name, name, length) == 0))
+            return topic;
+    return NULL;
+}
+
+void topicInit(TopicIndex* index)
+{
+    assert(index != NULL);
+    index->bucket = NULL;
+    index->buckets = 0;
+    index->count = 0;
+    index->pair = NULL;
+    index->pairs = index->pairCount = 0;
+}
+
+/*
+Adds the subscriber to the topic, the topic is created by its first one.
+Returns 0 if added, 1 if it is already there, -1 if out of memory.
+*/
+int topicSubscribe(TopicIndex* index, TopicSubscriber* subscriber, const char* name, unsigned length)
+{
+    TopicPair* pair;
+    Topic* topic;
+
+    assert((index != NULL) && (subscriber != NULL));
+    if (pairReserve(index) == -1)
+        return -1;
+    topic = topicFind(index, name, length);
+    if (topic != NULL) {
+        if (pairSlot(index, topic, subscriber)->topic != NULL)
+            return 1;
+    } else {
+        topic = create(index, name, length, hashOf(name, length));
+        if (topic == NULL)
+            return -1;
+    }
+    if ((reserve((void**)&topic->member, topic->count, &topic->size, sizeof(TopicMember)) == -1)
+            || (reserve((void**)&subscriber->link, subscriber->count, &subscriber->size, sizeof(TopicLink)) == -1)) {
+        if (topic->count == 0)
+            destroy(index, topic);
+        return -1;
+    }
+    topic->member[topic->count].subscriber = subscriber;
+    topic->member[topic->count].position = subscriber->count;
+    subscriber->link[subscriber->count].topic = topic;
+    subscriber->link[subscriber->count].position = topic->count;
+    pair = pairSlot(index, topic, subscriber);
+    pair->topic = topic;
+    pair->subscriber = subscriber;
+    pair->position = subscriber->count;
+    index->pairCount++;
+    topic->count++;
+    subscriber->count++;
+    return 0;
+}
+
+/* frees the links of a subscriber which has left all topics */
+void topicSubscriberClear(TopicSubscriber* subscriber)
+{
+    assert((subscriber != NULL) && (subscriber->count == 0));
+    free(subscriber->link);
+    topicSubscriberInit(subscriber);
+}
+
+void topicSubscriberInit(TopicSubscriber* subscriber)
+{
+    assert(subscriber != NULL);
+    subscriber->link = NULL;
+    subscriber->count = subscriber->size = 0;
+}
+
+/* returns 0 if removed, -1 if it is not subscribed */
+int topicUnsubscribe(TopicIndex* index, TopicSubscriber* subscriber, const char* name, unsigned length)
+{
+    TopicPair* pair;
+    Topic* topic;
+
+    assert((index != NULL) && (subscriber != NULL));
+    topic = topicFind(index, name, length);
+    if (topic == NULL)
+        return -1;
+    pair = pairSlot(index, topic, subscriber);
+    if (pair->topic == NULL)
+        return -1;
+    leave(index, subscriber, pair->position);
+    return 0;
+}
+
+/* the links are kept for the next topics of the subscriber */
+void topicUnsubscribeAll(TopicIndex* index, TopicSubscriber* subscriber)
+{
+    assert((index != NULL) && (subscriber != NULL));
+    while (subscriber->count > 0) /* the last one, nothing moves */
+        leave(index, subscriber, subscriber->count - 1);
+}
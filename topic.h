@@ -0,0 +1,59 @@
+#ifndef _TOPIC_H
+#define _TOPIC_H
+
+struct _Topic;
+
+/* one topic of a subscriber, see TopicSubscriber */
+typedef struct _TopicLink {
+    struct _Topic* topic;
+    int position; /* in topic->member */
+} TopicLink;
+
+/* embedded in the owner, knows its topics, so leaving all of them needs no scan */
+typedef struct _TopicSubscriber {
+    TopicLink* link; /* topics subscribed, in no order */
+    int count, size;
+} TopicSubscriber;
+
+/* one subscriber of a topic, see Topic */
+typedef struct _TopicMember {
+    TopicSubscriber* subscriber;
+    int position; /* in subscriber->link */
+} TopicMember;
+
+/* dense array of subscribers, freed when the last one leaves */
+typedef struct _Topic {
+    struct _Topic* next; /* in the hash chain */
+    unsigned hash;
+    unsigned length;
+    TopicMember* member;
+    int count, size;
+    char name[1]; /* length bytes, allocated with the topic */
+} Topic;
+
+/* finds the link of a subscriber to a topic, see TopicIndex */
+typedef struct _TopicPair {
+    Topic* topic; /* NULL if the slot is free */
+    TopicSubscriber* subscriber;
+    int position; /* in subscriber->link */
+} TopicPair;
+
+/* topics by name, not thread-safe */
+typedef struct _TopicIndex {
+    Topic** bucket; /* power of two chains */
+    unsigned buckets;
+    unsigned long count; /* topics with subscribers */
+    TopicPair* pair; /* power of two slots, open addressing */
+    unsigned long pairs, pairCount;
+} TopicIndex;
+
+void topicClear(TopicIndex* index);
+Topic* topicFind(const TopicIndex* index, const char* name, unsigned length);
+void topicInit(TopicIndex* index);
+int topicSubscribe(TopicIndex* index, TopicSubscriber* subscriber, const char* name, unsigned length);
+void topicSubscriberClear(TopicSubscriber* subscriber);
+void topicSubscriberInit(TopicSubscriber* subscriber);
+int topicUnsubscribe(TopicIndex* index, TopicSubscriber* subscriber, const char* name, unsigned length);
+void topicUnsubscribeAll(TopicIndex* index, TopicSubscriber* subscriber);
+
+#endif /*_TOPIC_H */
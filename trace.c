@@ -0,0 +1,97 @@
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+/*
+   Tracing costs a store of 32 bytes and a counter increment, no locks,
+   no formatting and no system calls. Records share the timestamp of
+   the wakeup, the order inside one wakeup is the order in the ring.
+   A dump is formatted later by tracedump.c.
+*/
+
+#define MASK (TRACE_RECORDS - 1)
+
+static const char* names[TRACE_EVENTS] = {
+    "?", "wait", "wakeup", "accept", "recv", "send", "queue", "close",
+    "timeout", "slow", "pause", "resume", "drop", "broadcast", "timer",
+    "connect", "relay"
+};
+
+void traceAdd(TraceRing* ring, unsigned event, int fd, long long a, long long b)
+{
+    unsigned long long head = ring->head;
+    TraceRecord* record = &ring->record[head & MASK];
+
+    record->time = ring->now;
+    record->event = event;
+    record->fd = fd;
+    record->arg[0] = a;
+    record->arg[1] = b;
+    /* readers in other threads or signal handlers see whole records */
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/* now - ns of the current wakeup */
+void traceClock(TraceRing* ring, unsigned long long now)
+{
+    ring->now = now;
+}
+
+const char* traceEventName(unsigned event)
+{
+    return (event < TRACE_EVENTS) ? names[event] : names[0];
+}
+
+void traceInit(TraceRing* ring, int id)
+{
+    assert((TRACE_RECORDS & MASK) == 0);
+    ring->head = 0;
+    ring->now = 0;
+    ring->id = id;
+}
+
+static int writeAll(int fd, const void* data, unsigned long size)
+{
+    const char* p = data;
+
+    while (size > 0) {
+        ssize_t rc = write(fd, p, size);
+        if (rc == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += rc;
+        size -= rc;
+    }
+    return 0;
+}
+
+/*
+Writes a header and the kept records, the oldest first.
+Only write(2) is called, so it may be used from a signal handler.
+*/
+int traceWrite(const TraceRing* ring, int fd)
+{
+    TraceHeader header;
+    unsigned long long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    unsigned count = (head < TRACE_RECORDS) ? (unsigned)head : TRACE_RECORDS;
+    unsigned first = (unsigned)((head - count) & MASK);
+    unsigned part = (first + count > TRACE_RECORDS) ? TRACE_RECORDS - first : count;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_VERSION;
+    header.recordSize = sizeof(TraceRecord);
+    header.id = ring->id;
+    header.count = count;
+    header.head = head;
+    if ((writeAll(fd, &header, sizeof(header)) == -1)
+            || (writeAll(fd, &ring->record[first], part * sizeof(TraceRecord)) == -1)
+            || (writeAll(fd, &ring->record[0], (count - part) * sizeof(TraceRecord)) == -1))
+        return -1;
+    return 0;
+}
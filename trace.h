@@ -0,0 +1,66 @@
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#define TRACE_RECORDS 4096 /* kept per ring, power of two */
+#define TRACE_MAGIC "SELTRACE"
+#define TRACE_VERSION 1
+
+/* events, arguments are in brackets */
+#define TRACE_WAIT 1 /* going to poll (timeout ms) */
+#define TRACE_WAKEUP 2 /* back from poll (ready events, us waited) */
+#define TRACE_ACCEPT 3 /* fd accepted (slot, serial), or the listen fd failed (-errno) */
+#define TRACE_RECV 4 /* (bytes or -errno, 0 on EOF) */
+#define TRACE_SEND 5 /* (bytes or -errno, iovec count) */
+#define TRACE_QUEUE 6 /* output queued (bytes, queued in total) */
+#define TRACE_CLOSE 7 /* (socketClose rc, output bytes lost) */
+#define TRACE_TIMEOUT 8 /* closed by its timer (SELECT_TIMEOUT_XXX or 0 if slow, queued in total) */
+#define TRACE_SLOW 9 /* above the high watermark (SELECT_SLOW_XXX, queued in total) */
+#define TRACE_PAUSE 10 /* fd stops reading (for fd) */
+#define TRACE_RESUME 11 /* fd reads again */
+#define TRACE_DROP 12 /* output not queued (bytes) */
+#define TRACE_BROADCAST 13 /* (connections, bytes) */
+#define TRACE_TIMER 14 /* SelectTimer fired (period ms) */
+#define TRACE_CONNECT 15 /* selectConnect completed (0 or -errno, 1 if reused) */
+#define TRACE_RELAY 16 /* selectRelay started (fd of the other end, 1 if by splice) */
+#define TRACE_EVENTS 17 /* number of event ids */
+
+/* fixed size, written by the owner of the ring only */
+typedef struct _TraceRecord {
+    unsigned long long time; /* ns, monotonic, of the wakeup it belongs to */
+    unsigned event; /* TRACE_XXX */
+    int fd; /* -1 if none */
+    long long arg[2];
+} TraceRecord;
+
+/* one writer, readers may only copy it, the oldest records get overwritten */
+typedef struct _TraceRing {
+    unsigned long long head; /* records written so far */
+    unsigned long long now; /* ns, stamped on new records, see traceClock() */
+    int id; /* tells apart rings in a dump */
+    TraceRecord record[TRACE_RECORDS];
+} TraceRing;
+
+/* precedes the records of one ring in a dump, native byte order */
+typedef struct _TraceHeader {
+    char magic[8]; /* TRACE_MAGIC without '\0' */
+    unsigned version;
+    unsigned recordSize;
+    int id;
+    unsigned count; /* records following, the oldest first */
+    unsigned long long head;
+} TraceHeader;
+
+#if defined(NOTRACE) /* arguments are not evaluated, but still count as used */
+    #define traceEvent(ring, event, fd, a, b) \
+        ((void)(sizeof(ring) + sizeof(event) + sizeof(fd) + sizeof(a) + sizeof(b)))
+#else
+    #define traceEvent(ring, event, fd, a, b) traceAdd(ring, event, fd, a, b)
+#endif
+
+void traceAdd(TraceRing* ring, unsigned event, int fd, long long a, long long b);
+void traceClock(TraceRing* ring, unsigned long long now);
+const char* traceEventName(unsigned event);
+void traceInit(TraceRing* ring, int id);
+int traceWrite(const TraceRing* ring, int fd);
+
+#endif /*_TRACE_H */
@@ -0,0 +1,64 @@
+/*
+   Prints trace records written by selectTraceDump(), one per line:
+   loop, seconds since the first record of the loop, event, fd, arguments.
+   See trace.h for the meaning of arguments of every event.
+   To compile:
+   $ gcc -otracedump tracedump.c trace.c
+   To run:
+   $ ./tracedump srv.trace
+   The dump must come from a machine with the same byte order.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace.h"
+
+static int dump(FILE* file, const char* name)
+{
+    TraceHeader header;
+    TraceRecord record;
+    unsigned i;
+
+    while (fread(&header, sizeof(header), 1, file) == 1) {
+        unsigned long long first = 0;
+        if ((memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0)
+                || (header.version != TRACE_VERSION) || (header.recordSize != sizeof(record))) {
+            fprintf(stderr, "%s: not a trace of this version\n", name);
+            return -1;
+        }
+        printf("# loop %d: %u of %llu records\n", header.id, header.count, header.head);
+        for (i = 0; i < header.count; i++) {
+            if (fread(&record, sizeof(record), 1, file) != 1) {
+                fprintf(stderr, "%s: truncated\n", name);
+                return -1;
+            }
+            if (i == 0)
+                first = record.time;
+            printf("%d %llu.%09llu %-9s %d %lld %lld\n", header.id,
+                (record.time - first) / 1000000000ULL, (record.time - first) % 1000000000ULL,
+                traceEventName(record.event), record.fd, record.arg[0], record.arg[1]);
+        }
+    }
+    return ferror(file) ? -1 : 0;
+}
+
+int main(int argc, char* argv[])
+{
+    FILE* file;
+    int rc;
+
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s <trace file>\n", argv[0]);
+        return 1;
+    }
+    file = fopen(argv[1], "rb");
+    if (file == NULL) {
+        perror(argv[1]);
+        return 1;
+    }
+    rc = dump(file, argv[1]);
+    fclose(file);
+    return (rc == 0) ? 0 : 1;
+}